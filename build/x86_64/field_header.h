@@ -0,0 +1 @@
+#include "socket_server.h"
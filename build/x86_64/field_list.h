@@ -0,0 +1,17 @@
+OFFSET(sample_frequency),
+OFFSET(earliest),
+OFFSET(latest),
+OFFSET(first_decimation),
+OFFSET(second_decimation),
+OFFSET(live_decimation),
+OFFSET(fa_entry_count),
+OFFSET(events_fa_id),
+OFFSET(status_valid),
+OFFSET(link_status),
+OFFSET(link_partner),
+OFFSET(last_interrupt),
+OFFSET(frame_errors),
+OFFSET(soft_errors),
+OFFSET(hard_errors),
+OFFSET(running),
+OFFSET(overrun),
@@ -30,14 +30,33 @@ DEFAULT_SERVER = 'fa-archiver.diamond.ac.uk'
 DEFAULT_PORT = 8888
 
 import re
+import struct
+import collections
 import numpy
 import cothread
 from cothread import cosocket
 
 
 __all__ = [
-    'connection', 'subscription', 'get_sample_frequency', 'get_decimation',
-    'Server']
+    'connection', 'subscription', 'multiplexed', 'get_sample_frequency',
+    'get_decimation', 'Server']
+
+
+# Frame types for protocol version 2, see multiplexed below.
+MUX_COMMAND = 1
+MUX_CANCEL = 2
+MUX_PARAMETERS = 3
+MUX_DATA = 4
+MUX_END = 5
+
+# Reply to MUX_PARAMETERS, as returned by multiplexed.parameters().  The
+# sniffer status fields are only meaningful if status_valid is set.
+PARAMETERS_FORMAT = '<dQQIIIIi9I'
+parameters = collections.namedtuple('parameters', [
+    'sample_frequency', 'earliest', 'latest', 'first_decimation',
+    'second_decimation', 'live_decimation', 'fa_entry_count', 'events_fa_id',
+    'status_valid', 'link_status', 'link_partner', 'last_interrupt',
+    'frame_errors', 'soft_errors', 'hard_errors', 'running', 'overrun'])
 
 
 def format_mask(mask):
@@ -65,6 +84,71 @@ def format_mask(mask):
     return count, ','.join(ranges)
 
 
+def lz4_decompress(payload, length):
+    '''Decompresses a block in LZ4 block format which must decode to exactly
+    length bytes.'''
+    payload = bytearray(payload)
+    result = bytearray()
+    ip = 0
+    def read_length(ip, value):
+        while True:
+            byte = payload[ip]
+            ip += 1
+            value += byte
+            if byte != 255:
+                return ip, value
+    while ip < len(payload):
+        token = payload[ip]
+        ip += 1
+        literals = token >> 4
+        if literals == 15:
+            ip, literals = read_length(ip, literals)
+        result += payload[ip:ip + literals]
+        ip += literals
+        if ip >= len(payload):
+            break
+        offset = payload[ip] | payload[ip + 1] << 8
+        ip += 2
+        match = token & 15
+        if match == 15:
+            ip, match = read_length(ip, match)
+        match += 4
+        start = len(result) - offset
+        assert offset > 0 and start >= 0, 'Corrupt compressed frame'
+        if match <= offset:
+            result += result[start:start + match]
+        else:
+            # Overlapping match repeats the last offset bytes
+            for i in range(match):
+                result.append(result[start + i])
+    assert len(result) == length, 'Corrupt compressed frame'
+    return result
+
+
+def decode_frame(raw_length, encoded_length, stride, payload):
+    '''Decodes a single frame of compressed data, see encode.h in the archiver
+    sources for the format.'''
+    if raw_length == encoded_length:
+        return payload
+
+    shuffled = lz4_decompress(payload, raw_length)
+    words = raw_length // 4
+    planes = numpy.frombuffer(
+        bytes(shuffled[:4 * words]), dtype = numpy.uint8).reshape(4, words)
+    data = numpy.zeros(words, dtype = numpy.uint32)
+    for i in range(4):
+        data |= planes[i].astype(numpy.uint32) << (8 * i)
+    if stride:
+        # Undo the delta encoding by summing down the columns of lines
+        lines = -(-words // stride)
+        padded = numpy.zeros(lines * stride, dtype = numpy.uint32)
+        padded[:words] = data
+        padded = padded.reshape(lines, stride).cumsum(
+            axis = 0, dtype = numpy.uint32)
+        data = padded.reshape(-1)[:words]
+    return data.tostring() + bytes(shuffled[4 * words:])
+
+
 class connection:
     class EOF(Exception):
         pass
@@ -97,6 +181,21 @@ class connection:
                 break
         return ''.join(result)
 
+    def recv_exact(self, length):
+        result = []
+        while length > 0:
+            chunk = connection.recv(self, length)
+            result.append(chunk)
+            length -= len(chunk)
+        return ''.join(result)
+
+    def recv_decoded(self, block_size = None):
+        '''Reads and decodes one frame of compressed data.'''
+        raw_length, encoded_length, stride = \
+            struct.unpack('<III', self.recv_exact(12))
+        payload = self.recv_exact(encoded_length)
+        return decode_frame(raw_length, encoded_length, stride, payload)
+
     def read_block(self, length):
         result = numpy.empty(length, dtype = numpy.int8)
         rx = 0
@@ -127,7 +226,8 @@ class subscription(connection):
     connection to the server doesn't overflow.
     '''
 
-    def __init__(self, mask, decimated=False, uncork=False, **kargs):
+    def __init__(self, mask, decimated=False, uncork=False, compressed=False,
+            **kargs):
         connection.__init__(self, **kargs)
         self.count, format = format_mask(mask)
         self.decimated = decimated
@@ -135,10 +235,14 @@ class subscription(connection):
         flags = ''
         if uncork: flags = flags + 'U'
         if decimated: flags = flags + 'D'
+        if compressed: flags = flags + 'X'
         self.sock.send('S%s%s\n' % (format, flags))
         c = self.recv(1)
         if c != chr(0):
             raise self.Error((c + self.recv())[:-1])    # Discard trailing \n
+        if compressed:
+            # All data following the initial response is sent in frames.
+            self.recv = self.recv_decoded
 
     def read(self, samples):
         '''Returns a waveform of samples indexed by sample count, bpm count
@@ -151,6 +255,156 @@ class subscription(connection):
         return array.reshape((samples, self.count, 2))
 
 
+class mux_request:
+    '''A single command in progress on a multiplexed connection, created by
+    calling multiplexed.request().  The response is read in pieces with recv(),
+    which returns an empty string once the response is complete.  If a timeout
+    was given and no part of the response arrives in time the request is
+    cancelled, and the response then ends early with cancelled set.'''
+
+    def __init__(self, mux, request_id, timeout = None):
+        self.mux = mux
+        self.request_id = request_id
+        self.timeout = timeout
+        self.queue = cothread.EventQueue()
+        self.done = False
+        self.cancelled = False
+
+    def recv(self):
+        if self.done:
+            return ''
+        try:
+            chunk = self.queue.Wait(None if self.cancelled else self.timeout)
+        except cothread.Timedout:
+            # The server ends the response promptly once cancelled.
+            self.cancel()
+            chunk = self.queue.Wait()
+        if chunk is None:
+            self.done = True
+            return ''
+        else:
+            return chunk
+
+    def recv_all(self):
+        result = []
+        while True:
+            chunk = self.recv()
+            if chunk:
+                result.append(chunk)
+            else:
+                break
+        return ''.join(result)
+
+    def cancel(self):
+        '''Asks the server to abandon the request.  Any data already sent is
+        still delivered before the response completes.'''
+        if not self.done and not self.cancelled:
+            self.cancelled = True
+            self.mux.send_frame(self.request_id, MUX_CANCEL)
+
+
+class multiplexed:
+    '''m = multiplexed(server, port)
+
+    Opens a persistent connection to the server using protocol version 2, over
+    which any number of commands can be in progress at once.  Each command is
+    started with m.request() and its response read from the returned request,
+    or m.command() can be used to run a command and return its whole response.
+    m.parameters() returns the main server parameters without parsing text.
+
+    The timeout given here only applies to opening the connection.  After that
+    responses are waited for without limit, as a read can wait its turn for
+    the server's buffers, unless a timeout is given for the request itself.'''
+
+    class Error(Exception):
+        pass
+
+
+    def __init__(self,
+            server = DEFAULT_SERVER, port = DEFAULT_PORT, timeout = 1):
+        self.sock = cosocket.socket()
+        self.sock.connect((server, port))
+        self.sock.settimeout(timeout)
+        self.sock.send('M\n')
+        c = self.sock.recv(1)
+        if c != chr(0):
+            # Servers without protocol version 2 reject the M command.
+            message = (c + self.sock.recv(1024))[:-1]
+            self.sock.close()
+            raise self.Error(message)
+        self.sock.settimeout(None)
+
+        self.next_id = 0
+        self.requests = {}
+        self.closed = False
+        cothread.Spawn(self.__receiver)
+
+    def close(self):
+        self.closed = True
+        self.sock.close()
+
+    def send_frame(self, request_id, type, payload = ''):
+        self.sock.sendall(
+            struct.pack('<III', len(payload), request_id, type) + payload)
+
+    def __start(self, type, payload = '', timeout = None):
+        if self.closed:
+            raise self.Error('Connection closed')
+        request_id = self.next_id
+        self.next_id = (self.next_id + 1) & 0xFFFFFFFF
+        request = mux_request(self, request_id, timeout)
+        self.requests[request_id] = request
+        self.send_frame(request_id, type, payload)
+        return request
+
+    def request(self, command, timeout = None):
+        '''Starts the given command, written exactly as for a connection of its
+        own, and returns a mux_request for reading the response.  If timeout is
+        given the request is cancelled if no part of the response arrives
+        within this many seconds.'''
+        return self.__start(MUX_COMMAND, command, timeout)
+
+    def command(self, command, timeout = None):
+        return self.request(command, timeout).recv_all()
+
+    def parameters(self):
+        '''Returns a parameters tuple, with timestamps in microseconds.'''
+        payload = self.__start(MUX_PARAMETERS).recv_all()
+        return parameters._make(struct.unpack(PARAMETERS_FORMAT, payload))
+
+    def __recv_exact(self, length):
+        result = []
+        while length > 0:
+            chunk = self.sock.recv(length)
+            if not chunk:
+                raise connection.EOF('Connection closed by server')
+            result.append(chunk)
+            length -= len(chunk)
+        return ''.join(result)
+
+    def __receiver(self):
+        try:
+            while True:
+                length, request_id, type = \
+                    struct.unpack('<III', self.__recv_exact(12))
+                payload = self.__recv_exact(length)
+                request = self.requests.get(request_id)
+                if request is None:
+                    pass
+                elif type == MUX_END:
+                    del self.requests[request_id]
+                    request.queue.Signal(None)
+                else:
+                    request.queue.Signal(payload)
+        except Exception:
+            # Whatever the reason, the connection is finished.  Complete all
+            # outstanding requests so that nobody waits for them.
+            self.closed = True
+            for request in self.requests.values():
+                request.queue.Signal(None)
+            self.requests = {}
+
+
 def server_command(command, **kargs):
     server = connection(**kargs)
     server.sock.send(command)
@@ -170,7 +424,9 @@ def get_fa_ids(**kargs):
     containing the following fields:
         (fa_id, description, archived)
     '''
-    raw_list = server_command('CL\n', **kargs)
+    return parse_fa_ids(server_command('CL\n', **kargs))
+
+def parse_fa_ids(raw_list):
     result = []
     line_match = re.compile('^( |\*)([0-9]+) (.*) (.*) (.*)$')
     for line in raw_list.split('\n')[:-1]:
@@ -194,16 +450,33 @@ class Server:
         self.port = port
         self.fa_ids = None
 
-        response = self.server_command('CFCK\n').split('\n')
-        self.sample_frequency = float(response[0])
-        self.decimation = int(response[1])
+        # Use a single persistent connection for all commands if the server
+        # supports it, otherwise fall back to a connection per command.
         try:
-            self.fa_id_count = int(response[2])
-        except ValueError:
-            self.fa_id_count = 256      # If server responds with error message
+            self.mux = multiplexed(server = server, port = port)
+        except multiplexed.Error:
+            self.mux = None
+
+        if self.mux:
+            parameters = self.mux.parameters()
+            self.sample_frequency = parameters.sample_frequency
+            self.decimation = parameters.live_decimation
+            self.fa_id_count = parameters.fa_entry_count
+        else:
+            response = self.server_command('CFCK\n').split('\n')
+            self.sample_frequency = float(response[0])
+            self.decimation = int(response[1])
+            try:
+                self.fa_id_count = int(response[2])
+            except ValueError:
+                self.fa_id_count = 256  # If server responds with error message
 
     def server_command(self, command):
-        return server_command(command, server = self.server, port = self.port)
+        if self.mux:
+            return self.mux.command(command)
+        else:
+            return server_command(
+                command, server = self.server, port = self.port)
 
     def subscription(self, mask, **kargs):
         return subscription(
@@ -214,7 +487,7 @@ class Server:
         list is filtered to return only archived ids.  If missing is set then
         names are synthesised where they are missing.'''
         if self.fa_ids is None:
-            self.fa_ids = get_fa_ids(server = self.server, port = self.port)
+            self.fa_ids = parse_fa_ids(self.server_command('CL\n'))
 
         if stored:
             # Filter out only the ids which are archived
@@ -50,6 +50,9 @@
 #include "mask.h"
 #include "disk.h"
 #include "disk_writer.h"
+#include "list.h"
+#include "disk_reader.h"
+#include "hot_cache.h"
 #include "socket_server.h"
 #include "archiver.h"
 #include "parse.h"
@@ -114,6 +117,22 @@ static const char *server_bind_address = NULL;
 static const char *server_name = "";
 /* If non zero, identifies FA id used for event stream. */
 static unsigned int events_fa_id = (unsigned int) -1;
+/* Number of archive reads run in parallel. */
+static unsigned int read_queue_depth = 4;
+/* Size of shared block cache in megabytes. */
+static unsigned int block_cache_size = 256;
+/* Size of read buffer pool in complete sets of ids. */
+static unsigned int buffer_sets = 2;
+/* Seconds a read will wait for buffers before giving up. */
+static unsigned int admission_timeout = 10;
+/* Reads admitted at once from a single client host, 0 for no limit. */
+static unsigned int client_limit = 0;
+/* Size of cache of recently written blocks in bytes. */
+static uint64_t hot_cache_size = 0;
+/* Number of threads serving reads and other commands. */
+static unsigned int read_workers = 32;
+/* Maximum number of subscriptions served at once. */
+static unsigned int subscribers = 128;
 
 
 static void usage(void)
@@ -143,7 +162,16 @@ static void usage(void)
 "    -G   Use gigabit ethernet as data source\n"
 "    -S:  Specify the gigabit ethernet data source socket (default 2048)\n"
 "    -N   Run without data source, archive effectively read-only\n"
-        , argv0, buffer_blocks);
+"    -Q:  Specify number of archive reads run in parallel (default %u)\n"
+"    -K:  Specify size of shared block cache in MB, 0 to disable (default %u)\n"
+"    -H:  Specify size of recent history cache, eg 4G (default disabled)\n"
+"    -P:  Specify size of read buffer pool in sets of ids (default %u)\n"
+"    -W:  Specify seconds a read waits for buffers (default %u)\n"
+"    -L:  Limit concurrent reads from one client host (default no limit)\n"
+"    -w:  Specify number of threads serving reads (default %u)\n"
+"    -u:  Specify maximum number of subscriptions (default %u)\n"
+        , argv0, buffer_blocks, read_queue_depth, block_cache_size,
+        buffer_sets, admission_timeout, read_workers, subscribers);
 }
 
 
@@ -162,7 +190,8 @@ static bool process_options(int *argc, char ***argv)
     bool ok = true;
     while (ok)
     {
-        switch (getopt(*argc, *argv, "+hc:l:n:d:rb:qtDp:s:F:E:B:XRGS:N"))
+        switch (getopt(*argc, *argv,
+                "+hc:l:n:d:rb:qtDp:s:F:E:B:XRGS:NQ:K:H:P:W:L:w:u:"))
         {
             case 'h':   usage();                                    exit(0);
             case 'c':   decimation_config = optarg;                 break;
@@ -198,6 +227,40 @@ static bool process_options(int *argc, char ***argv)
                 ok = DO_PARSE("input data socket",
                     parse_int, optarg, &gigabit_port);
                 break;
+            case 'Q':
+                ok = DO_PARSE("read queue depth",
+                    parse_uint, optarg, &read_queue_depth);
+                break;
+            case 'K':
+                ok = DO_PARSE("block cache size",
+                    parse_uint, optarg, &block_cache_size);
+                break;
+            case 'H':
+                ok = DO_PARSE("hot cache size",
+                    parse_size64, optarg, &hot_cache_size);
+                break;
+            case 'P':
+                ok = DO_PARSE("buffer pool size",
+                    parse_uint, optarg, &buffer_sets)  &&
+                    TEST_OK_(buffer_sets > 0, "Buffer pool too small");
+                break;
+            case 'W':
+                ok = DO_PARSE("admission timeout",
+                    parse_uint, optarg, &admission_timeout);
+                break;
+            case 'L':
+                ok = DO_PARSE("client read limit",
+                    parse_uint, optarg, &client_limit);
+                break;
+            case 'w':
+                ok = DO_PARSE("read workers",
+                    parse_uint, optarg, &read_workers)  &&
+                    TEST_OK_(read_workers > 0, "Need at least one read worker");
+                break;
+            case 'u':
+                ok = DO_PARSE("subscriptions",
+                    parse_uint, optarg, &subscribers);
+                break;
             default:
                 fprintf(stderr, "Try `%s -h` for usage\n", argv0);
                 return false;
@@ -365,6 +428,7 @@ static void run_archiver(void)
     if (decimation_config)
         terminate_decimation();
     terminate_disk_writer();
+    terminate_disk_reader();
     if (pid_filename)
         IGNORE(TEST_IO(unlink(pid_filename)));
     log_message("Shut Down");
@@ -394,8 +458,12 @@ int main(int argc, char **argv)
         initialise_sniffer(fa_block_buffer, fa_entry_count)  &&
         initialise_server(
             fa_block_buffer, decimated_buffer, events_fa_id, server_name,
-            server_bind_address, server_socket, extra_commands, reuseaddr)  &&
-        initialise_reader(output_filename)  &&
+            server_bind_address, server_socket, extra_commands, reuseaddr,
+            read_workers, subscribers)  &&
+        initialise_hot_cache(hot_cache_size)  &&
+        initialise_reader(
+            output_filename, read_queue_depth, block_cache_size,
+            buffer_sets, admission_timeout, client_limit)  &&
 
         maybe_daemonise()  &&
         initialise_signals()  &&
@@ -404,6 +472,7 @@ int main(int argc, char **argv)
          * course threads don't survive across the daemon() call!  Alas, this
          * means that many startup errors go into syslog rather than stderr. */
         start_disk_writer(fa_block_buffer)  &&
+        start_disk_reader()  &&
         start_sniffer(boost_priority)  &&
         IF_(decimation_config, start_decimation())  &&
         start_server()  &&
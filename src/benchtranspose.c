@@ -0,0 +1,205 @@
+/* Benchmark of read data transposition against the original loops.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Times fa_write_lines() and d_write_lines() against the simple loops they
+ * replaced, kept here as the reference, and checks that both produce exactly
+ * the same output.  Exits with a non zero status if any result differs. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "disk.h"
+#include "pool.h"
+#include "transpose.h"
+
+
+/* Number of lines transposed by each call, and the offset into the buffers of
+ * the first line.  The odd line count exercises the tail handling. */
+#define LINE_COUNT      8191
+#define OFFSET          3
+/* Each test is repeated until the reference and the new version together have
+ * run for at least twice this long, and the fastest run of each is reported. */
+#define MIN_RUN_TIME    0.2
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Reference implementations. */
+
+static void reference_fa_write_lines(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset,
+    unsigned int data_mask, void *p)
+{
+    struct fa_entry *output = (struct fa_entry *) p;
+    for (unsigned int l = 0; l < line_count; l ++)
+    {
+        for (unsigned int i = 0; i < field_count; i ++)
+            *output++ = ((struct fa_entry *) read_buffers->buffers[i])[offset];
+        offset += 1;
+    }
+}
+
+static void reference_d_write_lines(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset,
+    unsigned int data_mask, void *p)
+{
+    struct fa_entry *output = (struct fa_entry *) p;
+    for (unsigned int l = 0; l < line_count; l ++)
+    {
+        for (unsigned int i = 0; i < field_count; i ++)
+        {
+            struct fa_entry *input = (struct fa_entry *)
+                &((struct decimated_data *) read_buffers->buffers[i])[offset];
+            if (data_mask & 1)  *output++ = input[0];
+            if (data_mask & 2)  *output++ = input[1];
+            if (data_mask & 4)  *output++ = input[2];
+            if (data_mask & 8)  *output++ = input[3];
+        }
+        offset += 1;
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Timing. */
+
+typedef void reference_t(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset,
+    unsigned int data_mask, void *p);
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
+
+/* Times the reference and the new transposition alternately, so that both see
+ * the same state of the machine, and returns the fastest time in ms of each. */
+static void time_write_lines(
+    write_lines_t write_lines, reference_t *reference,
+    unsigned int field_count, struct read_buffers *buffers,
+    unsigned int data_mask, void *expected, void *result,
+    double *t_reference, double *t_new)
+{
+    *t_reference = 1e9;
+    *t_new = 1e9;
+    double start = now();
+    do {
+        double t0 = now();
+        reference(
+            LINE_COUNT, field_count, buffers, OFFSET, data_mask, expected);
+        double t1 = now();
+        write_lines(LINE_COUNT, field_count, buffers, OFFSET, result);
+        double t2 = now();
+        if (t1 - t0 < *t_reference)
+            *t_reference = t1 - t0;
+        if (t2 - t1 < *t_new)
+            *t_new = t2 - t1;
+    } while (now() - start < 2 * MIN_RUN_TIME);
+    *t_reference *= 1e3;
+    *t_new *= 1e3;
+}
+
+
+/* Runs one test case, returns false if the results differ. */
+static bool run_test(
+    const char *name, write_lines_t write_lines, reference_t *reference,
+    unsigned int field_count, size_t sample_size, size_t output_size,
+    unsigned int data_mask)
+{
+    /* Fill each input column with distinct data. */
+    void *inputs[field_count];
+    struct read_buffers buffers = { .count = field_count, .buffers = inputs };
+    size_t column_size = sample_size * (LINE_COUNT + OFFSET);
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        uint32_t *column = malloc(column_size);
+        for (size_t j = 0; j < column_size / sizeof(uint32_t); j ++)
+            column[j] = (uint32_t) rand();
+        inputs[i] = column;
+    }
+
+    size_t length = (size_t) LINE_COUNT * field_count * output_size;
+    void *expected = malloc(length);
+    void *result = malloc(length);
+    double t_reference, t_new;
+    time_write_lines(write_lines, reference, field_count, &buffers,
+        data_mask, expected, result, &t_reference, &t_new);
+    bool ok = memcmp(expected, result, length) == 0;
+
+    printf("%-6s %3u ids: %8.3f -> %8.3f ms  %5.2fx%s\n",
+        name, field_count, t_reference, t_new, t_reference / t_new,
+        ok ? "" : "  MISMATCH");
+
+    free(expected);
+    free(result);
+    for (unsigned int i = 0; i < field_count; i ++)
+        free(inputs[i]);
+    return ok;
+}
+
+
+int main(int argc, char **argv)
+{
+    static const unsigned int id_counts[] = { 1, 2, 3, 4, 17, 64, 256 };
+    unsigned int id_count_count = sizeof(id_counts) / sizeof(id_counts[0]);
+    bool ok = true;
+
+    printf("%u lines at offset %u, reference -> transposed\n",
+        LINE_COUNT, OFFSET);
+    for (unsigned int i = 0; i < id_count_count; i ++)
+        ok = run_test("FA", fa_write_lines, reference_fa_write_lines,
+            id_counts[i], FA_ENTRY_SIZE, FA_ENTRY_SIZE, 0)  &&  ok;
+
+    for (unsigned int data_mask = 1; data_mask <= 15; data_mask ++)
+    {
+        char name[16];
+        sprintf(name, "D %u", data_mask);
+        unsigned int field_count = (unsigned int) __builtin_popcount(data_mask);
+        for (unsigned int i = 0; i < id_count_count; i ++)
+            ok = run_test(name,
+                d_write_lines(data_mask), reference_d_write_lines,
+                id_counts[i], sizeof(struct decimated_data),
+                field_count * FA_ENTRY_SIZE, data_mask)  &&  ok;
+    }
+
+    if (!ok)
+        printf("Transposed results differ from reference\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+/* Shared cache of archive blocks.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "list.h"
+#include "locking.h"
+
+#include "block_cache.h"
+
+
+/* Guards all access to the cache, and the condition is used to signal the
+ * completion of loads. */
+DECLARE_LOCKING(cache_lock);
+
+struct cache_entry {
+    struct list_head hash;      // Linked into hash table while valid
+    struct list_head lru;       // Linked into lru_list while unreferenced
+    off64_t offset;             // Offset of block in archive
+    size_t length;              // Length of block
+    unsigned int refcount;      // Number of users of this entry
+    bool loading;               // Set until loader calls complete
+    bool ok;                    // Set if loading was successful
+    bool stale;                 // Set once removed from the hash table
+    char data[];
+};
+
+static size_t cache_block_size;     // Size of data area of each entry
+static unsigned int cache_limit;    // Maximum number of entries
+static unsigned int cache_count;    // Number of entries allocated
+
+/* Entries are looked up through a hash table on their archive offset. */
+static unsigned int hash_size;      // Always a power of 2
+static struct list_head *hash_table;
+/* Unreferenced entries in order of last use, candidates for reuse. */
+static LIST_HEAD(lru_list);
+
+
+static struct list_head *hash_bucket(off64_t offset)
+{
+    /* Fibonacci hashing spreads the block offsets, which are all multiples of
+     * a common block size, across the table. */
+    uint64_t hash = (uint64_t) offset * 0x9E3779B97F4A7C15ULL;
+    return &hash_table[(unsigned int) (hash >> 32) & (hash_size - 1)];
+}
+
+
+/* Removes entry from hash table so that it can no longer be found, and frees it
+ * if it's not in use. */
+static void discard_entry(struct cache_entry *entry)
+{
+    list_del(&entry->hash);
+    entry->stale = true;
+    if (entry->refcount == 0)
+    {
+        list_del(&entry->lru);
+        free(entry);
+        cache_count -= 1;
+    }
+}
+
+
+/* Returns a fresh entry, either newly allocated or the least recently used
+ * unreferenced entry, or NULL if the cache is full of entries in use. */
+static struct cache_entry *allocate_entry(void)
+{
+    struct cache_entry *entry = NULL;
+    if (cache_count < cache_limit)
+    {
+        entry = malloc(sizeof(struct cache_entry) + cache_block_size);
+        if (entry)
+            cache_count += 1;
+    }
+    else if (lru_list.next != &lru_list)
+    {
+        entry = container_of(lru_list.next, struct cache_entry, lru);
+        list_del(&entry->hash);
+        list_del(&entry->lru);
+    }
+    return entry;
+}
+
+
+static struct cache_entry *find_entry(off64_t offset, size_t length)
+{
+    struct list_head *bucket = hash_bucket(offset);
+    list_for_each_entry(struct cache_entry, hash, entry, bucket)
+        if (entry->offset == offset  &&  entry->length == length)
+            return entry;
+    return NULL;
+}
+
+
+static struct cache_entry *do_lookup(off64_t offset, size_t length, bool *load)
+{
+    struct cache_entry *entry = find_entry(offset, length);
+    if (entry)
+    {
+        if (entry->refcount == 0)
+            list_del(&entry->lru);
+        entry->refcount += 1;
+        *load = false;
+    }
+    else
+    {
+        entry = allocate_entry();
+        if (entry)
+        {
+            *entry = (struct cache_entry) {
+                .offset = offset, .length = length,
+                .refcount = 1, .loading = true, };
+            list_add(&entry->hash, hash_bucket(offset));
+            *load = true;
+        }
+    }
+    return entry;
+}
+
+
+struct cache_entry *lookup_block_cache(
+    off64_t offset, size_t length, bool *load)
+{
+    if (length > cache_block_size  ||  cache_limit == 0)
+        return NULL;
+
+    struct cache_entry *volatile entry;     // Implicit longjmp in [UN]LOCK
+    LOCK(cache_lock);
+    entry = do_lookup(offset, length, load);
+    UNLOCK(cache_lock);
+    return entry;
+}
+
+
+void *cache_entry_data(struct cache_entry *entry)
+{
+    return entry->data;
+}
+
+
+void complete_cache_entry(struct cache_entry *entry, bool ok)
+{
+    LOCK(cache_lock);
+    entry->loading = false;
+    entry->ok = ok;
+    /* A failed load must not be found again. */
+    if (!ok  &&  !entry->stale)
+        discard_entry(entry);
+    pbroadcast(&cache_lock);
+    UNLOCK(cache_lock);
+}
+
+
+bool wait_cache_entry(struct cache_entry *entry)
+{
+    LOCK(cache_lock);
+    while (entry->loading)
+        pwait(&cache_lock);
+    UNLOCK(cache_lock);
+    return entry->ok;
+}
+
+
+void release_cache_entry(struct cache_entry *entry)
+{
+    LOCK(cache_lock);
+    entry->refcount -= 1;
+    if (entry->refcount == 0)
+    {
+        if (entry->stale)
+        {
+            free(entry);
+            cache_count -= 1;
+        }
+        else
+            list_add_tail(&entry->lru, &lru_list);
+    }
+    UNLOCK(cache_lock);
+}
+
+
+void invalidate_block_cache(off64_t offset, size_t length)
+{
+    if (cache_limit == 0)
+        return;
+
+    LOCK(cache_lock);
+    for (unsigned int i = 0; i < hash_size; i ++)
+    {
+        struct list_head *bucket = &hash_table[i];
+        struct list_head *next;
+        for (struct list_head *item = bucket->next; item != bucket; item = next)
+        {
+            next = item->next;
+            struct cache_entry *entry =
+                container_of(item, struct cache_entry, hash);
+            if (entry->offset < offset + (off64_t) length  &&
+                offset < entry->offset + (off64_t) entry->length)
+                discard_entry(entry);
+        }
+    }
+    UNLOCK(cache_lock);
+}
+
+
+void initialise_block_cache(size_t block_size, unsigned int block_count)
+{
+    cache_block_size = block_size;
+    cache_limit = block_count;
+
+    hash_size = 1;
+    while (hash_size < block_count)
+        hash_size <<= 1;
+    hash_table = malloc(hash_size * sizeof(struct list_head));
+    for (unsigned int i = 0; i < hash_size; i ++)
+        INIT_LIST_HEAD(&hash_table[i]);
+}
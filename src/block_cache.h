@@ -0,0 +1,60 @@
+/* Shared cache of archive blocks.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Blocks read from the archive can be shared between concurrent readers through
+ * this cache.  Each entry is identified by its offset in the archive and is
+ * reference counted while in use.  The first reader to ask for a block is given
+ * the job of loading it, and other readers of the same block wait for that load
+ * rather than reading the block again.  Entries are invalidated when the
+ * archive is overwritten. */
+
+struct cache_entry;
+
+/* Looks up the block of the given length at offset in the archive and returns
+ * a referenced entry for it, or NULL if the block can't be cached.  If *load is
+ * set on return then the caller must read the block into the entry's data area
+ * and then call complete_cache_entry(). */
+struct cache_entry *lookup_block_cache(
+    off64_t offset, size_t length, bool *load);
+/* Returns the data area for this entry. */
+void *cache_entry_data(struct cache_entry *entry);
+/* Called by the loader of an entry when its data has been read. */
+void complete_cache_entry(struct cache_entry *entry, bool ok);
+/* Waits for the entry to be loaded, returns false if loading failed. */
+bool wait_cache_entry(struct cache_entry *entry);
+/* Releases a reference returned by lookup_block_cache(). */
+void release_cache_entry(struct cache_entry *entry);
+
+/* Discards all cached blocks overlapping the given area of the archive.  Blocks
+ * in use are released when their last user is done. */
+void invalidate_block_cache(off64_t offset, size_t length);
+
+/* Sets the size of each cached block and the maximum number of blocks to be
+ * cached.  If block_count is zero the cache is disabled. */
+void initialise_block_cache(size_t block_size, unsigned int block_count);
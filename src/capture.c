@@ -52,6 +52,7 @@
 #include "matlab.h"
 #include "parse.h"
 #include "reader.h"
+#include "encode.h"
 
 
 #define DEFAULT_SERVER      "fa-archiver.diamond.ac.uk"
@@ -89,6 +90,7 @@ static bool check_id0 = false;
 static bool offset_matlab_times = true;
 static bool subtract_day_zero = false;
 static bool save_id0 = false;
+static bool compressed = false;
 
 /* Archiver parameters read from archiver during initialisation. */
 static double sample_frequency;
@@ -284,6 +286,8 @@ static void usage(char *argv0)
 "        used including any local daylight saving offset.\n"
 "   -d   Subtract the day from the matlab timestamp vector.\n"
 "   -T   Save \"id0\" communication controller timestamp information.\n"
+"   -X   Ask the server to compress the data sent.  Worthwhile over slow\n"
+"        network links, but costs CPU at both ends.\n"
 "\n"
 "Note that if matlab format is specified and no sample count is specified\n"
 "(interrupted continuous capture or range of times given) then output must be\n"
@@ -422,7 +426,7 @@ static bool parse_opts(int *argc, char ***argv)
     bool ok = true;
     while (ok)
     {
-        switch (getopt(*argc, *argv, "+hRCDo:aS:qckn:zZdTs:t:b:p:f:"))
+        switch (getopt(*argc, *argv, "+hRCDo:aS:qckn:zZdTXs:t:b:p:f:"))
         {
             case 'h':   usage(argv0);                               exit(0);
             case 'R':   matlab_format = false;                      break;
@@ -440,6 +444,7 @@ static bool parse_opts(int *argc, char ***argv)
             case 'Z':   offset_matlab_times = false;                break;
             case 'd':   subtract_day_zero = true;                   break;
             case 'T':   save_id0 = true;                            break;
+            case 'X':   compressed = true;                          break;
             case 's':   ok = parse_start(parse_datetime, optarg);   break;
             case 't':   ok = parse_start(parse_today, optarg);      break;
             case 'b':   ok = parse_start(parse_before, optarg);     break;
@@ -580,6 +585,7 @@ static void format_read_options(char *options)
     if (request_contiguous) *options++ = 'C';   // Ensure no gaps in data
     if (request_contiguous  &&  check_id0)
                             *options++ = 'Z';   // Include ID0 in gap check
+    if (compressed)         *options++ = 'X';   // Compressed data
     *options = '\0';
 }
 
@@ -592,6 +598,7 @@ static void format_subscribe_options(char *options)
     if (matlab_format  &&  save_id0)
                             *options++ = 'Z';   //  with id0 values
     if (decimated_capture)  *options++ = 'D';   // Decimated data stream
+    if (compressed)         *options++ = 'X';   // Compressed data
     *options = '\0';
 }
 
@@ -1025,6 +1032,7 @@ int main(int argc, char **argv)
                 "Unable to open output file \"%s\"", output_filename))  &&
         request_data(stream)  &&
         check_response(stream)  &&
+        IF_(compressed, TEST_NULL(stream = open_decoded_stream(stream)))  &&
 
         initialise_signal()  &&
         capture_and_save(stream);
@@ -124,23 +124,29 @@ bool initialise_header(
     uint32_t dd_block_size = (uint32_t) (
         header->dd_sample_count * archive_mask_count *
         sizeof(struct decimated_data));
+    uint32_t event_block_size = sizeof(struct event_block);
     /* Start with a simple estimate by division. */
     uint32_t major_block_count =
         (uint32_t) (data_size / (
-            index_block_size + dd_block_size + header->major_block_size));
+            index_block_size + dd_block_size + event_block_size +
+            header->major_block_size));
     uint32_t index_data_size =
         (uint32_t) round_to_page(major_block_count * index_block_size);
     uint64_t dd_data_size =
         round_to_page((size_t) major_block_count * dd_block_size);
+    uint64_t event_data_size =
+        round_to_page((size_t) major_block_count * event_block_size);
     /* Now incrementally reduce the major block count until we're good.  In
      * fact, this is only going to happen once at most. */
-    while (index_data_size + dd_data_size +
+    while (index_data_size + dd_data_size + event_data_size +
            major_block_count * header->major_block_size > data_size)
     {
         major_block_count -= 1;
         index_data_size =
             (uint32_t) round_to_page(major_block_count * index_block_size);
         dd_data_size = round_to_page(major_block_count * dd_block_size);
+        event_data_size =
+            round_to_page((size_t) major_block_count * event_block_size);
     }
 
     /* Finally we can compute the data layout. */
@@ -149,7 +155,9 @@ bool initialise_header(
     header->dd_data_start = header->index_data_start + index_data_size;
     header->dd_data_size = dd_data_size;
     header->dd_total_count = header->dd_sample_count * major_block_count;
-    header->major_data_start = header->dd_data_start + dd_data_size;
+    header->event_data_start = header->dd_data_start + dd_data_size;
+    header->event_data_size = event_data_size;
+    header->major_data_start = header->event_data_start + event_data_size;
     header->major_block_count = major_block_count;
     header->total_data_size =
         header->major_data_start +
@@ -185,6 +193,33 @@ static bool validate_version(struct disk_header *header)
 }
 
 
+/* The event index, if present, lies between the DD data and the major data. */
+static bool validate_event_area(struct disk_header *header)
+{
+    return
+        page_aligned(header->event_data_start, "event index")  &&
+        page_aligned(header->event_data_size, "event index size")  &&
+        TEST_OK_(
+            header->event_data_start >=
+            header->dd_data_start + header->dd_data_size,
+            "Unexpected event index start: %"PRIu64" < %"PRIu64" + %"PRIu64,
+                header->event_data_start,
+                header->dd_data_start, header->dd_data_size)  &&
+        TEST_OK_(
+            header->major_data_start >=
+            header->event_data_start + header->event_data_size,
+            "Unexpected major data start: %"PRIu64" < %"PRIu64" + %"PRIu64,
+                header->major_data_start,
+                header->event_data_start, header->event_data_size)  &&
+        TEST_OK_(
+            header->major_block_count * sizeof(struct event_block) <=
+            header->event_data_size,
+            "Event index too small: %"PRIu32" * %zd > %"PRIu64,
+                header->major_block_count, sizeof(struct event_block),
+                header->event_data_size);
+}
+
+
 bool validate_header(struct disk_header *header, uint64_t file_size)
 {
     COMPILE_ASSERT(sizeof(struct disk_header) <= DISK_HEADER_SIZE);
@@ -289,6 +324,8 @@ bool validate_header(struct disk_header *header, uint64_t file_size)
             "Unexpected major data start: %"PRIu64" < %"PRIu64" + %"PRIu64,
                 header->major_data_start,
                 header->dd_data_start, header->dd_data_size)  &&
+        IF_(header->event_data_start != 0,
+            validate_event_area(header))  &&
         TEST_OK_(
             header->total_data_size >=
             header->major_data_start +
@@ -362,6 +399,7 @@ void print_header(FILE *out, struct disk_header *header)
         "Index data from %"PRIu64" for %"PRIu32" bytes\n"
         "DD data starts %"PRIu64" for %"PRIu64" bytes, %"PRIu32" samples,"
             " %"PRIu32" per block\n"
+        "Event index from %"PRIu64" for %"PRIu64" bytes\n"
         "FA+D data from %"PRIu64", %"PRIu32" decimated samples per block\n"
         "Last duration: %"PRIu32" us, or %lg Hz.  Current index: %"PRIu32"\n",
         header->signature, header->version,
@@ -377,6 +415,7 @@ void print_header(FILE *out, struct disk_header *header)
         header->index_data_start, header->index_data_size,
         header->dd_data_start, header->dd_data_size, header->dd_total_count,
             header->dd_sample_count,
+        header->event_data_start, header->event_data_size,
         header->major_data_start, header->d_sample_count,
         header->last_duration,
             1e6 * header->major_sample_count / (double) header->last_duration,
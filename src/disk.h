@@ -41,10 +41,11 @@ struct decimated_data {
  * Hierarchical description of store.  The header, index and DD data blocks are
  * held in memory, while the FA data blocks need to be kept on disk.
  *
- *  data_store = disk_header, index, DD_data, FA_data
+ *  data_store = disk_header, index, DD_data, [ event_index ], FA_data
  *  index = data_index[major_block_count]
  *  DD_data = DD_block[archive_mask_count]
  *  DD_block = decimated_data[dd_sample_count]
+ *  event_index = event_block[major_block_count]
  *  FA_data = major_block[major_block_count]
  *  major_block = FA_block[archive_mask_count], D_block[archive_mask_count]
  *  FA_block = fa_entry[major_sample_count]
@@ -63,6 +64,10 @@ struct decimated_data {
  * |       |       *dd_total_count
  * |       +-----------------------------------
  * |       *archive_mask_count
+ * +-------+-----------------------------------
+ * |event  |event_block
+ * |index  +-----------------------------------
+ * |       *major_block_count
  * +-------+-------+-------+-------------------
  * |FA     |major  |FA     |fa_entry
  * |data   |block  |block  +-------------------
@@ -89,6 +94,9 @@ struct decimated_data {
  * Note that major_sample_count must be a multiple of the two decimation factors
  * so that all indexing can be done in multiples of major blocks.  Thus the
  * index is by major block.
+ *
+ * The event index is absent from archives prepared before it was introduced,
+ * in which case event_data_start and event_data_size are both zero.
  */
 
 /* The data is stored on disk in native format: it will be read and written
@@ -130,6 +138,11 @@ struct disk_header {
 
     uint32_t current_major_block;   // This block is being written
     uint32_t last_duration;     // Time for last major block in microseconds
+
+    /* The event index was added after the fields above, and so is placed here
+     * to keep older archives readable. */
+    uint64_t event_data_start;  // Start of event index, 0 if absent
+    uint64_t event_data_size;   // Size of event index area
 };
 
 
@@ -146,6 +159,23 @@ struct data_index {
 };
 
 
+/* For each major block we record every sample at which a bit of the event mask
+ * (the FA id selected with -E) is set which was clear in the previous sample,
+ * up to a fixed limit per block. */
+#define EVENT_BLOCK_ENTRIES 255
+
+struct event_entry {
+    uint32_t offset;            // Offset of sample into major block
+    struct fa_entry events;     // Event bits newly set at this sample
+};
+
+struct event_block {
+    uint32_t count;             // Number of entries recorded
+    uint32_t dropped;           // Transitions not recorded for lack of room
+    struct event_entry entries[EVENT_BLOCK_ENTRIES];
+};
+
+
 #define DISK_SIGNATURE      "FASNIFF"
 #define DISK_VERSION        5
 
@@ -0,0 +1,360 @@
+/* Batched reads from the archive.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "error.h"
+#include "list.h"
+#include "locking.h"
+#include "buffer.h"
+#include "disk_writer.h"
+#include "block_cache.h"
+#include "hot_cache.h"
+
+#include "disk_reader.h"
+
+
+/* All readers share a single file handle on the archive, as all reads are done
+ * with pread and so don't depend on the file position. */
+static int archive_fd = -1;
+
+/* Number of reads allowed to run in parallel.  If this is 1 then reads are
+ * simply done in the calling thread. */
+static unsigned int queue_depth;
+static pthread_t *reader_threads;
+static bool reader_running = true;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Coalesced reads. */
+
+/* Performs preadv() until the entire length has been read, stepping over
+ * partially completed reads. */
+static bool do_preadv(
+    struct iovec *iov, unsigned int iovcnt, off64_t offset, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t rx;
+        if (!TEST_IO(rx = preadv(archive_fd, iov, (int) iovcnt, offset))  ||
+            !TEST_OK_(rx > 0, "Unexpected end of archive"))
+            return false;
+        offset += rx;
+        length -= (size_t) rx;
+
+        size_t done = (size_t) rx;
+        while (iovcnt > 0  &&  done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base += done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+
+/* Performs a single coalesced read and completes any shared cache entries it
+ * loads. */
+static bool read_run(const struct read_request *requests, unsigned int count)
+{
+    struct iovec iov[count];
+    size_t length = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        iov[i].iov_base = requests[i].buffer;
+        iov[i].iov_len = requests[i].length;
+        length += requests[i].length;
+    }
+    request_read();
+    bool ok = do_preadv(iov, count, requests[0].offset, length);
+
+    for (unsigned int i = 0; i < count; i ++)
+        if (requests[i].entry)
+            complete_cache_entry(requests[i].entry, ok);
+    return ok;
+}
+
+
+/* Computes the length of the run of adjacent requests needing a read starting
+ * with the first request. */
+static unsigned int run_length(
+    const struct read_request requests[], unsigned int count)
+{
+    unsigned int n = 1;
+    while (n < count  &&  n < IOV_MAX  &&  requests[n].must_read  &&
+           requests[n - 1].offset + (off64_t) requests[n - 1].length ==
+                requests[n].offset)
+        n += 1;
+    return n;
+}
+
+
+/* Steps over requests which don't need to be read, returns false if there is
+ * nothing left to read in this batch. */
+static bool skip_unread(struct read_batch *batch)
+{
+    while (batch->next < batch->count  &&
+           !batch->requests[batch->next].must_read)
+        batch->next += 1;
+    return batch->next < batch->count;
+}
+
+
+/* Claims the next run from the batch and returns its length. */
+static unsigned int next_run(
+    struct read_batch *batch, const struct read_request **requests)
+{
+    *requests = &batch->requests[batch->next];
+    unsigned int count = run_length(*requests, batch->count - batch->next);
+    batch->next += count;
+    skip_unread(batch);
+    return count;
+}
+
+
+/* Looks up all requests in the caches.  Recently written data is copied
+ * straight from the hot cache, shared requests which hit the block cache are
+ * redirected to the cached data, and only requests which miss, or which
+ * couldn't be cached, are left to be read. */
+static void lookup_caches(struct read_request requests[], unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        struct read_request *request = &requests[i];
+        request->must_read = true;
+        request->entry = NULL;
+        if (read_hot_cache(request->offset, request->length, request->buffer))
+            request->must_read = false;
+        else if (request->shared)
+        {
+            request->entry = lookup_block_cache(
+                request->offset, request->length, &request->must_read);
+            if (request->entry)
+                request->buffer = cache_entry_data(request->entry);
+        }
+    }
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Reader threads. */
+
+DECLARE_LOCKING(reader_lock);
+/* Batches with runs waiting to be read. */
+static LIST_HEAD(batch_queue);
+
+
+/* Blocks until a run is available for reading and claims it from the first
+ * batch on the queue, returning the batch and the claimed run.  Returns NULL if
+ * the reader threads are being shut down. */
+static struct read_batch *claim_run(
+    const struct read_request **requests, unsigned int *count)
+{
+    struct read_batch *volatile batch = NULL;   // Implicit longjmp in [UN]LOCK
+    LOCK(reader_lock);
+    while (reader_running  &&  batch_queue.next == &batch_queue)
+        pwait(&reader_lock);
+    if (reader_running)
+    {
+        struct read_batch *first =
+            container_of(batch_queue.next, struct read_batch, list);
+        *count = next_run(first, requests);
+        first->active += 1;
+        /* Once all runs in the batch have been claimed it can come off the
+         * queue. */
+        if (first->next >= first->count)
+            list_del(&first->list);
+        batch = first;
+    }
+    UNLOCK(reader_lock);
+    return batch;
+}
+
+
+/* Marks a run from the given batch as complete, waking its owner. */
+static void complete_run(struct read_batch *batch, bool ok)
+{
+    LOCK(reader_lock);
+    batch->ok = batch->ok  &&  ok;
+    batch->active -= 1;
+    pbroadcast(&reader_lock);
+    UNLOCK(reader_lock);
+}
+
+
+static void *reader_thread(void *context)
+{
+    const struct read_request *requests;
+    unsigned int count;
+    struct read_batch *batch;
+    while (batch = claim_run(&requests, &count), batch)
+        complete_run(batch, read_run(requests, count));
+    return NULL;
+}
+
+
+void start_read_batch(
+    struct read_batch *batch,
+    struct read_request requests[], unsigned int count)
+{
+    *batch = (struct read_batch) {
+        .requests = requests, .count = count, .ok = true };
+    lookup_caches(requests, count);
+
+    if (reader_threads)
+    {
+        if (skip_unread(batch))
+        {
+            LOCK(reader_lock);
+            list_add_tail(&batch->list, &batch_queue);
+            pbroadcast(&reader_lock);
+            UNLOCK(reader_lock);
+        }
+    }
+    else
+    {
+        /* No reader threads, so just do the reads in turn now.  This must be
+         * done here rather than when waiting so that any shared blocks we're
+         * loading aren't held up behind our own processing. */
+        while (batch->ok  &&  skip_unread(batch))
+        {
+            const struct read_request *run;
+            unsigned int run_count = next_run(batch, &run);
+            batch->ok = read_run(run, run_count);
+        }
+        /* Fail any loads we didn't get around to. */
+        for (unsigned int i = batch->next; i < count; i ++)
+            if (requests[i].must_read  &&  requests[i].entry)
+                complete_cache_entry(requests[i].entry, false);
+        batch->next = count;
+    }
+}
+
+
+bool wait_read_batch(struct read_batch *batch)
+{
+    if (reader_threads)
+    {
+        LOCK(reader_lock);
+        while (batch->next < batch->count  ||  batch->active > 0)
+            pwait(&reader_lock);
+        UNLOCK(reader_lock);
+    }
+
+    /* Now wait for any shared blocks being loaded by other readers. */
+    for (unsigned int i = 0; i < batch->count; i ++)
+        if (batch->requests[i].entry)
+            batch->ok = wait_cache_entry(batch->requests[i].entry)  &&
+                batch->ok;
+    return TEST_OK_(batch->ok, "Error reading archive");
+}
+
+
+void release_read_batch(struct read_batch *batch)
+{
+    for (unsigned int i = 0; i < batch->count; i ++)
+        if (batch->requests[i].entry)
+        {
+            release_cache_entry(batch->requests[i].entry);
+            batch->requests[i].entry = NULL;
+        }
+}
+
+
+bool send_archive_data(int file, off64_t offset, size_t length)
+{
+    request_read();
+    while (length > 0)
+    {
+        ssize_t tx;
+        if (!TEST_IO_(tx = sendfile64(file, archive_fd, &offset, length),
+                "Error sending archive data")  ||
+            !TEST_OK_(tx > 0, "Unexpected end of archive"))
+            return false;
+        length -= (size_t) tx;
+    }
+    return true;
+}
+
+
+bool initialise_disk_reader(const char *archive, unsigned int depth)
+{
+    queue_depth = depth;
+    return
+        TEST_OK_(queue_depth > 0, "Invalid read queue depth")  &&
+        TEST_IO_(archive_fd = open(archive, O_RDONLY | O_LARGEFILE),
+            "Unable to open archive file \"%s\"", archive);
+}
+
+
+bool start_disk_reader(void)
+{
+    bool ok = true;
+    if (queue_depth > 1)
+    {
+        reader_threads = calloc(queue_depth, sizeof(pthread_t));
+        for (unsigned int i = 0; ok  &&  i < queue_depth; i ++)
+            ok = TEST_0(pthread_create(
+                &reader_threads[i], NULL, reader_thread, NULL));
+    }
+    return ok;
+}
+
+
+void terminate_disk_reader(void)
+{
+    if (reader_threads)
+    {
+        LOCK(reader_lock);
+        reader_running = false;
+        pbroadcast(&reader_lock);
+        UNLOCK(reader_lock);
+        for (unsigned int i = 0; i < queue_depth; i ++)
+            ASSERT_0(pthread_join(reader_threads[i], NULL));
+    }
+    IGNORE(TEST_IO(close(archive_fd)));
+}
@@ -0,0 +1,81 @@
+/* Batched reads from the archive.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* A single read from the archive file into a buffer.  If the request is marked
+ * as shared then the data may instead be delivered through the shared block
+ * cache, in which case buffer is updated to point to the cached data. */
+struct read_request {
+    off64_t offset;             // Offset into archive of data to read
+    size_t length;              // Number of bytes to read
+    void *buffer;               // Destination for data
+    bool shared;                // Set if data can be shared with other readers
+    /* The following fields are filled in by start_read_batch(). */
+    bool must_read;             // Set if this request needs a disk read
+    struct cache_entry *entry;  // Shared cache entry if not NULL
+};
+
+
+/* A batch of reads which can be run in the background.  The fields of this
+ * structure are private to the disk reader. */
+struct read_batch {
+    struct list_head list;      // Linked into the reader queue while waiting
+    struct read_request *requests;  // Requests to be read
+    unsigned int count;         // Number of requests
+    unsigned int next;          // First request not yet started
+    unsigned int active;        // Number of reads in progress
+    bool ok;                    // Cleared if any read fails
+};
+
+
+/* Starts the given reads in the background.  Requests for adjacent areas of
+ * the archive are coalesced into single reads, so for best results the requests
+ * should be in ascending order of offset, and up to the configured queue depth
+ * of reads are run in parallel.  The requests and batch must
+ * remain valid until wait_read_batch() has been called, which must be called
+ * exactly once for each started batch, and after this release_read_batch()
+ * must be called once the data is no longer needed. */
+void start_read_batch(
+    struct read_batch *batch,
+    struct read_request requests[], unsigned int count);
+/* Waits for all reads in the batch to complete, returns false if any read
+ * failed. */
+bool wait_read_batch(struct read_batch *batch);
+/* Releases any shared data used by the batch. */
+void release_read_batch(struct read_batch *batch);
+
+/* Sends length bytes at offset in the archive straight to file with sendfile(),
+ * so the data never passes through user space.  The caches are bypassed. */
+bool send_archive_data(int file, off64_t offset, size_t length);
+
+/* Opens the archive for shared reading with the given queue depth. */
+bool initialise_disk_reader(const char *archive, unsigned int queue_depth);
+/* Starts the reader threads, must be called after daemonising. */
+bool start_disk_reader(void);
+/* Orderly shutdown of the reader threads. */
+void terminate_disk_reader(void);
@@ -49,6 +49,8 @@
 #include "disk.h"
 #include "transform.h"
 #include "locking.h"
+#include "block_cache.h"
+#include "hot_cache.h"
 
 #include "disk_writer.h"
 
@@ -59,6 +61,9 @@ static bool writer_running = true;
 
 /* File handle for writing to disk. */
 static int disk_fd;
+/* Buffered file handle used for writing back the staged DD data.  Writes
+ * through this handle share the page cache with the DD mapping. */
+static int dd_fd;
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -68,10 +73,11 @@ static int disk_fd;
 static struct disk_header *header;      // Disk header with basic parameters
 static struct data_index *data_index;   // Index of blocks
 static struct decimated_data *dd_data;  // Double decimated data
+static struct event_block *event_index; // Event index, NULL if absent
 
 
-/* Opens and locks the archive for direct IO and maps the three in memory
- * regions directly into memory.  Returns the configured input block size and
+/* Opens and locks the archive for direct IO and maps the in memory regions
+ * directly into memory.  Returns the configured input block size and
  * number of FA ids per capture frame. */
 bool initialise_disk_writer(
     const char *file_name, uint32_t *input_block_size, uint32_t *fa_entry_count,
@@ -99,21 +105,38 @@ bool initialise_disk_writer(
             data_index = mmap(NULL, (size_t) header->index_data_size,
                 PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd,
                 (off_t) header->index_data_start))  &&
+        /* The DD area is mapped read only: updates are written back through
+         * dd_fd by the writer thread. */
         TEST_IO(
             dd_data = mmap(NULL, (size_t) header->dd_data_size,
-                PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd,
+                PROT_READ, MAP_SHARED, disk_fd,
                 (off_t) header->dd_data_start))  &&
-        DO_(initialise_transform(header, data_index, dd_data, events_fa_id));
+        IF_(header->event_data_size > 0,
+            TEST_IO(
+                event_index = mmap(NULL, (size_t) header->event_data_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd,
+                    (off_t) header->event_data_start)))  &&
+        TEST_IO_(
+            dd_fd = open(file_name, O_WRONLY | O_LARGEFILE),
+            "Unable to open archive file \"%s\"", file_name)  &&
+        DO_(initialise_transform(
+            header, data_index, dd_data, event_index, events_fa_id));
 }
 
 static void close_disk(void)
 {
-    ASSERT_IO(msync(dd_data, (size_t) header->dd_data_size, MS_ASYNC));
     ASSERT_IO(msync(data_index, (size_t) header->index_data_size, MS_ASYNC));
     ASSERT_IO(msync(header, DISK_HEADER_SIZE, MS_ASYNC));
+    if (event_index)
+    {
+        ASSERT_IO(msync(
+            event_index, (size_t) header->event_data_size, MS_ASYNC));
+        ASSERT_IO(munmap(event_index, (size_t) header->event_data_size));
+    }
     ASSERT_IO(munmap(dd_data, (size_t) header->dd_data_size));
     ASSERT_IO(munmap(data_index, (size_t) header->index_data_size));
     ASSERT_IO(munmap(header, DISK_HEADER_SIZE));
+    ASSERT_IO(close(dd_fd));
     ASSERT_IO(close(disk_fd));
 }
 
@@ -133,6 +156,11 @@ static bool writing_active = false;
 static off64_t writing_offset;
 static void *writing_block;
 static size_t writing_length;
+static const struct decimated_data *writing_dd_block;
+static unsigned int writing_dd_offset;
+
+/* DD writeback is started a page at a time. */
+static size_t page_size;
 
 
 /* Ensures entire block is written even if interrupted. */
@@ -149,6 +177,35 @@ static bool do_write(int file, void *buffer, size_t length)
     return true;
 }
 
+/* Writes back the DD data staged with the major block just written.  The staged
+ * data holds one run of dd_sample_count samples for each archived id, and each
+ * run goes straight into the page cache so that it survives the loss of this
+ * process.  Each run adds only a few samples to its page, so rather than force
+ * every touched page out with each block we only start writeback of the pages
+ * that a run completes. */
+static bool write_dd_block(void)
+{
+    size_t dd_size = sizeof(struct decimated_data) * header->dd_sample_count;
+    bool ok = true;
+    for (unsigned int id = 0; ok  &&  id < header->archive_mask_count; id ++)
+    {
+        off64_t offset = (off64_t) (
+            header->dd_data_start + sizeof(struct decimated_data) *
+                ((uint64_t) id * header->dd_total_count + writing_dd_offset));
+        off64_t end = offset + (off64_t) dd_size;
+        off64_t page_start = offset & -(off64_t) page_size;
+        off64_t page_end = end & -(off64_t) page_size;
+        ok =
+            TEST_OK(
+                pwrite(dd_fd, writing_dd_block + id * header->dd_sample_count,
+                    dd_size, offset) == (ssize_t) dd_size)  &&
+            IF_(page_end > offset,
+                TEST_IO(sync_file_range(dd_fd, page_start,
+                    page_end - page_start, SYNC_FILE_RANGE_WRITE)));
+    }
+    return ok;
+}
+
 static void *writer_thread(void *context)
 {
     bool ok = true;
@@ -161,7 +218,12 @@ static void *writer_thread(void *context)
 
         ok = writing_active  &&
             TEST_IO(lseek(disk_fd, writing_offset, SEEK_SET))  &&
-            do_write(disk_fd, writing_block, writing_length);
+            do_write(disk_fd, writing_block, writing_length)  &&
+            DO_(fill_hot_cache(writing_offset, writing_block))  &&
+            write_dd_block();
+        /* Any cached copies of this block read while we were writing may be
+         * torn, so must be discarded before readers are let in again. */
+        invalidate_block_cache(writing_offset, writing_length);
 
         LOCK(writer_lock);
         writing_active = false;
@@ -179,14 +241,23 @@ static void stop_writer_thread(void)
     UNLOCK(writer_lock);
 }
 
-void schedule_write(off64_t offset, void *block, size_t length)
+void schedule_write(
+    off64_t offset, void *block, size_t length,
+    const struct decimated_data *dd_block, unsigned int dd_offset)
 {
+    /* Once the index is updated readers will expect the new data for this
+     * block, so the old data must not be found in the cache. */
+    invalidate_block_cache(offset, length);
+    invalidate_hot_cache(offset);
+
     LOCK(writer_lock);
     while (writing_active)
         pwait(&writer_lock);
     writing_offset = offset;
     writing_block = block;
     writing_length = length;
+    writing_dd_block = dd_block;
+    writing_dd_offset = dd_offset;
     writing_active = true;
     pbroadcast(&writer_lock);
     UNLOCK(writer_lock);
@@ -243,6 +314,7 @@ static pthread_t writer_id;
 bool start_disk_writer(struct buffer *buffer)
 {
     reader = open_reader(buffer, true);
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
     return
         TEST_0(pthread_create(&writer_id, NULL, writer_thread, NULL))  &&
         TEST_0(pthread_create(&transform_id, NULL, transform_thread, NULL));
@@ -47,11 +47,16 @@ bool disk_writer_enabled(void);
 
 /* Methods for access to writer thread. */
 
-/* Asks the writer thread to write out the given block.  If a previously
- * requested write is still in progress then this blocks until the write has
- * completed. */
-void schedule_write(off64_t offset, void *block, size_t length);
+/* Asks the writer thread to write out the given block followed by the DD data
+ * staged for the same major block, which is written back to the DD area
+ * starting at sample dd_offset.  If a previously requested write is still in
+ * progress then this blocks until the write has completed. */
+struct decimated_data;
+void schedule_write(
+    off64_t offset, void *block, size_t length,
+    const struct decimated_data *dd_block, unsigned int dd_offset);
 
 /* Requests permission to perform a read, blocks while an outstanding write is
- * in progress. */
+ * in progress.  Must also be called before reading the DD area, as the DD data
+ * for the last block is written back together with the major block. */
 void request_read(void);
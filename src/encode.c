@@ -0,0 +1,421 @@
+/* Compressed wire encoding for data sent to clients.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "error.h"
+
+#include "encode.h"
+
+
+/* LZ4 block format parameters. */
+#define MIN_MATCH       4       // Shortest match that can be encoded
+#define LAST_LITERALS   5       // Last bytes of block must be literals
+#define MATCH_LIMIT     12      // Last match must start this far from end
+#define MAX_OFFSET      65535   // Matches reach back no further than this
+#define HASH_BITS       12      // Size of match finder hash table
+
+
+/* Worst case compressed size for incompressible data. */
+static size_t compress_bound(size_t length)
+{
+    return length + length / 255 + 16;
+}
+
+
+static uint32_t read_u32(const uint8_t *data)
+{
+    uint32_t result;
+    memcpy(&result, data, sizeof(result));
+    return result;
+}
+
+static void write_u32(uint8_t *data, uint32_t value)
+{
+    memcpy(data, &value, sizeof(value));
+}
+
+
+/* Writes an LZ4 length extension: runs of 255 followed by the remainder. */
+static uint8_t *write_length(uint8_t *out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = (uint8_t) length;
+    return out;
+}
+
+
+/* Writes a single LZ4 sequence of literals optionally followed by a match.  A
+ * match_length of zero marks the final sequence of the block. */
+static uint8_t *write_sequence(
+    uint8_t *out, const uint8_t *literals, size_t literal_length,
+    size_t offset, size_t match_length)
+{
+    uint8_t *token = out++;
+    *token = (uint8_t) ((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15)
+        out = write_length(out, literal_length - 15);
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+
+    if (match_length > 0)
+    {
+        *out++ = (uint8_t) offset;
+        *out++ = (uint8_t) (offset >> 8);
+        size_t length = match_length - MIN_MATCH;
+        *token |= (uint8_t) (length < 15 ? length : 15);
+        if (length >= 15)
+            out = write_length(out, length - 15);
+    }
+    return out;
+}
+
+
+static unsigned int hash_u32(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+
+/* A simple greedy LZ4 compressor: each position is hashed on its first four
+ * bytes and the most recent position with the same hash is tried as a match.
+ * Returns the compressed length, which can be up to compress_bound(length). */
+static size_t lz_compress(const uint8_t *in, size_t length, uint8_t *out)
+{
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    uint8_t *out_start = out;
+    size_t anchor = 0;
+    if (length > MATCH_LIMIT)
+    {
+        size_t limit = length - MATCH_LIMIT;
+        size_t match_end = length - LAST_LITERALS;
+        size_t ip = 0;
+        while (ip < limit)
+        {
+            uint32_t sequence = read_u32(in + ip);
+            unsigned int hash = hash_u32(sequence);
+            size_t ref = table[hash];
+            table[hash] = (uint32_t) ip;
+            if (ref < ip  &&  ip - ref <= MAX_OFFSET  &&
+                read_u32(in + ref) == sequence)
+            {
+                size_t match = MIN_MATCH;
+                while (ip + match < match_end  &&
+                       in[ref + match] == in[ip + match])
+                    match += 1;
+                out = write_sequence(
+                    out, in + anchor, ip - anchor, ip - ref, match);
+                ip += match;
+                anchor = ip;
+            }
+            else
+                ip += 1;
+        }
+    }
+    out = write_sequence(out, in + anchor, length - anchor, 0, 0);
+    return (size_t) (out - out_start);
+}
+
+
+/* Reads an LZ4 length extension, fails if it runs off the end of the input. */
+static bool read_length(
+    const uint8_t **in, const uint8_t *in_end, size_t *length)
+{
+    uint8_t byte;
+    do {
+        if (*in >= in_end)
+            return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+
+/* Decompresses an LZ4 block, which must decode to exactly out_length bytes.
+ * All offsets and lengths are checked, so corrupt input is safely rejected. */
+static bool lz_decompress(
+    const uint8_t *in, size_t in_length, uint8_t *out, size_t out_length)
+{
+    const uint8_t *in_end = in + in_length;
+    size_t op = 0;
+    while (in < in_end)
+    {
+        uint8_t token = *in++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15  &&
+            !read_length(&in, in_end, &literal_length))
+            return false;
+        if (literal_length > (size_t) (in_end - in)  ||
+            literal_length > out_length - op)
+            return false;
+        memcpy(out + op, in, literal_length);
+        in += literal_length;
+        op += literal_length;
+        if (in == in_end)
+            break;          // Final sequence has no match
+
+        if (in_end - in < 2)
+            return false;
+        size_t offset = (size_t) in[0] | (size_t) in[1] << 8;
+        in += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15  &&  !read_length(&in, in_end, &match_length))
+            return false;
+        match_length += MIN_MATCH;
+        if (offset == 0  ||  offset > op  ||  match_length > out_length - op)
+            return false;
+        /* Matches can overlap their own output, so copy bytewise. */
+        for (size_t i = 0; i < match_length; i ++)
+            out[op + i] = out[op - offset + i];
+        op += match_length;
+    }
+    return op == out_length;
+}
+
+
+/* Computes differences of 32-bit words stride words apart and shuffles the
+ * result into byte planes. */
+static void shuffle_delta(
+    const uint8_t *in, size_t length, unsigned int stride, uint8_t *out)
+{
+    size_t words = length / 4;
+    for (size_t i = 0; i < words; i ++)
+    {
+        uint32_t word = read_u32(in + 4 * i);
+        if (stride > 0  &&  i >= stride)
+            word -= read_u32(in + 4 * (i - stride));
+        out[i]             = (uint8_t) word;
+        out[i + words]     = (uint8_t) (word >> 8);
+        out[i + 2 * words] = (uint8_t) (word >> 16);
+        out[i + 3 * words] = (uint8_t) (word >> 24);
+    }
+    memcpy(out + 4 * words, in + 4 * words, length - 4 * words);
+}
+
+
+/* Inverse of shuffle_delta(). */
+static void unshuffle_delta(
+    const uint8_t *in, size_t length, unsigned int stride, uint8_t *out)
+{
+    size_t words = length / 4;
+    for (size_t i = 0; i < words; i ++)
+    {
+        uint32_t word =
+            (uint32_t) in[i] |
+            (uint32_t) in[i + words] << 8 |
+            (uint32_t) in[i + 2 * words] << 16 |
+            (uint32_t) in[i + 3 * words] << 24;
+        if (stride > 0  &&  i >= stride)
+            word += read_u32(out + 4 * (i - stride));
+        write_u32(out + 4 * i, word);
+    }
+    memcpy(out + 4 * words, in + 4 * words, length - 4 * words);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Encoding. */
+
+struct encoder {
+    unsigned int stride;        // Delta stride in words
+    uint8_t *shuffled;          // Transformed data before compression
+    uint8_t *frame;             // Frame header followed by compressed data
+};
+
+
+struct encoder *create_encoder(unsigned int stride)
+{
+    struct encoder *encoder = malloc(sizeof(struct encoder));
+    encoder->stride = stride;
+    encoder->shuffled = malloc(ENCODE_MAX_FRAME);
+    encoder->frame = malloc(
+        sizeof(struct encode_frame_header) + compress_bound(ENCODE_MAX_FRAME));
+    return encoder;
+}
+
+
+void destroy_encoder(struct encoder *encoder)
+{
+    if (encoder)
+    {
+        free(encoder->shuffled);
+        free(encoder->frame);
+        free(encoder);
+    }
+}
+
+
+/* Encodes a single frame and sends it with its header in one write. */
+static bool write_frame(
+    struct encoder *encoder, int file, const uint8_t *data, size_t length)
+{
+    shuffle_delta(data, length, encoder->stride, encoder->shuffled);
+    uint8_t *payload = encoder->frame + sizeof(struct encode_frame_header);
+    size_t encoded = lz_compress(encoder->shuffled, length, payload);
+    /* Send incompressible data as it is. */
+    if (encoded >= length)
+    {
+        memcpy(payload, data, length);
+        encoded = length;
+    }
+
+    struct encode_frame_header header = {
+        .raw_length = (uint32_t) length,
+        .encoded_length = (uint32_t) encoded,
+        .stride = encoder->stride,
+    };
+    memcpy(encoder->frame, &header, sizeof(header));
+    return TEST_write_(file, encoder->frame, sizeof(header) + encoded,
+        "Error writing to client");
+}
+
+
+bool write_encoded(
+    struct encoder *encoder, int file, const void *data, size_t length)
+{
+    bool ok = true;
+    while (ok  &&  length > 0)
+    {
+        size_t frame = length < ENCODE_MAX_FRAME ? length : ENCODE_MAX_FRAME;
+        ok = write_frame(encoder, file, data, frame);
+        data += frame;
+        length -= frame;
+    }
+    return ok;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Decoding. */
+
+struct decoder {
+    FILE *input;                // Stream of frames
+    uint8_t *payload;           // Received frame payload
+    uint8_t *shuffled;          // Decompressed data
+    uint8_t *data;              // Decoded data for reading
+    size_t length;              // Length of decoded data
+    size_t offset;              // Amount of decoded data already read
+};
+
+
+/* Reads and decodes the next frame.  Returns false with *eof set if the input
+ * ends cleanly between frames. */
+static bool read_frame(struct decoder *decoder, bool *eof)
+{
+    struct encode_frame_header header;
+    size_t rx = fread(&header, 1, sizeof(header), decoder->input);
+    *eof = rx == 0  &&  feof(decoder->input);
+    if (*eof)
+        return false;
+
+    bool raw = header.encoded_length == header.raw_length;
+    bool ok =
+        TEST_OK_(rx == sizeof(header), "Truncated frame header")  &&
+        TEST_OK_(header.raw_length <= ENCODE_MAX_FRAME  &&
+            header.encoded_length <= compress_bound(ENCODE_MAX_FRAME),
+            "Invalid frame header")  &&
+        TEST_OK_(fread(decoder->payload, 1, header.encoded_length,
+            decoder->input) == header.encoded_length, "Truncated frame")  &&
+        IF_ELSE(raw,
+            DO_(memcpy(decoder->data, decoder->payload, header.raw_length)),
+        // else
+            TEST_OK_(lz_decompress(
+                decoder->payload, header.encoded_length,
+                decoder->shuffled, header.raw_length),
+                "Corrupt compressed frame")  &&
+            DO_(unshuffle_delta(
+                decoder->shuffled, header.raw_length, header.stride,
+                decoder->data)));
+    decoder->length = ok ? header.raw_length : 0;
+    decoder->offset = 0;
+    return ok;
+}
+
+
+static ssize_t read_decoded(void *cookie, char *buffer, size_t size)
+{
+    struct decoder *decoder = cookie;
+    size_t rx = 0;
+    while (rx < size)
+    {
+        if (decoder->offset >= decoder->length)
+        {
+            bool eof;
+            if (!read_frame(decoder, &eof))
+                return eof  ||  rx > 0 ? (ssize_t) rx : -1;
+        }
+        size_t count = decoder->length - decoder->offset;
+        if (count > size - rx)
+            count = size - rx;
+        memcpy(buffer + rx, decoder->data + decoder->offset, count);
+        decoder->offset += count;
+        rx += count;
+    }
+    return (ssize_t) rx;
+}
+
+
+static int close_decoded(void *cookie)
+{
+    struct decoder *decoder = cookie;
+    int result = fclose(decoder->input);
+    free(decoder->payload);
+    free(decoder->shuffled);
+    free(decoder->data);
+    free(decoder);
+    return result;
+}
+
+
+FILE *open_decoded_stream(FILE *input)
+{
+    struct decoder *decoder = malloc(sizeof(struct decoder));
+    *decoder = (struct decoder) {
+        .input = input,
+        .payload = malloc(compress_bound(ENCODE_MAX_FRAME)),
+        .shuffled = malloc(ENCODE_MAX_FRAME),
+        .data = malloc(ENCODE_MAX_FRAME),
+    };
+    cookie_io_functions_t functions = {
+        .read = read_decoded, .close = close_decoded };
+    return fopencookie(decoder, "r", functions);
+}
@@ -0,0 +1,68 @@
+/* Compressed wire encoding for data sent to clients.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Clients can ask for the data following the initial null byte of a response
+ * to be sent compressed as a sequence of frames, each of which stands alone:
+ *
+ *  frame = raw-length encoded-length stride payload{encoded-length}
+ *
+ * with all three header fields 4 byte integers.  If encoded-length equals
+ * raw-length then the payload is the original data, otherwise the payload is
+ * the raw data transformed in three steps.  First the data is taken as 32-bit
+ * words and each word has the word stride words before it subtracted, so that
+ * for data consisting of lines of stride words we send differences between
+ * successive samples.  Next the bytes of the words are shuffled into four
+ * planes, so the low bytes of all the words come first, and any trailing bytes
+ * are appended unchanged.  Finally the result is compressed in the LZ4 block
+ * format. */
+
+struct encode_frame_header {
+    uint32_t raw_length;        // Length of decoded data
+    uint32_t encoded_length;    // Length of payload following
+    uint32_t stride;            // Delta stride in 32-bit words, 0 for none
+};
+
+/* Largest frame that will be generated or accepted. */
+#define ENCODE_MAX_FRAME    (1 << 20)
+
+
+struct encoder;
+
+/* Creates an encoder for data organised as lines of stride 32-bit words. */
+struct encoder *create_encoder(unsigned int stride);
+void destroy_encoder(struct encoder *encoder);
+
+/* Writes length bytes of data to file as one or more encoded frames. */
+bool write_encoded(
+    struct encoder *encoder, int file, const void *data, size_t length);
+
+
+/* Returns a stream from which the decoded contents of the stream of frames
+ * read from input can be read.  Closing the returned stream closes input. */
+FILE *open_decoded_stream(FILE *input);
@@ -0,0 +1,265 @@
+/* Cache of recently written major blocks.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "locking.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "disk.h"
+#include "transform.h"
+
+#include "hot_cache.h"
+
+
+/* Each major block is cached in the slot given by its block number modulo the
+ * number of slots, so a slot always holds the last data written to the
+ * corresponding disk block.  The data itself is held in a separate buffer so
+ * that a slot can be refilled while readers are still copying out of its old
+ * buffer: the old buffer is retired, and only goes back on the free list when
+ * its last reader is done.  One more buffer than there are slots is allocated
+ * to allow for this. */
+struct hot_buffer {
+    struct hot_buffer *next;    // Link in free list
+    unsigned int readers;       // Number of readers currently copying out
+    bool retired;               // Set once the buffer is no longer in a slot
+    void *data;                 // Copy of complete major block
+};
+
+struct hot_slot {
+    unsigned int block;         // Major block held in this slot
+    struct hot_buffer *buffer;  // Buffer holding block, NULL if slot empty
+};
+
+/* Guards the slots, the free list and the buffer headers.  Readers copy out of
+ * a buffer without holding the lock, but hold its reader count up while doing
+ * so.  Neither the transform thread nor the disk writer ever waits for them. */
+DECLARE_LOCKING(hot_lock);
+
+static unsigned int slot_count;
+static struct hot_slot *slots;
+static struct hot_buffer *buffers;
+static unsigned int buffer_count;
+static struct hot_buffer *free_buffers;
+static uint64_t hits;
+static uint64_t misses;
+static uint64_t skipped;
+
+
+static void free_buffer(struct hot_buffer *buffer)
+{
+    buffer->next = free_buffers;
+    free_buffers = buffer;
+}
+
+
+/* Takes the buffer out of the slot, must be called under the lock.  A buffer
+ * which is still being read is freed by its last reader. */
+static void empty_slot(struct hot_slot *slot)
+{
+    struct hot_buffer *buffer = slot->buffer;
+    slot->buffer = NULL;
+    if (buffer)
+    {
+        if (buffer->readers > 0)
+            buffer->retired = true;
+        else
+            free_buffer(buffer);
+    }
+}
+
+
+/* Returns the major block starting at the given offset in the archive. */
+static unsigned int offset_to_block(off64_t offset)
+{
+    const struct disk_header *header = get_header();
+    return (unsigned int) (
+        ((uint64_t) offset - header->major_data_start) /
+        header->major_block_size);
+}
+
+
+void invalidate_hot_cache(off64_t offset)
+{
+    if (slot_count == 0)
+        return;
+
+    unsigned int major_block = offset_to_block(offset);
+    struct hot_slot *slot = &slots[major_block % slot_count];
+    LOCK(hot_lock);
+    if (slot->buffer  &&  slot->block == major_block)
+        empty_slot(slot);
+    UNLOCK(hot_lock);
+}
+
+
+void fill_hot_cache(off64_t offset, const void *block)
+{
+    if (slot_count == 0)
+        return;
+
+    const struct disk_header *header = get_header();
+    unsigned int major_block = offset_to_block(offset);
+    struct hot_slot *slot = &slots[major_block % slot_count];
+
+    struct hot_buffer *volatile buffer;     // Implicit longjmp in [UN]LOCK
+    LOCK(hot_lock);
+    empty_slot(slot);
+    buffer = free_buffers;
+    if (buffer)
+        free_buffers = buffer->next;
+    else
+        skipped += 1;
+    UNLOCK(hot_lock);
+
+    /* If every spare buffer is still being read this block simply isn't
+     * cached, the slot is refilled with the next block to land in it. */
+    if (buffer)
+    {
+        memcpy(buffer->data, block, header->major_block_size);
+
+        LOCK(hot_lock);
+        buffer->retired = false;
+        slot->block = major_block;
+        slot->buffer = buffer;
+        UNLOCK(hot_lock);
+    }
+}
+
+
+/* Claims the buffer holding the given block for reading, returns NULL and
+ * counts a miss if the block is not cached. */
+static struct hot_buffer *claim_buffer(unsigned int major_block)
+{
+    struct hot_slot *slot = &slots[major_block % slot_count];
+    struct hot_buffer *volatile result = NULL;  // Implicit longjmp in [UN]LOCK
+    LOCK(hot_lock);
+    if (slot->buffer  &&  slot->block == major_block)
+    {
+        result = slot->buffer;
+        result->readers += 1;
+        hits += 1;
+    }
+    else
+        misses += 1;
+    UNLOCK(hot_lock);
+    return result;
+}
+
+
+static void release_buffer(struct hot_buffer *buffer)
+{
+    LOCK(hot_lock);
+    buffer->readers -= 1;
+    if (buffer->readers == 0  &&  buffer->retired)
+    {
+        buffer->retired = false;
+        free_buffer(buffer);
+    }
+    UNLOCK(hot_lock);
+}
+
+
+bool read_hot_cache(off64_t offset, size_t length, void *buffer)
+{
+    if (slot_count == 0)
+        return false;
+
+    /* Work out which major block this read falls in, and only try the cache if
+     * the read lies entirely within a single block. */
+    const struct disk_header *header = get_header();
+    if ((uint64_t) offset < header->major_data_start)
+        return false;
+    uint64_t major_offset = (uint64_t) offset - header->major_data_start;
+    unsigned int major_block =
+        (unsigned int) (major_offset / header->major_block_size);
+    size_t block_offset = major_offset % header->major_block_size;
+    if (block_offset + length > header->major_block_size)
+        return false;
+
+    struct hot_buffer *hot_buffer = claim_buffer(major_block);
+    if (hot_buffer)
+    {
+        memcpy(buffer, hot_buffer->data + block_offset, length);
+        release_buffer(hot_buffer);
+    }
+    return hot_buffer != NULL;
+}
+
+
+void get_hot_cache_status(struct hot_cache_status *status)
+{
+    const struct disk_header *header = get_header();
+    LOCK(hot_lock);
+    status->blocks = 0;
+    for (unsigned int i = 0; i < slot_count; i ++)
+        if (slots[i].buffer)
+            status->blocks += 1;
+    status->capacity = slot_count;
+    status->size = (uint64_t) buffer_count * header->major_block_size;
+    status->hits = hits;
+    status->misses = misses;
+    status->skipped = skipped;
+    UNLOCK(hot_lock);
+}
+
+
+bool initialise_hot_cache(uint64_t size)
+{
+    const struct disk_header *header = get_header();
+    uint64_t count = size / header->major_block_size;
+    /* One buffer is kept spare for refilling a slot still being read, and
+     * there's no point in holding more blocks than there are in the archive. */
+    if (count > (uint64_t) header->major_block_count + 1)
+        count = (uint64_t) header->major_block_count + 1;
+    if (count < 2)
+        return true;
+    slot_count = (unsigned int) count - 1;
+    buffer_count = (unsigned int) count;
+
+    bool ok =
+        TEST_NULL(slots = calloc(slot_count, sizeof(struct hot_slot)))  &&
+        TEST_NULL(buffers = calloc(buffer_count, sizeof(struct hot_buffer)));
+    for (unsigned int i = 0; ok  &&  i < buffer_count; i ++)
+    {
+        ok = TEST_NULL_(buffers[i].data = malloc(header->major_block_size),
+            "Unable to allocate hot cache");
+        if (ok)
+            free_buffer(&buffers[i]);
+    }
+    return ok;
+}
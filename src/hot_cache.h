@@ -0,0 +1,62 @@
+/* Cache of recently written major blocks.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* The most recently written major blocks are kept in memory so that reads of
+ * recent data, which is by far the most commonly requested, don't need to go to
+ * disk.  The cache is filled by the disk writer thread as each major block is
+ * written, so the copy is kept off the transform thread. */
+
+/* Discards any cached copy of the major block at offset in the archive, called
+ * as the block is handed to the disk writer to be overwritten. */
+void invalidate_hot_cache(off64_t offset);
+
+/* Copies the complete major block just written at offset into the cache.  This
+ * never waits for readers: if they are still holding every spare buffer the
+ * block is not cached. */
+void fill_hot_cache(off64_t offset, const void *block);
+
+/* Tries to satisfy a read of length bytes at offset in the archive from the
+ * cache, returns false if the data is not cached. */
+bool read_hot_cache(off64_t offset, size_t length, void *buffer);
+
+/* Cache statistics, as reported by the CH command. */
+struct hot_cache_status {
+    unsigned int blocks;        // Number of major blocks currently held
+    unsigned int capacity;      // Number of major blocks that can be held
+    uint64_t size;              // Size of cache in bytes
+    uint64_t hits;              // Reads satisfied from the cache
+    uint64_t misses;            // Reads passed through to disk
+    uint64_t skipped;           // Blocks not cached as no buffer was free
+};
+void get_hot_cache_status(struct hot_cache_status *status);
+
+/* Allocates a cache of up to size bytes.  Must be called after the disk header
+ * has been loaded.  If size is too small to hold two major blocks, one slot and
+ * its spare, the cache is disabled. */
+bool initialise_hot_cache(uint64_t size);
@@ -95,3 +95,33 @@ bool pwait_timeout(struct locking *locking, int secs, long nsecs)
         return true;
     }
 }
+
+
+void seq_write_begin(struct seqlock *seqlock)
+{
+    __atomic_store_n(&seqlock->sequence, seqlock->sequence + 1,
+        __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void seq_write_end(struct seqlock *seqlock)
+{
+    __atomic_store_n(&seqlock->sequence, seqlock->sequence + 1,
+        __ATOMIC_RELEASE);
+}
+
+unsigned int seq_read_begin(const struct seqlock *seqlock)
+{
+    /* Updates are only a handful of stores, so simply spin until done. */
+    unsigned int sequence =
+        __atomic_load_n(&seqlock->sequence, __ATOMIC_ACQUIRE);
+    while (sequence & 1)
+        sequence = __atomic_load_n(&seqlock->sequence, __ATOMIC_ACQUIRE);
+    return sequence;
+}
+
+bool seq_read_retry(const struct seqlock *seqlock, unsigned int sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&seqlock->sequence, __ATOMIC_RELAXED) != sequence;
+}
@@ -52,3 +52,20 @@ void psignal(struct locking *locking);
 void pbroadcast(struct locking *locking);
 void pwait(struct locking *locking);
 bool pwait_timeout(struct locking *locking, int secs, long nsecs);
+
+
+/* A sequence lock allows a single writer to publish small updates to readers
+ * which never block.  Readers repeat their reads until seq_read_retry() returns
+ * false, so must not act on anything they read until then, and the writer
+ * must not be able to leave readers seeing a half finished update for long. */
+struct seqlock {
+    unsigned int sequence;      // Odd while an update is in progress
+};
+
+#define DECLARE_SEQLOCK(lock) \
+    static struct seqlock lock = { .sequence = 0 }
+
+void seq_write_begin(struct seqlock *seqlock);
+void seq_write_end(struct seqlock *seqlock);
+unsigned int seq_read_begin(const struct seqlock *seqlock);
+bool seq_read_retry(const struct seqlock *seqlock, unsigned int sequence);
@@ -231,6 +231,8 @@ struct fa_id_list {
     const char *description;
     const char *x_name;
     const char *y_name;
+    double x_scale;
+    double y_scale;
 };
 
 static struct fa_id_list *fa_id_list;
@@ -260,9 +262,10 @@ static bool maybe_parse_word(const char **string, const char **result)
     }
 }
 
-/* Each line in the file consists of up to four whitespace separated fields:
- *  id [description] [x_name] [y_name]
- */
+/* Each line in the file consists of up to six whitespace separated fields:
+ *  id [description] [x_name] [y_name] [x_scale [y_scale]]
+ * where the scales can only be given if both names are given, and y_scale
+ * defaults to x_scale. */
 static bool parse_fa_id_line(const char **line, bool seen[])
 {
     int id;
@@ -282,6 +285,12 @@ static bool parse_fa_id_line(const char **line, bool seen[])
             maybe_parse_word(line, &entry->x_name)  &&
             skip_whitespace(line)  &&
             maybe_parse_word(line, &entry->y_name));
+        ok =
+            IF_(skip_whitespace(line)  &&  **line != '\0',
+                parse_double(line, &entry->x_scale)  &&
+                DO_(entry->y_scale = entry->x_scale)  &&
+                IF_(skip_whitespace(line)  &&  **line != '\0',
+                    parse_double(line, &entry->y_scale)));
     }
     return ok;
 }
@@ -321,6 +330,11 @@ bool load_fa_ids(const char *filename, uint32_t fa_entry_count)
 {
     fa_id_list = calloc(fa_entry_count, sizeof(struct fa_id_list));
     id_list_length = fa_entry_count;
+    for (uint32_t id = 0; id < fa_entry_count; id ++)
+    {
+        fa_id_list[id].x_scale = 1;
+        fa_id_list[id].y_scale = 1;
+    }
     return IF_(filename, load_fa_ids_file(filename));
 }
 
@@ -347,3 +361,10 @@ bool write_fa_ids(int output, const struct filter_mask *archive_mask)
     }
     return ok;
 }
+
+
+void get_fa_id_scale(unsigned int id, float *x_scale, float *y_scale)
+{
+    *x_scale = (float) fa_id_list[id].x_scale;
+    *y_scale = (float) fa_id_list[id].y_scale;
+}
@@ -91,3 +91,7 @@ bool load_fa_ids(const char *filename, uint32_t fa_entry_count);
 
 /* Sends list of FA ids and descriptions to the given output file. */
 bool write_fa_ids(int output, const struct filter_mask *archive_mask);
+
+/* Returns the calibration of the given FA id, the factor by which X and Y are
+ * multiplied when sent as floating point, 1 unless given in the ids file. */
+void get_fa_id_scale(unsigned int id, float *x_scale, float *y_scale);
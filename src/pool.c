@@ -35,10 +35,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/time.h>
 
 #include "error.h"
 #include "list.h"
 #include "locking.h"
+#include "encode.h"
 
 #include "pool.h"
 
@@ -53,29 +55,260 @@ struct pool_entry {
     char buffer[];
 };
 
-static unsigned int pool_size;
+static unsigned int pool_size;          // Buffers neither locked nor reserved
+static unsigned int pool_total;         // Total number of buffers
 static struct pool_entry *buffer_pool = NULL;
 
 size_t pooled_buffer_size;
 
 
+/* Accounting for a single client host. */
+struct pool_client {
+    struct list_head list;
+    unsigned int users;         // Requests admitted or waiting
+    unsigned int admitted;      // Requests admitted
+    char name[];                // Client host name
+};
+
+/* A request waiting for admission. */
+struct admission_waiter {
+    struct list_head list;
+    struct pool_client *client;
+    unsigned int count;         // Number of buffers wanted
+    struct timeval arrived;     // When the request started waiting
+};
+
+static unsigned int admission_timeout;  // Seconds to wait for admission
+static unsigned int client_limit;       // Requests per client, 0 if no limit
+static LIST_HEAD(client_list);
+/* One queue for each priority, interactive first. */
+static struct list_head admission_queues[] = {
+    LIST_HEAD_INIT(admission_queues[PRIORITY_INTERACTIVE]),
+    LIST_HEAD_INIT(admission_queues[PRIORITY_BULK]),
+};
+static struct admission_status admission_status;
+
+
+/* Looks up the accounting record for the host part of client_name, creating a
+ * new record if necessary. */
+static struct pool_client *get_client(const char *client_name)
+{
+    const char *colon = strrchr(client_name, ':');
+    size_t length =
+        colon ? (size_t) (colon - client_name) : strlen(client_name);
+    list_for_each_entry(struct pool_client, list, client, &client_list)
+        if (strncmp(client->name, client_name, length) == 0  &&
+            client->name[length] == '\0')
+        {
+            client->users += 1;
+            return client;
+        }
+
+    struct pool_client *client =
+        malloc(sizeof(struct pool_client) + length + 1);
+    client->users = 1;
+    client->admitted = 0;
+    memcpy(client->name, client_name, length);
+    client->name[length] = '\0';
+    list_add(&client->list, &client_list);
+    return client;
+}
+
+static void put_client(struct pool_client *client)
+{
+    client->users -= 1;
+    if (client->users == 0)
+    {
+        list_del(&client->list);
+        free(client);
+    }
+}
+
+
+static uint64_t microseconds_since(const struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t) (
+        (now.tv_sec - start->tv_sec) * 1000000 +
+        (now.tv_usec - start->tv_usec));
+}
 
-bool lock_buffers(struct read_buffers *buffers, unsigned int count)
+
+/* A bulk request which has waited for this many microseconds goes ahead of any
+ * interactive requests, so that a steady stream of small requests can't hold
+ * it back until it times out. */
+static uint64_t bulk_promotion_time(void)
 {
+    return (uint64_t) admission_timeout * 1000000 / 4;
+}
+
+
+/* Returns the first waiter in the given queue whose client is within its limit.
+ * Waiters held back by their own client's limit don't hold up anyone else. */
+static struct admission_waiter *first_waiter(struct list_head *queue)
+{
+    list_for_each_entry(struct admission_waiter, list, waiter, queue)
+        if (client_limit == 0  ||  waiter->client->admitted < client_limit)
+            return waiter;
+    return NULL;
+}
+
+/* Returns the waiter to be admitted next: interactive requests first unless
+ * the oldest bulk request has been waiting for too long. */
+static struct admission_waiter *queue_head(void)
+{
+    struct admission_waiter *interactive =
+        first_waiter(&admission_queues[PRIORITY_INTERACTIVE]);
+    struct admission_waiter *bulk =
+        first_waiter(&admission_queues[PRIORITY_BULK]);
+    if (interactive  &&
+            !(bulk  &&
+              microseconds_since(&bulk->arrived) >= bulk_promotion_time()))
+        return interactive;
+    else
+        return bulk;
+}
+
+
+/* Called with the buffer lock held to wait until waiter is at the head of the
+ * queue and its buffers are available, or until the timeout expires. */
+static bool wait_for_admission(struct admission_waiter *waiter)
+{
+    uint64_t timeout = (uint64_t) admission_timeout * 1000000;
+    uint64_t promotion = bulk_promotion_time();
+
+    bool ok = queue_head() == waiter  &&  waiter->count <= pool_size;
+    uint64_t waited = 0;
+    while (!ok  &&  waited < timeout)
+    {
+        /* Wake up when we're due for promotion, as nothing else will tell us
+         * that we've moved to the head of the queue. */
+        uint64_t remaining = timeout - waited;
+        if (waited < promotion  &&  promotion - waited < remaining)
+            remaining = promotion - waited;
+        pwait_timeout(&buffer_lock,
+            (int) (remaining / 1000000), (long) (remaining % 1000000) * 1000);
+        ok = queue_head() == waiter  &&  waiter->count <= pool_size;
+        waited = microseconds_since(&waiter->arrived);
+    }
+
+    if (ok)
+    {
+        admission_status.admitted += 1;
+        admission_status.total_wait += waited;
+        if (waited > admission_status.max_wait)
+            admission_status.max_wait = waited;
+    }
+    else
+        admission_status.timeouts += 1;
+    return ok;
+}
+
+
+bool admit_buffers(
+    struct admission *admission, const char *client_name,
+    enum admission_priority priority, unsigned int count)
+{
+    if (!TEST_OK_(count <= pool_total, "Read too large for buffer pool"))
+        return false;
+
     bool ok;
     LOCK(buffer_lock);
-    ok = TEST_OK_(count <= pool_size, "Read too busy");
+    struct admission_waiter waiter = {
+        .client = get_client(client_name), .count = count };
+    gettimeofday(&waiter.arrived, NULL);
+    list_add_tail(&waiter.list, &admission_queues[priority]);
+    admission_status.waiting[priority] += 1;
+
+    ok = wait_for_admission(&waiter);
+
+    list_del(&waiter.list);
+    admission_status.waiting[priority] -= 1;
     if (ok)
     {
         pool_size -= count;
-        buffers->buffers = malloc(count * sizeof(void *));
-        buffers->count = count;
-        for (unsigned int i = 0; i < count; i ++)
-        {
-            struct pool_entry *entry = buffer_pool;
-            buffer_pool = entry->next;
-            buffers->buffers[i] = entry->buffer;
-        }
+        waiter.client->admitted += 1;
+        admission->client = waiter.client;
+        admission->reserved = count;
+    }
+    else
+        put_client(waiter.client);
+    /* Our departure from the queue may let the next request in. */
+    pbroadcast(&buffer_lock);
+    UNLOCK(buffer_lock);
+    return TEST_OK_(ok, "Read too busy");
+}
+
+
+void release_admission(struct admission *admission)
+{
+    if (admission->client)
+    {
+        LOCK(buffer_lock);
+        pool_size += admission->reserved;
+        admission->client->admitted -= 1;
+        put_client(admission->client);
+        pbroadcast(&buffer_lock);
+        UNLOCK(buffer_lock);
+        admission->client = NULL;
+        admission->reserved = 0;
+    }
+}
+
+
+void get_admission_status(struct admission_status *status)
+{
+    LOCK(buffer_lock);
+    *status = admission_status;
+    status->pool_size = pool_total;
+    status->free = pool_size;
+    UNLOCK(buffer_lock);
+}
+
+
+/* Called with the buffer lock held to take count buffers from the free list,
+ * which must already have been accounted for. */
+static void take_buffers(
+    struct admission *admission, struct read_buffers *buffers,
+    unsigned int count)
+{
+    buffers->buffers = malloc(count * sizeof(void *));
+    buffers->count = count;
+    buffers->admission = admission;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        struct pool_entry *entry = buffer_pool;
+        buffer_pool = entry->next;
+        buffers->buffers[i] = entry->buffer;
+    }
+}
+
+
+bool lock_buffers(
+    struct admission *admission, struct read_buffers *buffers,
+    unsigned int count)
+{
+    ASSERT_OK(count <= admission->reserved);
+    LOCK(buffer_lock);
+    admission->reserved -= count;
+    take_buffers(admission, buffers, count);
+    UNLOCK(buffer_lock);
+    return true;
+}
+
+
+bool try_lock_buffers(
+    struct admission *admission, struct read_buffers *buffers,
+    unsigned int count)
+{
+    bool ok;
+    LOCK(buffer_lock);
+    ok = count <= pool_size  &&  queue_head() == NULL;
+    if (ok)
+    {
+        pool_size -= count;
+        take_buffers(admission, buffers, count);
     }
     UNLOCK(buffer_lock);
     return ok;
@@ -94,12 +327,16 @@ void unlock_buffers(struct read_buffers *buffers)
         buffer_pool = entry;
     }
     pool_size += buffers->count;
+    if (buffers->count > 0)
+        pbroadcast(&buffer_lock);
     UNLOCK(buffer_lock);
     free(buffers->buffers);
 }
 
 
-void initialise_buffer_pool(size_t buffer_size, unsigned int count)
+void initialise_buffer_pool(
+    size_t buffer_size, unsigned int count,
+    unsigned int timeout, unsigned int client_limit_)
 {
     pooled_buffer_size = buffer_size;
     for (unsigned int i = 0; i < count; i ++)
@@ -110,6 +347,9 @@ void initialise_buffer_pool(size_t buffer_size, unsigned int count)
         buffer_pool = entry;
     }
     pool_size = count;
+    pool_total = count;
+    admission_timeout = timeout;
+    client_limit = client_limit_;
 }
 
 
@@ -117,10 +357,22 @@ void initialise_buffer_pool(size_t buffer_size, unsigned int count)
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Write buffers. */
 
-bool allocate_write_buffer(struct write_buffer *buffer, unsigned int count)
+bool allocate_write_buffer(
+    struct admission *admission, struct write_buffer *buffer,
+    unsigned int count)
+{
+    return
+        lock_buffers(admission, &buffer->buffers, count)  &&
+        TEST_NULL(buffer->out_pointers = calloc(count, sizeof(size_t)));
+}
+
+
+bool try_allocate_write_buffer(
+    struct admission *admission, struct write_buffer *buffer,
+    unsigned int count)
 {
     return
-        lock_buffers(&buffer->buffers, count)  &&
+        try_lock_buffers(admission, &buffer->buffers, count)  &&
         TEST_NULL(buffer->out_pointers = calloc(count, sizeof(size_t)));
 }
 
@@ -132,13 +384,24 @@ void release_write_buffer(struct write_buffer *buffer)
 }
 
 
+/* Sends data to the client, encoding it if requested. */
+static bool send_data(
+    struct write_buffer *buffer, const void *data, size_t length)
+{
+    if (buffer->encoder)
+        return write_encoded(buffer->encoder, buffer->file, data, length);
+    else
+        return TEST_write_(buffer->file, data, length,
+            "Error writing to client");
+}
+
+
 bool flush_buffer(struct write_buffer *buffer)
 {
     ASSERT_OK(buffer->buffers.count == 1  &&  buffer->file >= 0);
     return IF_(buffer->out_pointers[0] > 0,
-        TEST_write_(
-            buffer->file, buffer->buffers.buffers[0], buffer->out_pointers[0],
-            "Error writing to client")  &&
+        send_data(
+            buffer, buffer->buffers.buffers[0], buffer->out_pointers[0])  &&
         DO_(buffer->out_pointers[0] = 0));
 }
 
@@ -207,3 +470,20 @@ bool write_delayed_buffer(
             buffer_in->buffers.buffers[i], buffer_in->out_pointers[i]);
     return ok;
 }
+
+
+bool send_delayed_buffer(
+    struct write_buffer *buffer_in, struct write_buffer *buffer_out)
+{
+    /* Anything already in the output buffer has to go first. */
+    bool ok = flush_buffer(buffer_out);
+    for (unsigned int i = 0; ok  &&  i <= buffer_in->current_buffer; i ++)
+        ok = IF_(buffer_in->out_pointers[i] > 0,
+            send_data(buffer_out,
+                buffer_in->buffers.buffers[i], buffer_in->out_pointers[i]));
+
+    for (unsigned int i = 0; i <= buffer_in->current_buffer; i ++)
+        buffer_in->out_pointers[i] = 0;
+    buffer_in->current_buffer = 0;
+    return ok;
+}
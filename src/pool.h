@@ -32,23 +32,79 @@
  * averts overloading the server by making excessive demands. */
 
 
+/* Read requests are admitted to the buffer pool in turn: each request first
+ * reserves all the buffers it can't do without, waiting in a queue until they
+ * become available or a timeout expires.  Interactive requests are served
+ * before bulk requests until the oldest bulk request has waited for a quarter
+ * of the timeout, otherwise requests are served in order of arrival, and the
+ * number of requests admitted at once for a single client host can be limited.
+ * A request waiting for buffers holds up all requests behind it, so large
+ * requests are not starved by a stream of small ones. */
+
+enum admission_priority {
+    PRIORITY_INTERACTIVE,       // Small requests, served first
+    PRIORITY_BULK,              // Everything else
+};
+
+struct admission {
+    struct pool_client *client; // Client accounting, NULL until admitted
+    unsigned int reserved;      // Reserved buffers not yet locked
+};
+
+#define ALLOCATE_ADMISSION(admission) \
+    struct admission admission = { .client = NULL, .reserved = 0 }
+
+/* Waits for count buffers to be reserved for the named client.  Fails if the
+ * buffers can't be reserved before the admission timeout. */
+bool admit_buffers(
+    struct admission *admission, const char *client_name,
+    enum admission_priority priority, unsigned int count);
+/* Returns any unused reservation and ends the admission.  Safe to call if
+ * admission failed. */
+void release_admission(struct admission *admission);
+
+struct admission_status {
+    unsigned int pool_size;     // Total number of buffers in pool
+    unsigned int free;          // Buffers neither locked nor reserved
+    unsigned int waiting[2];    // Interactive and bulk requests waiting
+    uint64_t admitted;          // Requests admitted
+    uint64_t timeouts;          // Requests refused after waiting
+    uint64_t total_wait;        // Total wait of admitted requests in us
+    uint64_t max_wait;          // Longest wait of an admitted request in us
+};
+void get_admission_status(struct admission_status *status);
+
+
 /* This structure is used to communicate with the buffer pool. */
 struct read_buffers {
     unsigned int count;         // Number of allocated buffers
     void **buffers;             // Array of allocated buffers
+    struct admission *admission;    // Admission buffers are held under
 };
 
 #define ALLOCATE_READ_BUFFERS(bufs) \
     struct read_buffers bufs = { .count = 0, .buffers = NULL }
 
 
-/* Allocates the requested number of buffers, fails if none available. */
-bool lock_buffers(struct read_buffers *buffers, unsigned int count);
+/* Takes the requested number of buffers from those reserved by admission. */
+bool lock_buffers(
+    struct admission *admission, struct read_buffers *buffers,
+    unsigned int count);
+/* Takes buffers beyond those reserved if they are available without holding up
+ * any waiting request, otherwise silently returns false.  Used for optional
+ * allocations such as read-ahead buffers. */
+bool try_lock_buffers(
+    struct admission *admission, struct read_buffers *buffers,
+    unsigned int count);
 /* Releases previously allocated buffer block.  Safe to call if count==0. */
 void unlock_buffers(struct read_buffers *buffers);
 
-/* Called at startup to initialise the buffer pool. */
-void initialise_buffer_pool(size_t buffer_size, unsigned int count);
+/* Called at startup to initialise the buffer pool.  Requests wait for up to
+ * timeout seconds for admission, and if client_limit is non zero no more than
+ * this many requests from one client host are admitted at once. */
+void initialise_buffer_pool(
+    size_t buffer_size, unsigned int count,
+    unsigned int timeout, unsigned int client_limit);
 
 /* Records the size of buffers allocated by lock_buffers(). */
 extern size_t pooled_buffer_size;
@@ -64,6 +120,8 @@ struct write_buffer {
     unsigned int current_buffer;    // Buffer currently in  use
     size_t *out_pointers;           // One out pointer for each buffer
     struct read_buffers buffers;    // The buffers themselves
+    struct encoder *encoder;        // If set, data is sent encoded
+    struct formatter *formatter;    // If set, lines are converted for sending
 };
 
 
@@ -76,7 +134,14 @@ struct write_buffer {
 
 /* Allocates write buffer.  Assumes the buffer has been correctly zero
  * initialised with ALLOCATE_WRITE_BUFFER. */
-bool allocate_write_buffer(struct write_buffer *buffer, unsigned int count);
+bool allocate_write_buffer(
+    struct admission *admission, struct write_buffer *buffer,
+    unsigned int count);
+/* As for allocate_write_buffer(), but takes unreserved buffers as for
+ * try_lock_buffers(). */
+bool try_allocate_write_buffer(
+    struct admission *admission, struct write_buffer *buffer,
+    unsigned int count);
 /* Must be called to release buffer. */
 void release_write_buffer(struct write_buffer *buffer);
 
@@ -97,3 +162,8 @@ void release_buffer(struct write_buffer *buffer, size_t length);
  * as a delay buffer. */
 bool write_delayed_buffer(
     struct write_buffer *buffer_in, struct write_buffer *buffer_out);
+/* Sends buffer_in straight to the file of buffer_out after flushing buffer_out,
+ * and empties buffer_in for reuse.  Used to stage data prepared in parallel
+ * with other writers to the same file. */
+bool send_delayed_buffer(
+    struct write_buffer *buffer_in, struct write_buffer *buffer_out);
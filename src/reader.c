@@ -35,6 +35,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <errno.h>
 #include <pthread.h>
@@ -52,16 +53,27 @@
 #include "socket_server.h"
 #include "list.h"
 #include "pool.h"
+#include "disk_reader.h"
+#include "block_cache.h"
+#include "transpose.h"
+#include "spectrum.h"
+#include "encode.h"
 
 #include "reader.h"
 
 #define K   1024
 
+#define MAX_WINDOWS         100000  // Limit on windows in one batch read
+#define MAX_WINDOW_LINE     128     // Limit on length of one window line
+#define MAX_INTERVALS       1000000 // Limit on intervals from one search
+
+#define HISTORY_POLL        1000    // Interval between polls for live data, us
+#define HISTORY_TIMEOUT     2000000 // Longest wait for live data, us
+
 
-/* Each connection opens its own file handle on the archive.  This is the
- * archive file. */
-static const char *archive_filename;
 static unsigned int fa_entry_count;         // Read from header at startup
+static size_t page_size;                    // Alignment for archive reads
+static unsigned int cpu_count;              // Limit on workers for one read
 
 
 
@@ -75,35 +87,84 @@ struct iter_mask {
 };
 
 
+/* Reads in progress for one block of each id. */
+struct block_reads {
+    struct read_buffers *buffers;   // Read buffers allocated from the pool
+    struct read_buffers data;       // Where the data for each id will be
+    struct read_request *requests;  // Workspace for reads, one for each id
+    struct read_batch batch;        // Reads in progress
+};
+
+
+/* Accumulator for one axis of an envelope point.  The sums are accumulated
+ * relative to the first mean seen to avoid losing precision in the variance. */
+struct envelope_axis {
+    int32_t min, max;
+    int32_t origin;
+    double sum, sum_sq;
+};
+
+/* Accumulated envelope for one id, merging count FA samples. */
+struct envelope {
+    struct envelope_axis x, y;
+    uint64_t count;
+};
+
+/* Limits for a threshold search: a sample is outside the limits if either
+ * coordinate lies outside the closed range [low, high]. */
+struct limits {
+    struct fa_entry low, high;
+};
+
+
 struct reader {
-    /* Reads the requested block from archive into buffer, samples_per_fa_block
-     * samples will be returned:
-     *  archive         File handle of archive to read
+    /* Starts reading the requested block for each id from the archive.  At
+     * least the requested range of samples will be available for each id at
+     * its natural offset in reads->data once wait_read_batch() has been called
+     * on the batch.  Whole blocks are shared with other readers through the
+     * block cache, so the data may not be in our own read buffers:
      *  block           Major block to start reading
-     *  id              FA id to read
-     *  *buffer         Data written here, must be correct size */
-    bool (*read_block)(
-        int archive, unsigned int block, unsigned int id, void *buffer);
-    /* Writes the given lines from a list of buffers to an output buffer:
-     *  line_count      Number of samples to be written
-     *  field_count     Number of FA ids per sample
-     *  read_buffers    Array of buffers, one for each FA id
-     *  offset          Starting offset into buffer of first sample to write
-     *  data_mask       Mask of decimated fields to write (ignored for FA)
-     *  output          Data buffer to be written to */
-    void (*write_lines)(
-        unsigned int line_count, unsigned int field_count,
-        struct read_buffers *read_buffers, unsigned int offset,
-        unsigned int data_mask, void *output);
+     *  first           First sample in block required
+     *  count           Number of samples required
+     *  iter            List of FA ids to read
+     *  reads           Read buffers and reads in progress */
+    void (*start_read_blocks)(
+        unsigned int block, unsigned int first, unsigned int count,
+        const struct iter_mask *iter, struct block_reads *reads);
+    /* Returns the transposition to be used to write lines of data for the
+     * given data mask, which is ignored for FA data.  This is chosen once when
+     * the request is parsed. */
+    write_lines_t (*select_write_lines)(unsigned int data_mask);
     /* The size of a single output value.  For decimated data the output size
      * depends on the selected data mask, which is of course meaningless for FA
      * data. */
     size_t (*output_size)(unsigned int data_mask);
+    /* Set if the archive layout of a block for a single id is already the
+     * output format, in which case it can be sent straight from disk. */
+    bool send_direct;
+    /* Merges count samples starting at offset from the block of data read for
+     * one id into an envelope, where each sample stands for weight FA samples.
+     * The weight is only needed when merging data from different sources. */
+    void (*accumulate_envelope)(
+        struct envelope *envelope, const void *block,
+        unsigned int offset, unsigned int count, unsigned int weight);
+    /* Sets outside[i] for each of count samples starting at offset in the
+     * block of data read for one id which may hold values outside the given
+     * limits, returns true if any were found.  For decimated data this tests
+     * the min and max fields. */
+    bool (*mark_outside)(
+        const void *block, unsigned int offset, unsigned int count,
+        const struct limits *limits, bool outside[]);
 
     unsigned int decimation_log2;       // FA samples per read sample
     unsigned int samples_per_fa_block;  // Samples in a single FA block
 };
 
+/* Forward declaration of the three reader definitions. */
+static struct reader fa_reader;
+static struct reader d_reader;
+static struct reader dd_reader;
+
 
 /* Converts an external mask into indexes into the archive. */
 static bool mask_to_archive(
@@ -136,6 +197,25 @@ static unsigned int round_up(uint64_t a, uint64_t b)
 }
 
 
+/* Number of workers worth running in parallel over a range of blocks. */
+static unsigned int worker_limit(unsigned int blocks)
+{
+    return blocks < cpu_count ? blocks : cpu_count;
+}
+
+
+/* Errors in worker threads are stashed by the worker and passed back to the
+ * thread which owns the connection to be reported from there. */
+static void report_worker_error(char *error)
+{
+    if (error)
+    {
+        print_error("%s", error);
+        free(error);
+    }
+}
+
+
 /* Checks that the run of samples from (ix_start,offset) has no gaps.  Here the
  * start is an index block, but the offset is an offset in data points. */
 static bool check_run(
@@ -233,6 +313,8 @@ enum send_timestamp {
 struct ts_buffer {
     uint32_t count;                 // Number of timestamps actually written
     bool send_id0;                  // Set if id0s is in use
+    unsigned int timestamp_blocks;  // Buffers needed for timestamps
+    unsigned int duration_blocks;   // Buffers needed for durations and id0s
     /* To help the client out even further, we send the timestamps, durations
      * and option id0 values separately. */
     struct write_buffer timestamps;
@@ -253,12 +335,16 @@ struct ts_buffer {
 /* When sending timestamps at the end we have to first of all allocate a buffer
  * large enough to accomodate all the timestamps we're going to generate.  As
  * this could in fact end up being a lot of data we use the preallocated buffer
- * pool for this. */
-static bool allocate_timestamp_buffer(
+ * pool for this.  The number of buffers needed is computed first so that they
+ * can be reserved along with all the other buffers needed for the read. */
+static bool count_timestamp_buffers(
     enum send_timestamp send_timestamp, bool send_id0,
-    struct ts_buffer *ts_buffer, unsigned int samples_per_block, uint64_t count)
+    struct ts_buffer *ts_buffer, unsigned int samples_per_block, uint64_t count,
+    unsigned int *buffer_count)
 {
     ts_buffer->send_id0 = send_id0;
+    ts_buffer->timestamp_blocks = 0;
+    ts_buffer->duration_blocks = 0;
     if (send_timestamp == SEND_AT_END)
     {
         /* We only need a rough estimate here, so long as we don't
@@ -266,20 +352,35 @@ static bool allocate_timestamp_buffer(
          * one each extra for partial blocks at each end. */
         uint64_t ts_count_64 = 2 + count / samples_per_block;
         size_t ts_count = (size_t) ts_count_64;
-        unsigned int timestamp_blocks =
+        ts_buffer->timestamp_blocks =
             round_up(ts_count, pooled_buffer_size / sizeof(uint64_t));
-        unsigned int duration_blocks =
+        ts_buffer->duration_blocks =
             round_up(ts_count, pooled_buffer_size / sizeof(uint32_t));
-        return
-            TEST_OK_(ts_count == ts_count_64,
-                "Far too many samples requested")  &&
-            allocate_write_buffer(&ts_buffer->timestamps, timestamp_blocks)  &&
-            allocate_write_buffer(&ts_buffer->durations,  duration_blocks)  &&
-            IF_(send_id0,
-                allocate_write_buffer(&ts_buffer->id0s, duration_blocks));
+        *buffer_count =
+            ts_buffer->timestamp_blocks +
+            (send_id0 ? 2 : 1) * ts_buffer->duration_blocks;
+        return TEST_OK_(ts_count == ts_count_64,
+            "Far too many samples requested");
     }
     else
+    {
+        *buffer_count = 0;
         return true;
+    }
+}
+
+static bool allocate_timestamp_buffer(
+    struct admission *admission, struct ts_buffer *ts_buffer)
+{
+    return
+        IF_(ts_buffer->timestamp_blocks > 0,
+            allocate_write_buffer(admission,
+                &ts_buffer->timestamps, ts_buffer->timestamp_blocks)  &&
+            allocate_write_buffer(admission,
+                &ts_buffer->durations, ts_buffer->duration_blocks)  &&
+            IF_(ts_buffer->send_id0,
+                allocate_write_buffer(admission,
+                    &ts_buffer->id0s, ts_buffer->duration_blocks)));
 }
 
 
@@ -385,6 +486,95 @@ static void release_timestamp_buffer(struct ts_buffer *ts_buffer)
 
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Envelope support. */
+
+/* An envelope read reduces the selected time range to a fixed number of points,
+ * each of which merges a run of samples from the coarsest data source which
+ * still provides at least one sample per point. */
+
+
+static void reset_envelope(struct envelope *envelope)
+{
+    *envelope = (struct envelope) {
+        .x = { .min = INT32_MAX, .max = INT32_MIN },
+        .y = { .min = INT32_MAX, .max = INT32_MIN },
+        .count = 0 };
+}
+
+
+/* Merges a single decimated sample into one axis of an envelope, where the
+ * sample is the summary of weight FA samples with the given min, max, mean and
+ * standard deviation. */
+static inline void accumulate_axis(
+    struct envelope_axis *axis, bool first, double weight,
+    int32_t min, int32_t max, int32_t mean, int32_t std)
+{
+    if (first)
+        axis->origin = mean;
+    if (min < axis->min)  axis->min = min;
+    if (axis->max < max)  axis->max = max;
+    double delta = (double) mean - (double) axis->origin;
+    axis->sum += weight * delta;
+    axis->sum_sq += weight * (delta * delta + (double) std * (double) std);
+}
+
+
+/* Computes one axis of the fields selected by data_mask in the same order as
+ * for decimated data. */
+static void compute_axis(
+    const struct envelope_axis *axis, uint64_t count, int32_t result[4])
+{
+    double mean = axis->sum / (double) count;
+    double var = axis->sum_sq / (double) count - mean * mean;
+    result[0] = (int32_t) lround((double) axis->origin + mean);
+    result[1] = axis->min;
+    result[2] = axis->max;
+    result[3] = var > 0 ? (int32_t) sqrt(var) : 0;
+}
+
+
+/* Writes the fields of the envelope selected by data_mask to output, returns
+ * the advanced output pointer. */
+static struct fa_entry *write_envelope(
+    const struct envelope *envelope, unsigned int data_mask,
+    struct fa_entry *output)
+{
+    int32_t x[4], y[4];
+    compute_axis(&envelope->x, envelope->count, x);
+    compute_axis(&envelope->y, envelope->count, y);
+    for (unsigned int i = 0; i < 4; i ++)
+        if (data_mask & (1U << i))
+            *output++ = (struct fa_entry) { .x = x[i], .y = y[i] };
+    return output;
+}
+
+
+/* Writes out a single line of envelope points, one for each id, and resets the
+ * envelopes for the next line. */
+static bool write_envelope_line(
+    struct envelope envelopes[], unsigned int count, unsigned int data_mask,
+    size_t line_size_out, struct write_buffer *out_buffer)
+{
+    size_t buf_length;
+    struct fa_entry *output =
+        get_buffer(out_buffer, line_size_out, &buf_length);
+    if (output)
+    {
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            output = write_envelope(&envelopes[i], data_mask, output);
+            reset_envelope(&envelopes[i]);
+        }
+        release_buffer(out_buffer, line_size_out);
+        return true;
+    }
+    else
+        return false;
+}
+
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data transfer control. */
 
@@ -394,426 +584,2810 @@ struct read_parse {
     uint64_t samples;               // Requested number of samples
     uint64_t start;                 // Data start (in microseconds into epoch)
     uint64_t end;                   // Data end (alternative to count)
+    unsigned int windows;           // Windows in a batch read, 0 if not batch
     const struct reader *reader;    // Interpretation of data source
     unsigned int data_mask;         // Data mask for D and DD data
+    write_lines_t write_lines;      // Transposition for reader and data mask
+    unsigned int points;            // Envelope points, 0 for normal read
+    unsigned int decimation;        // Boxcar decimation factor, 0 if none
+    unsigned int max_points;        // Automatic resolution limit, 0 if none
+    bool statistics;                // Statistics over the whole range
+    unsigned int fft_length;        // Power spectrum FFT length, 0 if none
+    unsigned int log_bins;          // Log frequency bins, 0 for linear
     bool send_sample_count;         // Send sample count at start
     bool send_all_data;             // Don't bail out if insufficient data
     enum send_timestamp send_timestamp; // Send timestamp configuration
     bool send_id0;                  // Send id0 (with timestamp data)
     bool only_contiguous;           // Only contiguous data acceptable
     bool check_id0;                 // Consider id0 gap as a gap
+    bool encode;                    // Send compressed data
+    enum output_format format;      // Format of data sent
 };
 
 
-static bool transfer_data(
-    const struct read_parse *parse, struct read_buffers *read_buffers,
-    int archive, struct write_buffer *out_buffer, struct iter_mask *iter,
-    struct ts_buffer *ts_buffer,
-    unsigned int ix_block, unsigned int offset, uint64_t count)
+/* Returns true if the data read is to be reduced before sending.  Automatic
+ * resolution reads are not included, as they may turn out to send stored data
+ * unchanged. */
+static bool reduced_read(const struct read_parse *parse)
 {
-    const struct reader *reader = parse->reader;
-    const struct disk_header *header = get_header();
-    size_t line_size_out = iter->count * reader->output_size(parse->data_mask);
+    return
+        parse->points > 0  ||  parse->decimation > 0  ||  parse->statistics  ||
+        parse->fft_length > 0;
+}
+
+
+/* Sets up conversion of output lines to the requested format and compression.
+ * Compressed data is delta encoded over whole lines of formatted output. */
+static void prepare_output(
+    const struct read_parse *parse, const struct reader *reader,
+    unsigned int id_count, struct write_buffer *out_buffer)
+{
+    size_t field_size = reader->output_size(parse->data_mask);
+    out_buffer->formatter = create_formatter(
+        parse->format, &parse->read_mask, fa_entry_count,
+        (unsigned int) (field_size / FA_ENTRY_SIZE));
+    if (parse->encode)
+        out_buffer->encoder = create_encoder((unsigned int) (
+            formatted_line_size(out_buffer->formatter, id_count * field_size) /
+            4));
+}
 
+
+static void release_output(struct write_buffer *out_buffer)
+{
+    destroy_encoder(out_buffer->encoder);
+    destroy_formatter(out_buffer->formatter);
+}
+
+
+/* Transposes count lines of read data starting at offset into output lines and
+ * writes them out in buffer sized chunks, each converted to the output format
+ * if necessary. */
+static bool write_block_lines(
+    write_lines_t write_lines, unsigned int field_count, size_t line_size_out,
+    struct read_buffers *data, unsigned int offset, unsigned int count,
+    struct write_buffer *out_buffer)
+{
+    const struct formatter *formatter = out_buffer->formatter;
+    size_t header_size = format_header_size(formatter);
     bool ok = true;
     while (ok  &&  count > 0)
     {
-        ok = send_extended_timestamp(
-            parse->send_timestamp, ts_buffer, out_buffer, ix_block);
-
-        /* Read a single timeframe for each id from the archive.  This is
-         * normally a single large disk IO block per BPM id. */
-        for (unsigned int i = 0; ok  &&  i < iter->count; i ++)
-            ok = reader->read_block(
-                archive, ix_block, iter->index[i], read_buffers->buffers[i]);
-
-        /* Transpose the read data into output lines and write out in buffer
-         * sized chunks. */
-        unsigned int samples_read = reader->samples_per_fa_block;
-        while (ok  &&  offset < samples_read  &&  count > 0)
+        /* Ensure we get enough workspace to write a least a single line!
+         * Alas, can fail if writing fails. */
+        size_t buf_length;
+        void *line_buffer = get_buffer(
+            out_buffer, header_size + line_size_out, &buf_length);
+        ok = line_buffer != NULL;
+        if (ok)
         {
-            /* Ensure we get enough workspace to write a least a single line!
-             * Alas, can fail if writing fails. */
-            size_t buf_length;
-            void *line_buffer =
-                get_buffer(out_buffer, line_size_out, &buf_length);
-            ok = line_buffer != NULL;
-            if (!ok)
-                break;
-
             /* Enough lines to fill the write buffer, so long as we don't write
-             * more than requested and we don't exhaust the read blocks. */
+             * more than requested. */
             unsigned int line_count =
-                (unsigned int) (buf_length / line_size_out);
+                (unsigned int) ((buf_length - header_size) / line_size_out);
             if (count < line_count)
-                line_count = (unsigned int) count;
-            if (offset + line_count > samples_read)
-                line_count = samples_read - offset;
+                line_count = count;
 
-            reader->write_lines(
-                line_count, iter->count,
-                read_buffers, offset, parse->data_mask, line_buffer);
-            release_buffer(out_buffer, line_count * line_size_out);
+            write_lines(line_count, field_count, data, offset,
+                line_buffer + header_size);
+            release_buffer(out_buffer, format_lines(
+                formatter, line_buffer, line_count, line_size_out));
 
             count -= line_count;
             offset += line_count;
         }
-
-        ix_block += 1;
-        if (ix_block >= header->major_block_count)
-            ix_block = 0;
-        offset = 0;
     }
-
-    return ok  &&
-        IF_(parse->send_timestamp == SEND_AT_END,
-            write_timestamp_buffer(ts_buffer, out_buffer));
+    return ok;
 }
 
 
-static bool read_data(
-    int scon, const char *client_name, const struct read_parse *parse)
+/* If read-ahead buffers were allocated then the read for the next block is
+ * started before the current block is transposed and sent, so that disk and
+ * network transfers can overlap.  The two sets of read buffers are then used
+ * alternately. */
+static bool transfer_sequential(
+    const struct read_parse *parse,
+    const struct reader *reader, write_lines_t write_lines,
+    struct read_buffers read_buffers[2],
+    struct write_buffer *out_buffer, struct iter_mask *iter,
+    struct ts_buffer *ts_buffer,
+    unsigned int ix_block, unsigned int offset, uint64_t count)
 {
-    unsigned int ix_block, offset;      // Index of first point to send
-    struct iter_mask iter = { 0 };      // List of IDs to read
-    int archive = -1;                   // Archive file for reading FA or D data
-    uint64_t samples = parse->samples;  // Number of samples to return
+    const struct disk_header *header = get_header();
+    size_t line_size_out = iter->count * reader->output_size(parse->data_mask);
+    unsigned int samples_read = reader->samples_per_fa_block;
+
+    bool read_ahead = read_buffers[1].count > 0;
+    struct read_request requests[2][iter->count];
+    void *data[2][iter->count];
+    struct block_reads reads[2];
+    for (unsigned int i = 0; i < 2; i ++)
+        reads[i] = (struct block_reads) {
+            .buffers = &read_buffers[i],
+            .data = { .count = iter->count, .buffers = data[i] },
+            .requests = requests[i] };
+    bool started[2] = { false, false };
+    unsigned int current = 0;
 
-    /* Three lots of buffers from the pool: read buffers, write buffer and an
-     * optional timestamp buffer. */
-    ALLOCATE_READ_BUFFERS(read_buffers);    // Array of buffers, one for each ID
-    ALLOCATE_WRITE_BUFFER(out_buffer, scon);  // Buffered writes
-    ALLOCATE_TS_BUFFER(ts_buffer);      // For timestamps at end
+    bool ok = true;
+    while (ok  &&  count > 0)
+    {
+        unsigned int next_block = ix_block + 1;
+        if (next_block >= header->major_block_count)
+            next_block = 0;
+        /* Only the samples we're going to send need to be read. */
+        unsigned int block_count = samples_read - offset;
+        if (count < block_count)
+            block_count = (unsigned int) count;
 
-    bool ok =
-        /* Convert timestamps into index block, offset and sample count. */
-        compute_start(
-            parse->reader, parse->start, parse->end, parse->send_all_data,
-            &samples, &ix_block, &offset)  &&
-        /* If contiguous data requested ensure there are no gaps. */
-        IF_(parse->only_contiguous,
-            check_run(parse->reader,
-                parse->check_id0, ix_block, offset, samples))  &&
-        /* Prepare the iteration mask for efficient data delivery. */
-        mask_to_archive(&parse->read_mask, &iter)  &&
-        /* Capture all the buffers needed.  This can fail if there are too many
-         * readers trying to run at once. */
-        lock_buffers(&read_buffers, iter.count)  &&
-        allocate_write_buffer(&out_buffer, 1)  &&
-        allocate_timestamp_buffer(
-            parse->send_timestamp, parse->send_id0, &ts_buffer,
-            parse->reader->samples_per_fa_block, samples)  &&
-        /* Finally we're ready to go. */
-        TEST_IO(archive = open(archive_filename, O_RDONLY));
-    bool write_ok = report_socket_error(scon, client_name, ok);
+        /* Read a single timeframe for each id from the archive.  This is
+         * normally a single large disk IO block per BPM id, all submitted
+         * together as one batch.  If read-ahead is running this will already
+         * have been started. */
+        if (!started[current])
+            reader->start_read_blocks(
+                ix_block, offset, block_count, iter, &reads[current]);
+        started[current] = false;
+        ok =
+            wait_read_batch(&reads[current].batch)  &&
+            send_extended_timestamp(
+                parse->send_timestamp, ts_buffer, out_buffer, ix_block);
+
+        /* Start reading the next block while this one is being sent. */
+        unsigned int next = read_ahead ? 1 - current : current;
+        if (ok  &&  read_ahead  &&  count > block_count)
+        {
+            unsigned int next_count = samples_read;
+            if (count - block_count < next_count)
+                next_count = (unsigned int) (count - block_count);
+            reader->start_read_blocks(
+                next_block, 0, next_count, iter, &reads[next]);
+            started[next] = true;
+        }
 
-    if (ok  &&  write_ok)
-    {
-        write_ok =
-            IF_(parse->send_sample_count,
-                BUFFER_ITEM(&out_buffer, samples))  &&
-            send_timestamp_header(
-                parse->send_timestamp, parse->send_id0, &out_buffer,
-                parse->reader, ix_block, offset)  &&
-            transfer_data(
-                parse, &read_buffers, archive, &out_buffer,
-                &iter, &ts_buffer, ix_block, offset, samples)  &&
-            flush_buffer(&out_buffer);
+        ok = ok  &&
+            write_block_lines(
+                write_lines, iter->count, line_size_out,
+                &reads[current].data, offset, block_count, out_buffer);
+        release_read_batch(&reads[current].batch);
+
+        count -= block_count;
+        ix_block = next_block;
+        offset = 0;
+        current = next;
     }
 
-    release_timestamp_buffer(&ts_buffer);
-    release_write_buffer(&out_buffer);
-    unlock_buffers(&read_buffers);
-    if (archive != -1)
-        TEST_IO(close(archive));
+    /* If we bailed out early there may still be a read in flight, and we
+     * mustn't let go of its buffers until it's done. */
+    for (unsigned int i = 0; i < 2; i ++)
+        if (started[i])
+        {
+            IGNORE(wait_read_batch(&reads[i].batch));
+            release_read_batch(&reads[i].batch);
+        }
 
-    return write_ok;
+    return ok  &&
+        IF_(parse->send_timestamp == SEND_AT_END,
+            write_timestamp_buffer(ts_buffer, out_buffer));
 }
 
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Format specific definitions. */
+/* Large reads are split between several workers, each reading and transposing
+ * whole blocks into its own staging buffer: worker i handles blocks i, i+W,
+ * i+2W and so on of the range.  The staged blocks are sent strictly in turn so
+ * that the output is identical to a sequential transfer. */
+struct transfer_job {
+    const struct read_parse *parse;
+    const struct reader *reader;
+    write_lines_t write_lines;
+    const struct iter_mask *iter;
+    struct write_buffer *out_buffer;
+    struct ts_buffer *ts_buffer;
+    size_t line_size_out;           // Size of a single output line
+    unsigned int ix_block;          // First block of the range
+    unsigned int offset;            // Offset of range into first block
+    uint64_t count;                 // Number of samples in the range
+    unsigned int block_count;       // Number of blocks in the range
+    unsigned int worker_count;      // Stride between blocks of one worker
+    struct locking lock;            // Guards the fields below
+    unsigned int turn;              // Block of the range to be sent next
+    bool ok;                        // Cleared on any failure
+};
 
-/* Forward declaration of the three reader definitions. */
-static struct reader fa_reader;
-static struct reader d_reader;
-static struct reader dd_reader;
+/* Each worker needs its own read buffers and a staging buffer large enough for
+ * a complete block of output. */
+struct transfer_worker {
+    struct transfer_job *job;
+    unsigned int index;             // First block handled by this worker
+    bool own_buffers;               // Set if buffers must be unlocked
+    struct read_buffers buffers;
+    struct write_buffer staging;
+    pthread_t thread;
+    char *error;                    // Error from worker thread
+};
 
 
-static bool read_fa_block(
-    int archive, unsigned int major_block, unsigned int id, void *block)
+/* Returns the index block, first sample and sample count for block s of the
+ * range. */
+static void transfer_block_range(
+    const struct transfer_job *job, unsigned int s,
+    unsigned int *ix_block, unsigned int *first, unsigned int *count)
 {
     const struct disk_header *header = get_header();
-    size_t fa_block_size = FA_ENTRY_SIZE * header->major_sample_count;
-    off64_t offset = (off64_t) (
-        header->major_data_start +
-        (uint64_t) header->major_block_size * major_block +
-        fa_block_size * id);
-    return
-        DO_(request_read())  &&
-        TEST_IO(lseek(archive, offset, SEEK_SET))  &&
-        TEST_read(archive, block, fa_block_size);
+    unsigned int samples_read = job->reader->samples_per_fa_block;
+    uint64_t done = s == 0 ? 0 : (uint64_t) s * samples_read - job->offset;
+    *ix_block = (unsigned int) (
+        ((uint64_t) job->ix_block + s) % header->major_block_count);
+    *first = s == 0 ? job->offset : 0;
+    *count = samples_read - *first;
+    if (job->count - done < *count)
+        *count = (unsigned int) (job->count - done);
 }
 
-static bool read_d_block(
-    int archive, unsigned int major_block, unsigned int id, void *block)
+
+/* Waits until block s of the range is next to be sent and sends it from the
+ * worker's staging buffer.  If anything has gone wrong all the workers give
+ * up. */
+static bool send_block_in_turn(
+    struct transfer_job *job, struct transfer_worker *worker,
+    unsigned int s, unsigned int ix_block, bool staged)
 {
-    const struct disk_header *header = get_header();
-    size_t fa_block_size = FA_ENTRY_SIZE * header->major_sample_count;
-    size_t d_block_size =
-        sizeof(struct decimated_data) * header->d_sample_count;
-    off64_t offset = (off64_t) (
-        header->major_data_start +
-        (uint64_t) header->major_block_size * major_block +
-        header->archive_mask_count * fa_block_size +
-        d_block_size * id);
-    return
-        DO_(request_read())  &&
-        TEST_IO(lseek(archive, offset, SEEK_SET))  &&
-        TEST_read(archive, block, d_block_size);
+    bool ok;
+    LOCK(job->lock);
+    while (job->ok  &&  job->turn != s)
+        pwait(&job->lock);
+    ok = staged  &&  job->ok  &&
+        send_extended_timestamp(
+            job->parse->send_timestamp, job->ts_buffer, job->out_buffer,
+            ix_block)  &&
+        send_delayed_buffer(&worker->staging, job->out_buffer);
+    job->ok = ok;
+    job->turn += 1;
+    pbroadcast(&job->lock);
+    UNLOCK(job->lock);
+    return ok;
 }
 
-static bool read_dd_block(
-    int archive, unsigned int major_block, unsigned int id, void *block)
+
+static void *transfer_worker(void *context)
 {
-    const struct disk_header *header = get_header();
-    size_t offset =
-        header->dd_total_count * id +
-        dd_reader.samples_per_fa_block * major_block;
+    struct transfer_worker *worker = context;
+    struct transfer_job *job = worker->job;
+    const struct iter_mask *iter = job->iter;
 
-    const struct decimated_data *dd_area = get_dd_area();
-    memcpy(block, dd_area + offset,
-        sizeof(struct decimated_data) * dd_reader.samples_per_fa_block);
-    return true;
+    struct read_request requests[iter->count];
+    void *data[iter->count];
+    struct block_reads reads = {
+        .buffers = &worker->buffers,
+        .data = { .count = iter->count, .buffers = data },
+        .requests = requests };
+
+    bool ok = true;
+    for (unsigned int s = worker->index;
+         ok  &&  s < job->block_count; s += job->worker_count)
+    {
+        unsigned int ix_block, first, count;
+        transfer_block_range(job, s, &ix_block, &first, &count);
+        job->reader->start_read_blocks(ix_block, first, count, iter, &reads);
+        bool staged =
+            wait_read_batch(&reads.batch)  &&
+            write_block_lines(
+                job->write_lines, iter->count, job->line_size_out,
+                &reads.data, first, count, &worker->staging);
+        release_read_batch(&reads.batch);
+        ok = send_block_in_turn(job, worker, s, ix_block, staged);
+    }
+    return NULL;
 }
 
 
-static void fa_write_lines(
-    unsigned int line_count, unsigned int field_count,
-    struct read_buffers *read_buffers, unsigned int offset,
-    unsigned int data_mask, void *p)
+static void *transfer_worker_thread(void *context)
 {
-    struct fa_entry *output = (struct fa_entry *) p;
-    for (unsigned int l = 0; l < line_count; l ++)
-    {
-        for (unsigned int i = 0; i < field_count; i ++)
-            *output++ = ((struct fa_entry *) read_buffers->buffers[i])[offset];
-        offset += 1;
-    }
+    struct transfer_worker *worker = context;
+    push_error_handling();
+    transfer_worker(worker);
+    worker->error = pop_error_handling(true);
+    return NULL;
 }
 
-static void d_write_lines(
-    unsigned int line_count, unsigned int field_count,
-    struct read_buffers *read_buffers, unsigned int offset,
-    unsigned int data_mask, void *p)
+
+/* Gathers buffers for as many workers as the pool will allow, up to limit.  The
+ * first worker uses our own read buffers, the second the read-ahead buffers if
+ * we have them, and the rest must find their own under the same admission.
+ * Returns the number of workers ready to run. */
+static unsigned int prepare_transfer_workers(
+    struct transfer_job *job, struct transfer_worker workers[],
+    unsigned int limit, struct read_buffers read_buffers[2])
 {
-    struct fa_entry *output = (struct fa_entry *) p;
-    for (unsigned int l = 0; l < line_count; l ++)
+    /* Staging must hold a complete block of output lines, bearing in mind that
+     * lines are never split between buffers and that each buffer may need room
+     * for a format header. */
+    struct formatter *formatter = job->out_buffer->formatter;
+    unsigned int lines_per_buffer = (unsigned int) (
+        (pooled_buffer_size - format_header_size(formatter)) /
+        job->line_size_out);
+    if (lines_per_buffer == 0)
+        return 0;
+    unsigned int staging_count =
+        round_up(job->reader->samples_per_fa_block, lines_per_buffer);
+
+    unsigned int count = 0;
+    while (count < limit)
     {
-        for (unsigned int i = 0; i < field_count; i ++)
+        struct transfer_worker *worker = &workers[count];
+        *worker = (struct transfer_worker) {
+            .job = job, .index = count,
+            .staging = { .file = -1, .formatter = formatter } };
+        worker->own_buffers = count >= 2  ||  read_buffers[count].count == 0;
+        if (worker->own_buffers)
+        {
+            if (!try_lock_buffers(read_buffers[0].admission,
+                    &worker->buffers, job->iter->count))
+                break;
+        }
+        else
+            worker->buffers = read_buffers[count];
+        if (!try_allocate_write_buffer(read_buffers[0].admission,
+                &worker->staging, staging_count))
         {
-            /* Each input buffer is an array of decimated_data structures which
-             * we index by offset, but we then cast this to an array of fa_entry
-             * structures to allow the individual fields to be selected by the
-             * data_mask. */
-            struct fa_entry *input = (struct fa_entry *)
-                &((struct decimated_data *) read_buffers->buffers[i])[offset];
-            if (data_mask & 1)  *output++ = input[0];
-            if (data_mask & 2)  *output++ = input[1];
-            if (data_mask & 4)  *output++ = input[2];
-            if (data_mask & 8)  *output++ = input[3];
+            release_write_buffer(&worker->staging);
+            if (worker->own_buffers)
+                unlock_buffers(&worker->buffers);
+            break;
         }
-        offset += 1;
+        count += 1;
     }
+    return count;
 }
 
 
-static size_t fa_output_size(unsigned int data_mask)
+static void release_transfer_workers(
+    struct transfer_worker workers[], unsigned int count)
 {
-    return FA_ENTRY_SIZE;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        release_write_buffer(&workers[i].staging);
+        if (workers[i].own_buffers)
+            unlock_buffers(&workers[i].buffers);
+    }
 }
 
-/* For decimated data the data mask selects individual data fields that are
- * going to be emitted, so we count them here. */
-static size_t d_output_size(unsigned int data_mask)
+
+static void abort_transfer(struct transfer_job *job)
 {
-    unsigned int count =
-        ((data_mask >> 0) & 1) + ((data_mask >> 1) & 1) +
-        ((data_mask >> 2) & 1) + ((data_mask >> 3) & 1);
-    return count * FA_ENTRY_SIZE;
+    LOCK(job->lock);
+    job->ok = false;
+    pbroadcast(&job->lock);
+    UNLOCK(job->lock);
 }
 
 
-static struct reader fa_reader = {
-    .read_block = read_fa_block,
-    .write_lines = fa_write_lines,
-    .output_size = fa_output_size,
-    .decimation_log2 = 0,
-};
-
-static struct reader d_reader = {
-    .read_block = read_d_block,
-    .write_lines = d_write_lines,
-    .output_size = d_output_size,
-};
+/* Runs the prepared workers, with the calling thread as the first worker.  If a
+ * worker thread can't be started its blocks will never be sent, so the whole
+ * transfer fails. */
+static bool run_transfer_workers(
+    struct transfer_job *job, struct transfer_worker workers[])
+{
+    unsigned int started = 1;
+    while (started < job->worker_count)
+    {
+        struct transfer_worker *worker = &workers[started];
+        if (!TEST_0(pthread_create(
+                &worker->thread, NULL, transfer_worker_thread, worker)))
+            break;
+        started += 1;
+    }
+    if (started < job->worker_count)
+        abort_transfer(job);
 
-static struct reader dd_reader = {
-    .read_block = read_dd_block,
-    .write_lines = d_write_lines,
-    .output_size = d_output_size,
-};
+    transfer_worker(&workers[0]);
+    for (unsigned int i = 1; i < started; i ++)
+    {
+        ASSERT_0(pthread_join(workers[i].thread, NULL));
+        report_worker_error(workers[i].error);
+    }
+    return job->ok;
+}
 
 
+/* Reads spanning more than one block are run in parallel if possible, otherwise
+ * we fall back to a sequential transfer. */
+static bool transfer_data(
+    const struct read_parse *parse,
+    const struct reader *reader, write_lines_t write_lines,
+    struct read_buffers read_buffers[2],
+    struct write_buffer *out_buffer, struct iter_mask *iter,
+    struct ts_buffer *ts_buffer,
+    unsigned int ix_block, unsigned int offset, uint64_t count)
+{
+    struct transfer_job job = {
+        .parse = parse,
+        .reader = reader,
+        .write_lines = write_lines,
+        .iter = iter,
+        .out_buffer = out_buffer,
+        .ts_buffer = ts_buffer,
+        .line_size_out = iter->count * reader->output_size(parse->data_mask),
+        .ix_block = ix_block,
+        .offset = offset,
+        .count = count,
+        .block_count = round_up(offset + count, reader->samples_per_fa_block),
+        .turn = 0,
+        .ok = true,
+    };
+    unsigned int limit = worker_limit(job.block_count);
+    struct transfer_worker workers[limit];
+    job.worker_count =
+        limit > 1 ? prepare_transfer_workers(&job, workers, limit, read_buffers)
+        : 0;
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Read request parsing. */
+    bool ok;
+    if (job.worker_count > 1)
+    {
+        initialise_locking(&job.lock);
+        ok =
+            run_transfer_workers(&job, workers)  &&
+            IF_(parse->send_timestamp == SEND_AT_END,
+                write_timestamp_buffer(ts_buffer, out_buffer));
+    }
+    else
+        ok = transfer_sequential(
+            parse, reader, write_lines, read_buffers, out_buffer, iter,
+            ts_buffer, ix_block, offset, count);
+    release_transfer_workers(workers, job.worker_count);
+    return ok;
+}
 
-/* A read request specifies the following:
- *
- *  Data source: normal FA data, decimated or double decimated data.
- *  For decimated data, a field mask is specifed
- *  Mask of BPM ids to be retrieved
- *  Data start point as a timestamp
- *
- * The syntax is very simple (no spaces allowed):
- *
- *  read-request = "R" source "M" filter-mask start end options
- *  source = "F" | "D" [ "D" ] [ "F" data-mask ]
- *  data-mask = integer
- *  start = time-or-seconds
- *  end = "N" samples | "E" time-or-seconds
- *  time-or-seconds = "T" date-time | "S" seconds [ "." nanoseconds ]
- *  samples = integer
- *  options = [ "N" ] [ "A" ] [ "T" [ "E" | "A" ] ] [ "Z" ] [ "C" [ "Z" ] ]
- *
- * The options can only appear in the order given and have the following
- * meanings:
- *
- *  N   Send sample count as part of data stream
- *  A   Send all data there is, even if samples is too large or starts too early
- *  T   Send timestamp at head of dataset
- *  TE  Send extended timestamp at head of dataset and with each major block
- *  TA  Send extended timestamp at head and tail of dataset
- *  Z   Send id0 with data at the same time as the timestamp (or at start)
- *  C   Ensure no gaps in selected dataset, fail if any
- *  CZ  Include gaps generated by id0 in gap check
- */
 
-/* source = "F" | "D" [ "D" ] [ "F" data-mask ] . */
-static bool parse_source(const char **string, struct read_parse *parse)
+/* When only a single id of FA data is requested each block is sent straight
+ * from the archive to the socket, after flushing any timestamp data. */
+static bool transfer_direct(
+    const struct read_parse *parse, struct write_buffer *out_buffer,
+    const struct iter_mask *iter, struct ts_buffer *ts_buffer,
+    unsigned int ix_block, unsigned int offset, uint64_t count)
 {
-    if (read_char(string, 'F'))
-    {
-        parse->reader = &fa_reader;
-        return true;
+    const struct disk_header *header = get_header();
+    unsigned int samples_read = header->major_sample_count;
+    size_t fa_block_size = FA_ENTRY_SIZE * samples_read;
+
+    bool ok = true;
+    while (ok  &&  count > 0)
+    {
+        unsigned int block_count = samples_read - offset;
+        if (count < block_count)
+            block_count = (unsigned int) count;
+        off64_t start = (off64_t) (
+            header->major_data_start +
+            (uint64_t) header->major_block_size * ix_block +
+            fa_block_size * iter->index[0] + FA_ENTRY_SIZE * offset);
+
+        ok =
+            send_extended_timestamp(
+                parse->send_timestamp, ts_buffer, out_buffer, ix_block)  &&
+            flush_buffer(out_buffer)  &&
+            send_archive_data(
+                out_buffer->file, start, FA_ENTRY_SIZE * block_count);
+
+        count -= block_count;
+        ix_block += 1;
+        if (ix_block >= header->major_block_count)
+            ix_block = 0;
+        offset = 0;
+    }
+
+    return ok  &&
+        IF_(parse->send_timestamp == SEND_AT_END,
+            write_timestamp_buffer(ts_buffer, out_buffer));
+}
+
+
+/* Steps point_end on by step plus one extra sample whenever the accumulated
+ * remainder error reaches a whole sample. */
+static void advance_point_end(
+    uint64_t *point_end, uint64_t *error,
+    uint64_t step, uint64_t step_rem, uint64_t points)
+{
+    *point_end += step;
+    *error += step_rem;
+    if (*error >= points)
+    {
+        *error -= points;
+        *point_end += 1;
+    }
+}
+
+
+/* Reduces samples from the given reader to points lines of envelopes.  Each
+ * point merges either samples/points samples or one more, with the longer
+ * points spread evenly through the range.  Any samples beyond the last point
+ * are not read. */
+static bool transfer_envelope(
+    const struct read_parse *parse, const struct reader *reader,
+    struct read_buffers *read_buffers, struct write_buffer *out_buffer,
+    const struct iter_mask *iter, uint64_t points,
+    unsigned int ix_block, unsigned int offset, uint64_t samples)
+{
+    const struct disk_header *header = get_header();
+    size_t line_size_out =
+        iter->count * d_reader.output_size(parse->data_mask);
+    unsigned int samples_read = reader->samples_per_fa_block;
+
+    struct read_request requests[iter->count];
+    void *data[iter->count];
+    struct block_reads reads = {
+        .buffers = read_buffers,
+        .data = { .count = iter->count, .buffers = data },
+        .requests = requests };
+    struct envelope envelopes[iter->count];
+    for (unsigned int i = 0; i < iter->count; i ++)
+        reset_envelope(&envelopes[i]);
+
+    /* Point boundaries are stepped along with a Bresenham style error term so
+     * that point p ends at samples * (p + 1) / points without overflow. */
+    uint64_t step = samples / points;
+    uint64_t step_rem = samples % points;
+    uint64_t error = 0;
+    uint64_t point_end = 0;
+    uint64_t sample = 0;
+    advance_point_end(&point_end, &error, step, step_rem, points);
+
+    bool ok = true;
+    while (ok  &&  sample < samples)
+    {
+        unsigned int block_count = samples_read - offset;
+        if (samples - sample < block_count)
+            block_count = (unsigned int) (samples - sample);
+
+        reader->start_read_blocks(ix_block, offset, block_count, iter, &reads);
+        ok = wait_read_batch(&reads.batch);
+        while (ok  &&  block_count > 0)
+        {
+            unsigned int count = block_count;
+            if (point_end - sample < count)
+                count = (unsigned int) (point_end - sample);
+            for (unsigned int i = 0; i < iter->count; i ++)
+                reader->accumulate_envelope(
+                    &envelopes[i], reads.data.buffers[i], offset, count,
+                    1U << reader->decimation_log2);
+            offset += count;
+            sample += count;
+            block_count -= count;
+
+            if (sample == point_end)
+            {
+                ok = write_envelope_line(
+                    envelopes, iter->count, parse->data_mask,
+                    line_size_out, out_buffer);
+                advance_point_end(
+                    &point_end, &error, step, step_rem, points);
+            }
+        }
+        release_read_batch(&reads.batch);
+
+        ix_block += 1;
+        if (ix_block >= header->major_block_count)
+            ix_block = 0;
+        offset = 0;
+    }
+    return ok;
+}
+
+
+/* Merges count samples from the given reader starting at offset samples into
+ * block ix_block, where offset may run past the end of the block, into one
+ * envelope for each id. */
+static bool accumulate_range(
+    const struct reader *reader, struct block_reads *reads,
+    const struct iter_mask *iter, struct envelope envelopes[],
+    unsigned int ix_block, uint64_t offset, uint64_t count)
+{
+    const struct disk_header *header = get_header();
+    unsigned int samples_read = reader->samples_per_fa_block;
+    ix_block = (unsigned int) (
+        (ix_block + offset / samples_read) % header->major_block_count);
+    unsigned int block_offset = (unsigned int) (offset % samples_read);
+
+    bool ok = true;
+    while (ok  &&  count > 0)
+    {
+        unsigned int block_count = samples_read - block_offset;
+        if (count < block_count)
+            block_count = (unsigned int) count;
+
+        reader->start_read_blocks(
+            ix_block, block_offset, block_count, iter, reads);
+        ok = wait_read_batch(&reads->batch);
+        if (ok)
+            for (unsigned int i = 0; i < iter->count; i ++)
+                reader->accumulate_envelope(
+                    &envelopes[i], reads->data.buffers[i],
+                    block_offset, block_count, 1U << reader->decimation_log2);
+        release_read_batch(&reads->batch);
+
+        count -= block_count;
+        ix_block += 1;
+        if (ix_block >= header->major_block_count)
+            ix_block = 0;
+        block_offset = 0;
+    }
+    return ok;
+}
+
+
+/* Computes statistics over the whole range of count FA samples starting at
+ * offset in ix_block as a single line of envelopes.  Whole DD samples are used
+ * for as much of the range as possible, the rest is covered by D samples, and
+ * only what remains at the two ends is read as FA data. */
+static bool transfer_statistics(
+    const struct read_parse *parse,
+    struct read_buffers *read_buffers, struct write_buffer *out_buffer,
+    const struct iter_mask *iter,
+    unsigned int ix_block, unsigned int offset, uint64_t count)
+{
+    size_t line_size_out =
+        iter->count * d_reader.output_size(parse->data_mask);
+
+    struct read_request requests[iter->count];
+    void *data[iter->count];
+    struct block_reads reads = {
+        .buffers = read_buffers,
+        .data = { .count = iter->count, .buffers = data },
+        .requests = requests };
+    struct envelope envelopes[iter->count];
+    for (unsigned int i = 0; i < iter->count; i ++)
+        reset_envelope(&envelopes[i]);
+
+    /* Work from the coarsest source to the finest, covering the largest
+     * aligned run of the range left uncovered at each step.  As major blocks
+     * are whole numbers of DD samples we can align relative to ix_block. */
+    const struct reader *readers[] = { &dd_reader, &d_reader, &fa_reader };
+    uint64_t start = offset;
+    uint64_t end = offset + count;
+    uint64_t done_start = end, done_end = end; // Range already covered
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < ARRAY_SIZE(readers); i ++)
+    {
+        const struct reader *reader = readers[i];
+        unsigned int log2 = reader->decimation_log2;
+        uint64_t factor = 1U << log2;
+        /* Aligned run of whole samples inside the range. */
+        uint64_t first = (start + factor - 1) >> log2;
+        uint64_t last = end >> log2;
+        if (first >= last)
+            continue;
+        if (done_start == done_end)
+        {
+            /* Nothing covered yet, so take the whole run. */
+            ok = accumulate_range(reader, &reads, iter, envelopes,
+                ix_block, first, last - first);
+            done_start = first << log2;
+            done_end = last << log2;
+        }
+        else
+        {
+            /* Extend the covered range at either end. */
+            uint64_t head = done_start >> log2;
+            uint64_t tail = done_end >> log2;
+            ok =
+                IF_(first < head,
+                    accumulate_range(reader, &reads, iter, envelopes,
+                        ix_block, first, head - first))  &&
+                IF_(tail < last,
+                    accumulate_range(reader, &reads, iter, envelopes,
+                        ix_block, tail, last - tail));
+            if (first < head)
+                done_start = first << log2;
+            if (tail < last)
+                done_end = last << log2;
+        }
+    }
+
+    return ok  &&
+        write_envelope_line(
+            envelopes, iter->count, parse->data_mask,
+            line_size_out, out_buffer);
+}
+
+
+/* A power spectrum is computed by a number of workers in parallel, each taking
+ * the next major block of the range in turn and adding its spectra into the
+ * shared totals.  Welch segments never cross block boundaries, so gaps in the
+ * archive between blocks don't disturb the spectrum. */
+struct spectrum_job {
+    const struct spectrum *spectrum;
+    const struct iter_mask *iter;
+    unsigned int length;            // FFT length
+    double *power;                  // Totals, length/2 X,Y pairs for each id
+    struct locking lock;            // Guards all the fields below
+    unsigned int ix_block;          // Next block to be handed out
+    unsigned int offset;            // Offset of remaining range into block
+    uint64_t count;                 // FA samples still to be handed out
+    bool ok;                        // Cleared if any read fails
+};
+
+/* Each worker needs its own set of read buffers. */
+struct spectrum_worker {
+    struct spectrum_job *job;
+    struct read_buffers buffers;
+    pthread_t thread;
+    char *error;                    // Error from worker thread
+};
+
+
+/* Hands out the next block of the range, returns false when there is no more
+ * work to do or if an error has occurred. */
+static bool next_spectrum_block(
+    struct spectrum_job *job,
+    unsigned int *ix_block, unsigned int *first, unsigned int *count)
+{
+    const struct disk_header *header = get_header();
+    bool more;
+    LOCK(job->lock);
+    more = job->ok  &&  job->count > 0;
+    if (more)
+    {
+        *ix_block = job->ix_block;
+        *first = job->offset;
+        *count = header->major_sample_count - job->offset;
+        if (job->count < *count)
+            *count = (unsigned int) job->count;
+        job->count -= *count;
+        job->offset = 0;
+        job->ix_block += 1;
+        if (job->ix_block >= header->major_block_count)
+            job->ix_block = 0;
+    }
+    UNLOCK(job->lock);
+    return more;
+}
+
+
+/* Adds the power computed by one worker for one id into the totals. */
+static void add_spectrum_power(
+    struct spectrum_job *job, unsigned int id, const double power[])
+{
+    double *total = &job->power[job->length * id];
+    LOCK(job->lock);
+    for (unsigned int k = 0; k < job->length; k ++)
+        total[k] += power[k];
+    UNLOCK(job->lock);
+}
+
+
+static void *spectrum_worker(void *context)
+{
+    struct spectrum_worker *worker = context;
+    struct spectrum_job *job = worker->job;
+    unsigned int id_count = job->iter->count;
+    unsigned int power_count = job->length;     // length/2 X,Y pairs
+
+    struct read_request requests[id_count];
+    void *data[id_count];
+    struct block_reads reads = {
+        .buffers = &worker->buffers,
+        .data = { .count = id_count, .buffers = data },
+        .requests = requests };
+    void *workspace = malloc(spectrum_workspace_size(job->spectrum));
+    double *power = malloc(power_count * sizeof(double));
+
+    unsigned int ix_block, first, count;
+    while (next_spectrum_block(job, &ix_block, &first, &count))
+    {
+        /* Blocks too short for a single segment are not worth reading. */
+        if (welch_segments(job->length, count) == 0)
+            continue;
+
+        fa_reader.start_read_blocks(ix_block, first, count, job->iter, &reads);
+        bool ok = wait_read_batch(&reads.batch);
+        for (unsigned int i = 0; ok  &&  i < id_count; i ++)
+        {
+            memset(power, 0, power_count * sizeof(double));
+            accumulate_spectrum(job->spectrum,
+                (const struct fa_entry *) reads.data.buffers[i] + first,
+                count, workspace, power);
+            add_spectrum_power(job, i, power);
+        }
+        release_read_batch(&reads.batch);
+
+        if (!ok)
+        {
+            LOCK(job->lock);
+            job->ok = false;
+            UNLOCK(job->lock);
+        }
+    }
+
+    free(workspace);
+    free(power);
+    return NULL;
+}
+
+
+static void *spectrum_worker_thread(void *context)
+{
+    struct spectrum_worker *worker = context;
+    push_error_handling();
+    spectrum_worker(worker);
+    worker->error = pop_error_handling(true);
+    return NULL;
+}
+
+
+/* Scales the accumulated power into one sided power spectral density and sends
+ * it, optionally condensed into logarithmically spaced groups of bins in the
+ * same way as the viewer.  Each group of bins is sent as its mean. */
+static bool write_spectrum(
+    const struct read_parse *parse, struct write_buffer *out_buffer,
+    unsigned int id_count, const double power[], uint32_t segments,
+    double sample_frequency, double window_power)
+{
+    unsigned int length = parse->fft_length;
+    unsigned int bins = length / 2;
+
+    /* Each group of bins is identified by its first bin and bin count. */
+    unsigned int *starts = malloc(bins * sizeof(unsigned int));
+    unsigned int *counts = malloc(bins * sizeof(unsigned int));
+    uint32_t groups;
+    if (parse->log_bins > 0)
+    {
+        /* The DC bin is skipped. */
+        groups = compute_log_bins(bins - 1, parse->log_bins, counts);
+        for (unsigned int g = 0, start = 1; g < groups; g ++)
+        {
+            starts[g] = start;
+            start += counts[g];
+        }
+    }
+    else
+    {
+        groups = bins;
+        for (unsigned int g = 0; g < groups; g ++)
+        {
+            starts[g] = g;
+            counts[g] = 1;
+        }
+    }
+
+    /* The frequency of a group is the frequency of its last bin. */
+    bool ok =
+        BUFFER_ITEM(out_buffer, segments)  &&
+        BUFFER_ITEM(out_buffer, groups);
+    for (unsigned int g = 0; ok  &&  g < groups; g ++)
+    {
+        float frequency = (float) (
+            sample_frequency * (starts[g] + counts[g] - 1) / length);
+        ok = BUFFER_ITEM(out_buffer, frequency);
+    }
+
+    /* Every bin except DC collects the power of its negative frequency. */
+    double scale = 2 / (sample_frequency * window_power * segments);
+    size_t line_size_out = id_count * 2 * sizeof(float);
+    for (unsigned int g = 0; ok  &&  g < groups; g ++)
+    {
+        size_t buf_length;
+        float *output = get_buffer(out_buffer, line_size_out, &buf_length);
+        ok = output != NULL;
+        if (ok)
+        {
+            for (unsigned int i = 0; i < id_count; i ++)
+            {
+                const double *id_power = &power[2 * (bins * i + starts[g])];
+                double x = 0, y = 0;
+                for (unsigned int k = 0; k < counts[g]; k ++)
+                {
+                    x += id_power[2*k];
+                    y += id_power[2*k + 1];
+                }
+                double group_scale = scale / counts[g];
+                if (starts[g] == 0)
+                    group_scale /= 2;
+                *output++ = (float) (x * group_scale);
+                *output++ = (float) (y * group_scale);
+            }
+            release_buffer(out_buffer, line_size_out);
+        }
+    }
+
+    free(starts);
+    free(counts);
+    return ok;
+}
+
+
+/* Computes the power spectral density of each id over the range.  The calling
+ * thread is one of the workers and uses the read buffers already allocated.
+ * Extra workers are started for the remaining processors (there's no point in
+ * having more workers than blocks) so long as the buffer pool can provide
+ * their read buffers under the same admission. */
+static bool transfer_spectrum(
+    const struct read_parse *parse,
+    struct read_buffers *read_buffers, struct write_buffer *out_buffer,
+    const struct iter_mask *iter, uint32_t segments,
+    unsigned int ix_block, unsigned int offset, uint64_t count)
+{
+    const struct disk_header *header = get_header();
+    unsigned int length = parse->fft_length;
+
+    /* The sample frequency is taken from the durations of the blocks read. */
+    unsigned int blocks = round_up(offset + count, header->major_sample_count);
+    uint64_t duration = 0;
+    for (unsigned int i = 0; i < blocks; i ++)
+        duration +=
+            read_index((ix_block + i) % header->major_block_count)->duration;
+    double sample_frequency =
+        1e6 * blocks * header->major_sample_count / (double) duration;
+
+    struct spectrum *spectrum = create_spectrum(length);
+    struct spectrum_job job = {
+        .spectrum = spectrum,
+        .iter = iter,
+        .length = length,
+        .power = calloc((size_t) iter->count * length, sizeof(double)),
+        .ix_block = ix_block,
+        .offset = offset,
+        .count = count,
+        .ok = true,
+    };
+    initialise_locking(&job.lock);
+
+    unsigned int worker_count = worker_limit(blocks);
+    struct spectrum_worker workers[worker_count];
+    workers[0] = (struct spectrum_worker) {
+        .job = &job, .buffers = *read_buffers };
+    unsigned int started = 1;
+    while (started < worker_count)
+    {
+        struct spectrum_worker *worker = &workers[started];
+        *worker = (struct spectrum_worker) { .job = &job };
+        if (!try_lock_buffers(
+                read_buffers->admission, &worker->buffers, iter->count))
+            break;
+        else if (!TEST_0(pthread_create(
+                &worker->thread, NULL, spectrum_worker_thread, worker)))
+        {
+            unlock_buffers(&worker->buffers);
+            break;
+        }
+        started += 1;
+    }
+
+    spectrum_worker(&workers[0]);
+    for (unsigned int i = 1; i < started; i ++)
+    {
+        ASSERT_0(pthread_join(workers[i].thread, NULL));
+        unlock_buffers(&workers[i].buffers);
+        report_worker_error(workers[i].error);
+    }
+
+    bool ok = job.ok  &&
+        write_spectrum(
+            parse, out_buffer, iter->count, job.power, segments,
+            sample_frequency, spectrum_window_power(spectrum));
+    destroy_spectrum(spectrum);
+    free(job.power);
+    return ok;
+}
+
+
+/* Checks that the FFT length fits into a major block and counts the segments
+ * in the range, of which there must be at least one. */
+static bool count_spectrum_segments(
+    unsigned int length, unsigned int offset, uint64_t samples,
+    uint32_t *segments)
+{
+    unsigned int block_samples = fa_reader.samples_per_fa_block;
+    uint64_t total = 0;
+    bool ok = TEST_OK_(length <= block_samples,
+        "FFT length cannot be longer than %u", block_samples);
+    while (ok  &&  samples > 0)
+    {
+        unsigned int count = block_samples - offset;
+        if (samples < count)
+            count = (unsigned int) samples;
+        total += welch_segments(length, count);
+        samples -= count;
+        offset = 0;
+    }
+    return ok  &&
+        TEST_OK_(total > 0, "Too few samples for FFT length %u", length)  &&
+        TEST_OK_(total <= UINT32_MAX, "Too many segments requested")  &&
+        DO_(*segments = (uint32_t) total);
+}
+
+
+/* For an envelope read the range is first computed in FA samples, and then the
+ * coarsest source which still has at least one sample per point is selected,
+ * and the offset and sample count are converted to units of this source. */
+static bool select_envelope_reader(
+    unsigned int points, const struct reader **reader,
+    uint64_t *samples, unsigned int *offset)
+{
+    const struct reader *readers[] = { &dd_reader, &d_reader, &fa_reader };
+    for (unsigned int i = 0; i < ARRAY_SIZE(readers); i ++)
+        if (*samples >> readers[i]->decimation_log2 >= points)
+        {
+            *reader = readers[i];
+            *samples >>= readers[i]->decimation_log2;
+            *offset >>= readers[i]->decimation_log2;
+            return true;
+        }
+    return FAIL_("Only %"PRIu64" samples available for %u points",
+        *samples, points);
+}
+
+
+/* For a boxcar decimated read the coarsest source whose decimation divides the
+ * requested factor is selected, so that each output point merges a whole
+ * number of samples.  Any trailing partial point is dropped. */
+static bool select_decimation_reader(
+    unsigned int decimation, const struct reader **reader,
+    uint64_t *samples, unsigned int *offset, uint64_t *points)
+{
+    const struct reader *readers[] = { &dd_reader, &d_reader, &fa_reader };
+    for (unsigned int i = 0; i < ARRAY_SIZE(readers); i ++)
+    {
+        unsigned int factor = 1U << readers[i]->decimation_log2;
+        if (decimation % factor == 0)
+        {
+            *reader = readers[i];
+            *points = *samples / decimation;
+            *samples = *points * (decimation / factor);
+            *offset >>= readers[i]->decimation_log2;
+            break;
+        }
+    }
+    return TEST_OK_(*points > 0,
+        "Fewer than %u samples available for decimation", decimation);
+}
+
+
+/* For an automatic resolution read the smallest decimation giving no more than
+ * max_points samples is rounded up to a multiple of the coarsest stored level
+ * which is no coarser than this.  If this is exactly D or DD data then the
+ * stored data is sent as it is, otherwise boxcar decimation is computed.  The
+ * result has at least half of max_points samples, if there is enough data. */
+static bool select_auto_reader(
+    unsigned int max_points, unsigned int data_mask,
+    const struct reader **reader, write_lines_t *write_lines,
+    uint64_t *samples, unsigned int *offset,
+    unsigned int *decimation, uint64_t *points, bool *reduce)
+{
+    const struct reader *readers[] = { &dd_reader, &d_reader, &fa_reader };
+    if (!TEST_OK_(*samples > 0, "No samples in selected range"))
+        return false;
+    uint64_t factor = (*samples + max_points - 1) / max_points;
+    unsigned int i = 0;
+    while (i < ARRAY_SIZE(readers) - 1  &&
+           (1U << readers[i]->decimation_log2) > factor)
+        i += 1;
+    unsigned int level_log2 = readers[i]->decimation_log2;
+    uint64_t level_factor = 1U << level_log2;
+    factor = (factor + level_factor - 1) / level_factor * level_factor;
+    if (!TEST_OK_(factor <= UINT32_MAX, "Too few points requested"))
+        return false;
+
+    *decimation = (unsigned int) factor;
+    *reduce = factor != level_factor  ||  level_log2 == 0;
+    if (*reduce)
+        return select_decimation_reader(
+            *decimation, reader, samples, offset, points);
+    else
+    {
+        *reader = readers[i];
+        *write_lines = readers[i]->select_write_lines(data_mask);
+        *samples >>= level_log2;
+        *offset >>= level_log2;
+        return true;
+    }
+}
+
+
+/* Reads which fit within a single index block are treated as interactive and
+ * are admitted ahead of larger bulk reads. */
+static enum admission_priority read_priority(
+    const struct reader *reader, unsigned int offset, uint64_t samples)
+{
+    if (offset + samples <= reader->samples_per_fa_block)
+        return PRIORITY_INTERACTIVE;
+    else
+        return PRIORITY_BULK;
+}
+
+
+static bool read_data(
+    int scon, const char *client_name, const struct read_parse *parse)
+{
+    unsigned int ix_block, offset;      // Index of first point to send
+    struct iter_mask iter = { 0 };      // List of IDs to read
+    uint64_t samples = parse->samples;  // Number of samples to return
+    bool direct = false;                // Send straight from the archive
+    /* The reader and transposition can be changed for reduced and automatic
+     * resolution reads. */
+    const struct reader *reader = parse->reader;
+    write_lines_t write_lines = parse->write_lines;
+    bool reduce = reduced_read(parse);
+    uint64_t points = parse->points;    // Number of reduced points to send
+    unsigned int decimation = parse->decimation;    // Reported if automatic
+    uint32_t segments = 0;              // Number of spectrum segments
+    unsigned int ts_count = 0;          // Buffers needed for timestamps
+
+    /* All buffers are taken under a single admission to the buffer pool.
+     * Four lots of buffers from the pool: read buffers, optional read-ahead
+     * buffers, write buffer and an optional timestamp buffer.  The read
+     * buffers aren't needed if data is sent directly from the archive. */
+    struct read_buffers read_buffers[2] = {     // Arrays of buffers, one per ID
+        { .count = 0, .buffers = NULL }, { .count = 0, .buffers = NULL } };
+    ALLOCATE_WRITE_BUFFER(out_buffer, scon);  // Buffered writes
+    ALLOCATE_TS_BUFFER(ts_buffer);      // For timestamps at end
+    ALLOCATE_ADMISSION(admission);
+
+    bool ok =
+        /* A decimated sample count is converted to FA samples. */
+        IF_(parse->decimation > 0,
+            TEST_OK_(samples <= UINT64_MAX / parse->decimation,
+                "Far too many samples requested")  &&
+            DO_(samples *= parse->decimation))  &&
+        /* Convert timestamps into index block, offset and sample count. */
+        compute_start(
+            reader, parse->start, parse->end, parse->send_all_data,
+            &samples, &ix_block, &offset)  &&
+        /* For envelope and decimated reads choose the source to be reduced. */
+        IF_(parse->points > 0,
+            select_envelope_reader(
+                parse->points, &reader, &samples, &offset))  &&
+        IF_(parse->decimation > 0,
+            select_decimation_reader(
+                parse->decimation, &reader, &samples, &offset, &points))  &&
+        IF_(parse->max_points > 0,
+            select_auto_reader(
+                parse->max_points, parse->data_mask, &reader, &write_lines,
+                &samples, &offset, &decimation, &points, &reduce))  &&
+        IF_(parse->fft_length > 0,
+            count_spectrum_segments(
+                parse->fft_length, offset, samples, &segments))  &&
+        /* If contiguous data requested ensure there are no gaps. */
+        IF_(parse->only_contiguous,
+            check_run(reader, parse->check_id0, ix_block, offset, samples))  &&
+        /* Prepare the iteration mask for efficient data delivery. */
+        mask_to_archive(&parse->read_mask, &iter)  &&
+        DO_(direct =
+            reader->send_direct  &&  !reduce  &&  !parse->encode  &&
+            parse->format == FORMAT_INT32  &&  iter.count == 1)  &&
+        count_timestamp_buffers(
+            parse->send_timestamp, parse->send_id0, &ts_buffer,
+            reader->samples_per_fa_block, samples, &ts_count)  &&
+        /* Wait our turn for all the buffers needed.  This fails if the pool
+         * stays too busy for too long. */
+        admit_buffers(&admission, client_name,
+            read_priority(reader, offset, samples),
+            (direct ? 0 : iter.count) + 1 + ts_count)  &&
+        IF_(!direct, lock_buffers(&admission, &read_buffers[0], iter.count))  &&
+        allocate_write_buffer(&admission, &out_buffer, 1)  &&
+        allocate_timestamp_buffer(&admission, &ts_buffer)  &&
+        DO_(prepare_output(parse, reader, iter.count, &out_buffer));
+    /* Read-ahead is only worth having if more than one block will be read, and
+     * we just go without if the pool is running short. */
+    if (ok  &&  !direct  &&  !reduce  &&
+        samples > reader->samples_per_fa_block - offset)
+        try_lock_buffers(&admission, &read_buffers[1], iter.count);
+    bool write_ok = report_socket_error(scon, client_name, ok);
+
+    if (ok  &&  write_ok)
+    {
+        /* For reduced reads the sample count is the number of points, except
+         * for statistics and spectra where it is the number of FA samples
+         * merged. */
+        uint64_t sample_count =
+            reduce  &&  !parse->statistics  &&  parse->fft_length == 0 ?
+                points : samples;
+        write_ok =
+            IF_(parse->max_points > 0,
+                BUFFER_ITEM(&out_buffer, decimation))  &&
+            IF_(parse->send_sample_count,
+                BUFFER_ITEM(&out_buffer, sample_count))  &&
+            send_timestamp_header(
+                parse->send_timestamp, parse->send_id0, &out_buffer,
+                reader, ix_block, offset)  &&
+            IF_ELSE(direct,
+                transfer_direct(
+                    parse, &out_buffer,
+                    &iter, &ts_buffer, ix_block, offset, samples),
+            IF_ELSE(parse->statistics,
+                transfer_statistics(
+                    parse, &read_buffers[0], &out_buffer,
+                    &iter, ix_block, offset, samples),
+            IF_ELSE(parse->fft_length > 0,
+                transfer_spectrum(
+                    parse, &read_buffers[0], &out_buffer,
+                    &iter, segments, ix_block, offset, samples),
+            IF_ELSE(reduce,
+                transfer_envelope(
+                    parse, reader, &read_buffers[0], &out_buffer,
+                    &iter, points, ix_block, offset, samples),
+                transfer_data(
+                    parse, reader, write_lines, read_buffers, &out_buffer,
+                    &iter, &ts_buffer, ix_block, offset, samples)))))  &&
+            flush_buffer(&out_buffer);
+    }
+
+    release_timestamp_buffer(&ts_buffer);
+    release_write_buffer(&out_buffer);
+    release_output(&out_buffer);
+    unlock_buffers(&read_buffers[1]);
+    unlock_buffers(&read_buffers[0]);
+    release_admission(&admission);
+
+    return write_ok;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Format specific definitions. */
+
+/* Starts reading samples first to first+count from one block of samples of
+ * sample_size bytes for each id in iter, where the block for the first archived
+ * id starts at block_start and the remaining blocks follow in archive order.
+ * The read is widened to page boundaries (within the block) so that short reads
+ * remain efficient, and adjacent ids are read together when whole blocks are
+ * read.  Only whole blocks are shared through the block cache. */
+static void start_read_archive_blocks(
+    off64_t block_start, size_t sample_size, unsigned int block_samples,
+    unsigned int first, unsigned int count,
+    const struct iter_mask *iter, struct block_reads *reads)
+{
+    size_t block_size = sample_size * block_samples;
+    bool shared = first == 0  &&  count == block_samples;
+    for (unsigned int i = 0; i < iter->count; i ++)
+    {
+        off64_t start = block_start + (off64_t) (block_size * iter->index[i]);
+        off64_t end = start + (off64_t) block_size;
+        off64_t read_start = start + (off64_t) (sample_size * first);
+        off64_t read_end = read_start + (off64_t) (sample_size * count);
+
+        /* Round out to page boundaries in the archive, but don't stray outside
+         * this block. */
+        read_start -= read_start % (off64_t) page_size;
+        read_end += ((off64_t) page_size - read_end % (off64_t) page_size) %
+            (off64_t) page_size;
+        if (read_start < start)
+            read_start = start;
+        if (read_end > end)
+            read_end = end;
+
+        reads->requests[i] = (struct read_request) {
+            .offset = read_start,
+            .length = (size_t) (read_end - read_start),
+            .buffer = reads->buffers->buffers[i] + (read_start - start),
+            .shared = shared,
+        };
+    }
+    start_read_batch(&reads->batch, reads->requests, iter->count);
+
+    /* Shared requests may have been redirected to the block cache. */
+    for (unsigned int i = 0; i < iter->count; i ++)
+        reads->data.buffers[i] =
+            shared ? reads->requests[i].buffer : reads->buffers->buffers[i];
+}
+
+static void start_read_fa_blocks(
+    unsigned int major_block, unsigned int first, unsigned int count,
+    const struct iter_mask *iter, struct block_reads *reads)
+{
+    const struct disk_header *header = get_header();
+    off64_t offset = (off64_t) (
+        header->major_data_start +
+        (uint64_t) header->major_block_size * major_block);
+    start_read_archive_blocks(
+        offset, FA_ENTRY_SIZE, header->major_sample_count, first, count,
+        iter, reads);
+}
+
+static void start_read_d_blocks(
+    unsigned int major_block, unsigned int first, unsigned int count,
+    const struct iter_mask *iter, struct block_reads *reads)
+{
+    const struct disk_header *header = get_header();
+    size_t fa_block_size = FA_ENTRY_SIZE * header->major_sample_count;
+    off64_t offset = (off64_t) (
+        header->major_data_start +
+        (uint64_t) header->major_block_size * major_block +
+        header->archive_mask_count * fa_block_size);
+    start_read_archive_blocks(
+        offset, sizeof(struct decimated_data), header->d_sample_count,
+        first, count, iter, reads);
+}
+
+/* DD data is in memory and so is simply copied, leaving an empty batch. */
+static void start_read_dd_blocks(
+    unsigned int major_block, unsigned int first, unsigned int count,
+    const struct iter_mask *iter, struct block_reads *reads)
+{
+    const struct disk_header *header = get_header();
+    const struct decimated_data *dd_area = get_dd_area();
+
+    /* The DD data for the last completed block may still be being written
+     * back, so we need to wait for the writer just as for the other data. */
+    request_read();
+    for (unsigned int i = 0; i < iter->count; i ++)
+    {
+        size_t offset =
+            header->dd_total_count * iter->index[i] +
+            dd_reader.samples_per_fa_block * major_block + first;
+        reads->data.buffers[i] = reads->buffers->buffers[i];
+        memcpy((struct decimated_data *) reads->data.buffers[i] + first,
+            dd_area + offset, sizeof(struct decimated_data) * count);
+    }
+    start_read_batch(&reads->batch, reads->requests, 0);
+}
+
+
+static write_lines_t fa_select_write_lines(unsigned int data_mask)
+{
+    return fa_write_lines;
+}
+
+
+static size_t fa_output_size(unsigned int data_mask)
+{
+    return FA_ENTRY_SIZE;
+}
+
+/* For decimated data the data mask selects individual data fields that are
+ * going to be emitted, so we count them here. */
+static size_t d_output_size(unsigned int data_mask)
+{
+    unsigned int count =
+        ((data_mask >> 0) & 1) + ((data_mask >> 1) & 1) +
+        ((data_mask >> 2) & 1) + ((data_mask >> 3) & 1);
+    return count * FA_ENTRY_SIZE;
+}
+
+
+/* This is the inner loop of large reduced reads of FA data, so it is written
+ * to let the compiler vectorise it, with the running values held locally and
+ * the first sample fixing the origin before the loop.  The weight of FA data is
+ * always one. */
+static void fa_accumulate_envelope(
+    struct envelope *envelope, const void *block,
+    unsigned int offset, unsigned int count, unsigned int weight)
+{
+    const struct fa_entry *input = (const struct fa_entry *) block + offset;
+    if (envelope->count == 0)
+    {
+        envelope->x.origin = input[0].x;
+        envelope->y.origin = input[0].y;
+    }
+
+    int32_t min_x = envelope->x.min, max_x = envelope->x.max;
+    int32_t min_y = envelope->y.min, max_y = envelope->y.max;
+    double origin_x = envelope->x.origin, origin_y = envelope->y.origin;
+    double sum_x = 0, sum_sq_x = 0, sum_y = 0, sum_sq_y = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        int32_t x = input[i].x;
+        int32_t y = input[i].y;
+        min_x = x < min_x ? x : min_x;
+        max_x = x > max_x ? x : max_x;
+        min_y = y < min_y ? y : min_y;
+        max_y = y > max_y ? y : max_y;
+        double dx = (double) x - origin_x;
+        double dy = (double) y - origin_y;
+        sum_x += dx;
+        sum_sq_x += dx * dx;
+        sum_y += dy;
+        sum_sq_y += dy * dy;
+    }
+
+    envelope->x.min = min_x;
+    envelope->x.max = max_x;
+    envelope->x.sum += sum_x;
+    envelope->x.sum_sq += sum_sq_x;
+    envelope->y.min = min_y;
+    envelope->y.max = max_y;
+    envelope->y.sum += sum_y;
+    envelope->y.sum_sq += sum_sq_y;
+    envelope->count += count;
+}
+
+static void d_accumulate_envelope(
+    struct envelope *envelope, const void *block,
+    unsigned int offset, unsigned int count, unsigned int weight)
+{
+    const struct decimated_data *input =
+        (const struct decimated_data *) block + offset;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        bool first = envelope->count == 0;
+        accumulate_axis(&envelope->x, first, weight,
+            input[i].min.x, input[i].max.x, input[i].mean.x, input[i].std.x);
+        accumulate_axis(&envelope->y, first, weight,
+            input[i].min.y, input[i].max.y, input[i].mean.y, input[i].std.y);
+        envelope->count += weight;
+    }
+}
+
+
+static inline bool outside_limits(
+    const struct limits *limits, const struct fa_entry *min,
+    const struct fa_entry *max)
+{
+    return
+        min->x < limits->low.x  ||  max->x > limits->high.x  ||
+        min->y < limits->low.y  ||  max->y > limits->high.y;
+}
+
+static bool fa_mark_outside(
+    const void *block, unsigned int offset, unsigned int count,
+    const struct limits *limits, bool outside[])
+{
+    const struct fa_entry *input = (const struct fa_entry *) block + offset;
+    bool found = false;
+    for (unsigned int i = 0; i < count; i ++)
+        if (outside_limits(limits, &input[i], &input[i]))
+        {
+            outside[i] = true;
+            found = true;
+        }
+    return found;
+}
+
+static bool d_mark_outside(
+    const void *block, unsigned int offset, unsigned int count,
+    const struct limits *limits, bool outside[])
+{
+    const struct decimated_data *input =
+        (const struct decimated_data *) block + offset;
+    bool found = false;
+    for (unsigned int i = 0; i < count; i ++)
+        if (outside_limits(limits, &input[i].min, &input[i].max))
+        {
+            outside[i] = true;
+            found = true;
+        }
+    return found;
+}
+
+
+static struct reader fa_reader = {
+    .start_read_blocks = start_read_fa_blocks,
+    .select_write_lines = fa_select_write_lines,
+    .output_size = fa_output_size,
+    .send_direct = true,
+    .accumulate_envelope = fa_accumulate_envelope,
+    .mark_outside = fa_mark_outside,
+    .decimation_log2 = 0,
+};
+
+static struct reader d_reader = {
+    .start_read_blocks = start_read_d_blocks,
+    .select_write_lines = d_write_lines,
+    .output_size = d_output_size,
+    .accumulate_envelope = d_accumulate_envelope,
+    .mark_outside = d_mark_outside,
+};
+
+static struct reader dd_reader = {
+    .start_read_blocks = start_read_dd_blocks,
+    .select_write_lines = d_write_lines,
+    .output_size = d_output_size,
+    .accumulate_envelope = d_accumulate_envelope,
+    .mark_outside = d_mark_outside,
+};
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Read request parsing. */
+
+/* A read request specifies the following:
+ *
+ *  Data source: normal FA data, decimated or double decimated data, an
+ *  envelope of a fixed number of points, boxcar decimated data, decimated
+ *  data at a resolution chosen automatically, statistics over the range, or
+ *  power spectra computed from FA data.
+ *  For decimated data, a field mask is specifed
+ *  Mask of BPM ids to be retrieved
+ *  Data start point as a timestamp
+ *
+ * The syntax is very simple (no spaces allowed):
+ *
+ *  read-request = "R" source "M" filter-mask range options
+ *  source = "F" | "D" [ "D" ] [ "F" data-mask ] |
+ *      ( "P" points | "B" decimation | "A" max-points | "S" )
+ *      [ "F" data-mask ] | "W" fft-length [ "L" bins ]
+ *  data-mask = integer
+ *  points = integer
+ *  decimation = integer
+ *  max-points = integer
+ *  fft-length = integer
+ *  bins = integer
+ *  range = start end | "L" windows
+ *  start = time-or-seconds
+ *  end = "N" samples | "E" time-or-seconds
+ *  time-or-seconds = "T" date-time | "S" seconds [ "." nanoseconds ]
+ *  samples = integer
+ *  windows = integer
+ *  options = [ "N" ] [ "A" ] [ "T" [ "E" | "A" ] ] [ "Z" ] [ "C" [ "Z" ] ]
+ *      [ "X" ] [ "O" format ]
+ *  format = "F" | "S"
+ *
+ * A batch read ("L") is followed by the given number of lines each containing
+ * a window of the form start end, and only F and D sources are supported.
+ *
+ * The options can only appear in the order given and have the following
+ * meanings:
+ *
+ *  N   Send sample count as part of data stream
+ *  A   Send all data there is, even if samples is too large or starts too early
+ *  T   Send timestamp at head of dataset
+ *  TE  Send extended timestamp at head of dataset and with each major block
+ *  TA  Send extended timestamp at head and tail of dataset
+ *  Z   Send id0 with data at the same time as the timestamp (or at start)
+ *  C   Ensure no gaps in selected dataset, fail if any
+ *  CZ  Include gaps generated by id0 in gap check
+ *  X   Send compressed data
+ *  OF  Send data as calibrated floats, only for F and D sources
+ *  OS  Send data as scaled 16-bit integers, only for F and D sources
+ */
+
+/* source = "F" | "D" [ "D" ] [ "F" data-mask ] |
+ *      ( "P" points | "B" decimation | "A" max-points | "S" )
+ *      [ "F" data-mask ] | "W" fft-length [ "L" bins ] . */
+static bool parse_source(const char **string, struct read_parse *parse)
+{
+    parse->points = 0;
+    parse->decimation = 0;
+    parse->max_points = 0;
+    parse->statistics = false;
+    parse->fft_length = 0;
+    parse->log_bins = 0;
+    if (read_char(string, 'F'))
+    {
+        parse->reader = &fa_reader;
+        parse->data_mask = 0;       // Not used for FA data
+        return true;
+    }
+    else if (read_char(string, 'P'))
+    {
+        /* The range is computed in FA samples, the source to be reduced is
+         * chosen once the range is known. */
+        parse->reader = &fa_reader;
+        parse->data_mask = 7;       // Default to mean, min and max
+        return
+            parse_uint(string, &parse->points)  &&
+            TEST_OK_(parse->points > 0, "No points requested")  &&
+            IF_(read_char(string, 'F'),
+                parse_uint(string, &parse->data_mask)  &&
+                TEST_OK_(0 < parse->data_mask  &&  parse->data_mask <= 15,
+                    "Invalid envelope fields: %x", parse->data_mask));
+    }
+    else if (read_char(string, 'B'))
+    {
+        /* Boxcar decimation is computed from FA samples in the same way as an
+         * envelope. */
+        parse->reader = &fa_reader;
+        parse->data_mask = 15;      // Default to all fields as for D data
+        return
+            parse_uint(string, &parse->decimation)  &&
+            TEST_OK_(parse->decimation > 0, "Invalid decimation factor")  &&
+            IF_(read_char(string, 'F'),
+                parse_uint(string, &parse->data_mask)  &&
+                TEST_OK_(0 < parse->data_mask  &&  parse->data_mask <= 15,
+                    "Invalid decimated data fields: %x", parse->data_mask));
+    }
+    else if (read_char(string, 'A'))
+    {
+        /* The resolution is chosen once the range is known in FA samples. */
+        parse->reader = &fa_reader;
+        parse->data_mask = 15;      // Default to all fields as for D data
+        return
+            parse_uint(string, &parse->max_points)  &&
+            TEST_OK_(parse->max_points > 0, "No points requested")  &&
+            IF_(read_char(string, 'F'),
+                parse_uint(string, &parse->data_mask)  &&
+                TEST_OK_(0 < parse->data_mask  &&  parse->data_mask <= 15,
+                    "Invalid decimated data fields: %x", parse->data_mask));
+    }
+    else if (read_char(string, 'S'))
+    {
+        /* Statistics are merged from all three sources as appropriate. */
+        parse->reader = &fa_reader;
+        parse->data_mask = 15;      // Default to all fields as for D data
+        parse->statistics = true;
+        return
+            IF_(read_char(string, 'F'),
+                parse_uint(string, &parse->data_mask)  &&
+                TEST_OK_(0 < parse->data_mask  &&  parse->data_mask <= 15,
+                    "Invalid decimated data fields: %x", parse->data_mask));
+    }
+    else if (read_char(string, 'W'))
+    {
+        /* Power spectra are computed from FA data. */
+        parse->reader = &fa_reader;
+        parse->data_mask = 0;       // Not used for spectra
+        return
+            parse_uint(string, &parse->fft_length)  &&
+            TEST_OK_(parse->fft_length >= 4  &&
+                (parse->fft_length & (parse->fft_length - 1)) == 0,
+                "FFT length must be a power of 2")  &&
+            IF_(read_char(string, 'L'),
+                parse_uint(string, &parse->log_bins)  &&
+                TEST_OK_(parse->log_bins >= 2, "Too few frequency bins"));
     }
     else if (read_char(string, 'D'))
     {
-        parse->data_mask = 15;      // Default to all fields if no mask
-        if (read_char(string, 'D'))
-            parse->reader = &dd_reader;
-        else
-            parse->reader = &d_reader;
-        if (read_char(string, 'F'))
-            return
-                parse_uint(string, &parse->data_mask)  &&
-                TEST_OK_(0 < parse->data_mask  &&  parse->data_mask <= 15,
-                    "Invalid decimated data fields: %x", parse->data_mask);
-        else
-            return true;
+        parse->data_mask = 15;      // Default to all fields if no mask
+        if (read_char(string, 'D'))
+            parse->reader = &dd_reader;
+        else
+            parse->reader = &d_reader;
+        if (read_char(string, 'F'))
+            return
+                parse_uint(string, &parse->data_mask)  &&
+                TEST_OK_(0 < parse->data_mask  &&  parse->data_mask <= 15,
+                    "Invalid decimated data fields: %x", parse->data_mask);
+        else
+            return true;
+    }
+    else
+        return FAIL_("Invalid source specification");
+}
+
+
+/* time-or-seconds = "T" date-time | "S" seconds [ "." nanoseconds ] . */
+bool parse_time_or_seconds(const char **string, uint64_t *microseconds)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 0 };
+    bool ok;
+    if (read_char(string, 'T'))
+        ok = parse_datetime(string, &ts);
+    else if (read_char(string, 'S'))
+        ok = parse_seconds(string, &ts);
+    else
+        ok = FAIL_("Expected T or S for timestamp");
+    *microseconds = ts_to_microseconds(&ts);
+    return ok  &&  TEST_OK_(ts.tv_sec > 0, "Timestamp ridiculously early");
+}
+
+
+/* end = "N" samples | "E" time-or-seconds . */
+static bool parse_end(const char **string, uint64_t *end, uint64_t *samples)
+{
+    *end = 0;
+    *samples = 0;
+    if (read_char(string, 'N'))
+        return
+            parse_uint64(string, samples)  &&
+            TEST_OK_(*samples > 0, "No samples requested");
+    else if (read_char(string, 'E'))
+        return parse_time_or_seconds(string, end);
+    else
+        return FAIL_("Expected count or end time");
+}
+
+
+/* options =
+ *     [ "N" ] [ "A" ] [ "T" [ "E" | "A" ] ] [ "Z" ] [ "C" [ "Z" ] ]
+ *     [ "X" ] [ "O" format ] . */
+static bool parse_options(const char **string, struct read_parse *parse)
+{
+    parse->send_sample_count = read_char(string, 'N');
+    parse->send_all_data     = read_char(string, 'A');
+    parse->send_timestamp =
+        read_char(string, 'T') ?
+            read_char(string, 'E') ? SEND_EXTENDED :    // TE
+            read_char(string, 'A') ? SEND_AT_END :      // TA
+        SEND_BASIC :                                    // T
+        SEND_NOTHING;
+    parse->send_id0          = read_char(string, 'Z');
+    parse->only_contiguous   = read_char(string, 'C');
+    parse->check_id0 = parse->only_contiguous && read_char(string, 'Z');
+    parse->encode            = read_char(string, 'X');
+    return parse_output_format(string, &parse->format);
+}
+
+
+/* range = start end | "L" windows . */
+static bool parse_range(const char **string, struct read_parse *parse)
+{
+    parse->windows = 0;
+    if (read_char(string, 'L'))
+        return
+            parse_uint(string, &parse->windows)  &&
+            TEST_OK_(0 < parse->windows  &&  parse->windows <= MAX_WINDOWS,
+                "Invalid number of windows");
+    else
+        return
+            parse_time_or_seconds(string, &parse->start)  &&
+            parse_end(string, &parse->end, &parse->samples);
+}
+
+
+/* read-request = "R" source "M" filter-mask range options . */
+static bool parse_read_request(const char **string, struct read_parse *parse)
+{
+    return
+        parse_char(string, 'R')  &&
+        parse_source(string, parse)  &&
+        parse_char(string, 'M')  &&
+        parse_mask(string, fa_entry_count, &parse->read_mask)  &&
+        parse_range(string, parse)  &&
+        parse_options(string, parse)  &&
+        IF_(reduced_read(parse)  ||  parse->max_points > 0,
+            TEST_OK_(parse->send_timestamp == SEND_NOTHING  ||
+                parse->send_timestamp == SEND_BASIC,
+                "Extended timestamps not available for reduced data"))  &&
+        IF_(parse->format != FORMAT_INT32,
+            TEST_OK_(!reduced_read(parse)  &&  parse->max_points == 0,
+                "Output format only available for F and D data"))  &&
+        IF_(parse->windows > 0,
+            TEST_OK_(!reduced_read(parse)  &&  parse->max_points == 0,
+                "Batch read only available for F and D data")  &&
+            TEST_OK_(!parse->send_sample_count  &&
+                parse->send_timestamp == SEND_NOTHING,
+                "Sample count and timestamps sent with each window"))  &&
+        DO_(parse->write_lines =
+            parse->reader->select_write_lines(parse->data_mask));
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Batch reads. */
+
+/* A batch read returns many windows of data for a single request.  The list of
+ * windows follows the request line, one window per line, and the windows are
+ * sent back in archive order, each preceded by a header giving the window's
+ * position in the request.  Each block is read once for all of the windows it
+ * contains, except where more than two blocks are needed at once. */
+
+struct batch_window {
+    uint32_t index;                 // Position of window in request
+    uint64_t start;                 // Requested start time
+    uint64_t end;                   // Requested end time, or 0 if not given
+    uint64_t samples;               // Number of samples to send
+    unsigned int ix_block;          // Index block of first sample
+    unsigned int offset;            // Offset of first sample into block
+    uint64_t position;              // Sample position counted from first block
+};
+
+/* A set of read buffers holding the data read from one block. */
+struct batch_slot {
+    struct block_reads reads;
+    bool loaded;                    // Set if the block has been read
+    uint64_t block;                 // Block counted from first block
+};
+
+
+/* window = start end . */
+static bool parse_window(const char **string, struct batch_window *window)
+{
+    return
+        parse_time_or_seconds(string, &window->start)  &&
+        parse_end(string, &window->end, &window->samples);
+}
+
+
+/* Reads the list of windows following the request line.  The client sends
+ * nothing else, so we read until we've seen one line for each window. */
+static bool read_window_lines(
+    int scon, unsigned int count, char *text, size_t length)
+{
+    unsigned int lines = 0;
+    size_t rx = 0;
+    bool ok = true;
+    while (ok  &&  lines < count)
+    {
+        ssize_t chunk = 0;
+        ok =
+            TEST_OK_(rx < length, "Window list too long")  &&
+            TEST_IO_(chunk = read(scon, text + rx, length - rx),
+                "Socket read failed")  &&
+            TEST_OK_(chunk > 0, "End of file in window list");
+        for (ssize_t i = 0; ok  &&  i < chunk; i ++)
+            if (text[rx + (size_t) i] == '\n')
+            {
+                text[rx + (size_t) i] = '\0';
+                lines += 1;
+                ok = TEST_OK_(lines < count  ||  i == chunk - 1,
+                    "Junk after window list");
+            }
+        rx += (size_t) chunk;
+    }
+    return ok;
+}
+
+
+/* Reads and parses the windows, recording their positions in the request. */
+static bool read_windows(
+    int scon, struct batch_window windows[], unsigned int count)
+{
+    size_t length = count * MAX_WINDOW_LINE;
+    char *text = malloc(length);
+    bool ok = read_window_lines(scon, count, text, length);
+    const char *line = text;
+    for (unsigned int i = 0; ok  &&  i < count; i ++)
+    {
+        windows[i].index = i;
+        ok = DO_PARSE("window", parse_window, line, &windows[i]);
+        line += strlen(line) + 1;
+    }
+    free(text);
+    return ok;
+}
+
+
+/* Computes where the window lies in the archive.  Any error is reported with
+ * the index of the offending window. */
+static bool locate_window(
+    const struct read_parse *parse, struct batch_window *window)
+{
+    push_error_handling();
+    bool ok =
+        compute_start(
+            parse->reader, window->start, window->end, parse->send_all_data,
+            &window->samples, &window->ix_block, &window->offset)  &&
+        IF_(parse->only_contiguous,
+            check_run(parse->reader, parse->check_id0,
+                window->ix_block, window->offset, window->samples));
+    char *error_message = pop_error_handling(!ok);
+    if (!ok)
+    {
+        print_error("Window %"PRIu32": %s", window->index, error_message);
+        free(error_message);
+    }
+    return ok;
+}
+
+
+static int compare_windows(const void *a, const void *b)
+{
+    const struct batch_window *window_a = a;
+    const struct batch_window *window_b = b;
+    if (window_a->start != window_b->start)
+        return window_a->start < window_b->start ? -1 : 1;
+    else
+        return window_a->index < window_b->index ? -1 : 1;
+}
+
+
+/* Locates all the windows and sorts them into archive order.  Positions are
+ * then counted in samples from the start of the block containing the first
+ * window. */
+static bool locate_windows(
+    const struct read_parse *parse,
+    struct batch_window windows[], unsigned int count)
+{
+    const struct disk_header *header = get_header();
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < count; i ++)
+        ok = locate_window(parse, &windows[i]);
+    if (ok)
+    {
+        qsort(windows, count, sizeof(struct batch_window), compare_windows);
+        unsigned int first_block = windows[0].ix_block;
+        for (unsigned int i = 0; i < count; i ++)
+        {
+            unsigned int block =
+                (windows[i].ix_block + header->major_block_count -
+                    first_block) % header->major_block_count;
+            windows[i].position =
+                (uint64_t) block * parse->reader->samples_per_fa_block +
+                windows[i].offset;
+        }
+    }
+    return ok;
+}
+
+
+/* Returns the slot already holding block, otherwise the slot to read it into:
+ * an empty slot if there is one, or else the slot holding the earlier block. */
+static struct batch_slot *select_batch_slot(
+    struct batch_slot slots[], unsigned int slot_count, uint64_t block)
+{
+    struct batch_slot *result = &slots[0];
+    for (unsigned int i = 0; i < slot_count; i ++)
+        if (slots[i].loaded  &&  slots[i].block == block)
+            return &slots[i];
+        else if (!slots[i].loaded)
+            result = &slots[i];
+        else if (result->loaded  &&  slots[i].block < result->block)
+            result = &slots[i];
+    return result;
+}
+
+
+/* Reads block into slot.  Only the part of the block needed by the current
+ * window and any following windows which start in this block is read. */
+static bool load_batch_block(
+    const struct reader *reader, const struct iter_mask *iter,
+    const struct batch_window windows[], unsigned int count, unsigned int w,
+    uint64_t block, struct batch_slot *slot)
+{
+    const struct disk_header *header = get_header();
+    unsigned int samples_per_block = reader->samples_per_fa_block;
+    uint64_t block_start = block * samples_per_block;
+    uint64_t block_end = block_start + samples_per_block;
+
+    uint64_t first = block_end;
+    uint64_t last = block_start;
+    for (unsigned int i = w; i < count  &&  windows[i].position < block_end;
+         i ++)
+    {
+        uint64_t start = windows[i].position;
+        uint64_t end = start + windows[i].samples;
+        if (start < first)
+            first = start;
+        if (end > last)
+            last = end;
+    }
+    if (first < block_start)
+        first = block_start;
+    if (last > block_end)
+        last = block_end;
+
+    unsigned int ix_block = (unsigned int) (
+        (windows[0].ix_block + block) % header->major_block_count);
+    if (slot->loaded)
+        release_read_batch(&slot->reads.batch);
+    reader->start_read_blocks(
+        ix_block, (unsigned int) (first - block_start),
+        (unsigned int) (last - first), iter, &slot->reads);
+    slot->loaded = wait_read_batch(&slot->reads.batch);
+    slot->block = block;
+    if (!slot->loaded)
+        release_read_batch(&slot->reads.batch);
+    return slot->loaded;
+}
+
+
+/* Sends window w, preceded by its header. */
+static bool send_batch_window(
+    const struct read_parse *parse, const struct iter_mask *iter,
+    const struct batch_window windows[], unsigned int count, unsigned int w,
+    struct batch_slot slots[], unsigned int slot_count,
+    struct write_buffer *out_buffer)
+{
+    const struct reader *reader = parse->reader;
+    const struct batch_window *window = &windows[w];
+    unsigned int samples_per_block = reader->samples_per_fa_block;
+    size_t line_size_out = iter->count * reader->output_size(parse->data_mask);
+
+    bool ok =
+        BUFFER_ITEM(out_buffer, window->index)  &&
+        BUFFER_ITEM(out_buffer, window->samples)  &&
+        send_timestamp_header(
+            SEND_BASIC, parse->send_id0, out_buffer, reader,
+            window->ix_block, window->offset);
+
+    uint64_t position = window->position;
+    uint64_t end = position + window->samples;
+    while (ok  &&  position < end)
+    {
+        uint64_t block = position / samples_per_block;
+        unsigned int offset = (unsigned int) (position % samples_per_block);
+        unsigned int block_count = samples_per_block - offset;
+        if (end - position < block_count)
+            block_count = (unsigned int) (end - position);
+
+        struct batch_slot *slot = select_batch_slot(slots, slot_count, block);
+        ok =
+            IF_(!slot->loaded  ||  slot->block != block,
+                load_batch_block(
+                    reader, iter, windows, count, w, block, slot))  &&
+            write_block_lines(
+                parse->write_lines, iter->count, line_size_out,
+                &slot->reads.data, offset, block_count, out_buffer);
+        position += block_count;
+    }
+    return ok;
+}
+
+
+/* Sends all the windows in turn, using the second set of read buffers if we
+ * have them so that windows crossing a block boundary don't force the block
+ * to be read twice. */
+static bool transfer_windows(
+    const struct read_parse *parse, struct read_buffers read_buffers[2],
+    struct write_buffer *out_buffer, const struct iter_mask *iter,
+    const struct batch_window windows[], unsigned int count)
+{
+    unsigned int slot_count = read_buffers[1].count > 0 ? 2 : 1;
+    struct read_request requests[2][iter->count];
+    void *data[2][iter->count];
+    struct batch_slot slots[2];
+    for (unsigned int i = 0; i < 2; i ++)
+        slots[i] = (struct batch_slot) {
+            .reads = {
+                .buffers = &read_buffers[i],
+                .data = { .count = iter->count, .buffers = data[i] },
+                .requests = requests[i] },
+            .loaded = false };
+
+    bool ok = true;
+    for (unsigned int w = 0; ok  &&  w < count; w ++)
+        ok = send_batch_window(
+            parse, iter, windows, count, w, slots, slot_count, out_buffer);
+
+    for (unsigned int i = 0; i < slot_count; i ++)
+        if (slots[i].loaded)
+            release_read_batch(&slots[i].reads.batch);
+    return ok;
+}
+
+
+static bool read_batch(
+    int scon, const char *client_name, const struct read_parse *parse)
+{
+    unsigned int count = parse->windows;
+    struct batch_window *windows = calloc(count, sizeof(struct batch_window));
+    struct iter_mask iter = { 0 };
+    struct read_buffers read_buffers[2] = {
+        { .count = 0, .buffers = NULL }, { .count = 0, .buffers = NULL } };
+    ALLOCATE_WRITE_BUFFER(out_buffer, scon);
+    ALLOCATE_ADMISSION(admission);
+
+    bool ok =
+        read_windows(scon, windows, count)  &&
+        locate_windows(parse, windows, count)  &&
+        mask_to_archive(&parse->read_mask, &iter)  &&
+        admit_buffers(
+            &admission, client_name, PRIORITY_BULK, iter.count + 1)  &&
+        lock_buffers(&admission, &read_buffers[0], iter.count)  &&
+        allocate_write_buffer(&admission, &out_buffer, 1)  &&
+        DO_(prepare_output(parse, parse->reader, iter.count, &out_buffer));
+    /* As for read-ahead, the second set of buffers is optional. */
+    if (ok)
+        try_lock_buffers(&admission, &read_buffers[1], iter.count);
+    bool write_ok = report_socket_error(scon, client_name, ok);
+
+    if (ok  &&  write_ok)
+        write_ok =
+            transfer_windows(
+                parse, read_buffers, &out_buffer, &iter, windows, count)  &&
+            flush_buffer(&out_buffer);
+
+    release_write_buffer(&out_buffer);
+    release_output(&out_buffer);
+    unlock_buffers(&read_buffers[1]);
+    unlock_buffers(&read_buffers[0]);
+    release_admission(&admission);
+    free(windows);
+
+    return write_ok;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Read processing. */
+
+
+/* Convert timestamp into block index. */
+bool process_read(int scon, const char *client_name, const char *buf)
+{
+    struct read_parse parse;
+    push_error_handling();      // Popped by report_socket_error()
+    if (DO_PARSE("read request", parse_read_request, buf, &parse))
+        return IF_ELSE(parse.windows > 0,
+            read_batch(scon, client_name, &parse),
+            read_data(scon, client_name, &parse));
+    else
+        return report_socket_error(scon, client_name, false);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Gap listing. */
+
+struct gap_parse {
+    uint64_t start;             // Start of range to search
+    uint64_t end;               // End of range, or 0 if samples given
+    uint64_t samples;           // Number of FA samples to search
+    bool check_id0;             // Also report id0 discontinuities
+};
+
+
+/* gap-request = "G" time-or-seconds end [ "Z" ] . */
+static bool parse_gap_request(const char **string, struct gap_parse *parse)
+{
+    return
+        parse_char(string, 'G')  &&
+        parse_time_or_seconds(string, &parse->start)  &&
+        parse_end(string, &parse->end, &parse->samples)  &&
+        DO_(parse->check_id0 = read_char(string, 'Z'));
+}
+
+
+/* Walks the gap map over the selected range of blocks, filling in gaps[] with
+ * the timestamp of the end of the data before each gap and the start of the
+ * data following. */
+static void collect_gaps(
+    bool check_id0, unsigned int start, unsigned int blocks,
+    uint64_t gaps[][2], uint32_t *gap_count)
+{
+    unsigned int N = get_header()->major_block_count;
+    *gap_count = 0;
+    while (find_gap(check_id0, &start, &blocks))
+    {
+        const struct data_index *before = read_index((start + N - 1) % N);
+        const struct data_index *after = read_index(start);
+        gaps[*gap_count][0] = before->timestamp + before->duration;
+        gaps[*gap_count][1] = after->timestamp;
+        *gap_count += 1;
     }
-    else
-        return FAIL_("Invalid source specification");
 }
 
 
-/* time-or-seconds = "T" date-time | "S" seconds [ "." nanoseconds ] . */
-static bool parse_time_or_seconds(const char **string, uint64_t *microseconds)
+/* Sends a count of gaps followed by a pair of timestamps for each gap. */
+static bool send_gaps(
+    int scon, const char *client_name, const struct gap_parse *parse)
 {
-    struct timespec ts = { .tv_sec = 0, .tv_nsec = 0 };
-    bool ok;
-    if (read_char(string, 'T'))
-        ok = parse_datetime(string, &ts);
-    else if (read_char(string, 'S'))
-        ok = parse_seconds(string, &ts);
+    unsigned int ix_block, offset;
+    uint64_t samples = parse->samples;
+    uint64_t (*gaps)[2] = NULL;
+    uint32_t gap_count = 0;
+    unsigned int blocks = 0;
+
+    bool ok =
+        compute_start(
+            &fa_reader, parse->start, parse->end, true,
+            &samples, &ix_block, &offset)  &&
+        DO_(blocks = round_up(
+            offset + samples, fa_reader.samples_per_fa_block))  &&
+        TEST_NULL(gaps = malloc(blocks * sizeof(gaps[0])));
+    if (ok)
+        collect_gaps(parse->check_id0, ix_block, blocks, gaps, &gap_count);
+    bool write_ok =
+        report_socket_error(scon, client_name, ok)  &&  ok  &&
+        TEST_write(scon, &gap_count, sizeof(gap_count))  &&
+        TEST_write(scon, gaps, gap_count * sizeof(gaps[0]));
+
+    free(gaps);
+    return write_ok;
+}
+
+
+bool process_gaps(int scon, const char *client_name, const char *buf)
+{
+    struct gap_parse parse;
+    push_error_handling();      // Popped by report_socket_error()
+    if (DO_PARSE("gap request", parse_gap_request, buf, &parse))
+        return send_gaps(scon, client_name, &parse);
     else
-        ok = FAIL_("Expected T or S for timestamp");
-    *microseconds = ts_to_microseconds(&ts);
-    return ok  &&  TEST_OK_(ts.tv_sec > 0, "Timestamp ridiculously early");
+        return report_socket_error(scon, client_name, false);
 }
 
 
-/* end = "N" samples | "E" time-or-seconds . */
-static bool parse_end(const char **string, uint64_t *end, uint64_t *samples)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Event listing. */
+
+struct event_parse {
+    uint64_t start;             // Start of range to search
+    uint64_t end;               // End of range, or 0 if samples given
+    uint64_t samples;           // Number of FA samples to search
+    struct fa_entry mask;       // Event bits of interest
+};
+
+/* Record sent for each event found. */
+struct event_record {
+    uint64_t timestamp;         // Timestamp of sample raising events
+    struct fa_entry events;     // Event bits raised at this sample
+} __attribute__((packed));
+
+struct event_list {
+    struct event_record *events;
+    uint32_t count;             // Number of events found
+    uint32_t size;              // Allocated size of events[]
+    uint32_t dropped;           // Events not recorded in searched blocks
+};
+
+
+/* The event mask is parsed as a 64 bit filter mask, with bits 0 to 31
+ * selecting X event bits and bits 32 to 63 selecting Y bits. */
+static bool parse_event_mask(const char **string, struct fa_entry *mask)
 {
-    *end = 0;
-    *samples = 0;
-    if (read_char(string, 'N'))
-        return
-            parse_uint64(string, samples)  &&
-            TEST_OK_(*samples > 0, "No samples requested");
-    else if (read_char(string, 'E'))
-        return parse_time_or_seconds(string, end);
+    struct filter_mask filter;
+    bool ok = parse_mask(string, 64, &filter);
+    if (ok)
+    {
+        *mask = (struct fa_entry) { .x = 0, .y = 0 };
+        for (unsigned int bit = 0; bit < 32; bit ++)
+        {
+            if (test_mask_bit(&filter, bit))
+                mask->x |= (int32_t) (1U << bit);
+            if (test_mask_bit(&filter, bit + 32))
+                mask->y |= (int32_t) (1U << bit);
+        }
+    }
+    return ok;
+}
+
+
+/* event-request = "E" time-or-seconds end [ "M" event-mask ] . */
+static bool parse_event_request(const char **string, struct event_parse *parse)
+{
+    parse->mask = (struct fa_entry) { .x = -1, .y = -1 };
+    return
+        parse_char(string, 'E')  &&
+        parse_time_or_seconds(string, &parse->start)  &&
+        parse_end(string, &parse->end, &parse->samples)  &&
+        IF_(read_char(string, 'M'),
+            parse_event_mask(string, &parse->mask));
+}
+
+
+static void add_event(
+    struct event_list *list, uint64_t timestamp, struct fa_entry events)
+{
+    if (list->count >= list->size)
+    {
+        /* Grow the list as for the capture timestamp array. */
+        list->size = list->size == 0 ? 256 : list->size + list->size / 2;
+        list->events = realloc(
+            list->events, list->size * sizeof(struct event_record));
+    }
+    list->events[list->count] = (struct event_record) {
+        .timestamp = timestamp, .events = events };
+    list->count += 1;
+}
+
+
+/* Adds the events from one major block which fall within the range of samples
+ * [first, end) to the list, where sample positions are counted from the start
+ * of the block at index ix_block. */
+static void add_block_events(
+    struct event_list *list, const struct event_parse *parse,
+    unsigned int ix_block, const struct event_block *events,
+    uint64_t base, uint64_t first, uint64_t end)
+{
+    uint32_t block_size = get_header()->major_sample_count;
+    const struct data_index *index = read_index(ix_block);
+    unsigned int count = events->count < EVENT_BLOCK_ENTRIES ?
+        events->count : EVENT_BLOCK_ENTRIES;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        const struct event_entry *entry = &events->entries[i];
+        uint64_t position = base + entry->offset;
+        struct fa_entry selected = {
+            .x = entry->events.x & parse->mask.x,
+            .y = entry->events.y & parse->mask.y };
+        if (first <= position  &&  position < end  &&
+            (selected.x != 0  ||  selected.y != 0))
+            add_event(list,
+                index->timestamp +
+                    (uint64_t) entry->offset * index->duration / block_size,
+                selected);
+    }
+    list->dropped += events->dropped;
+}
+
+
+/* Walks the event index over the selected range of blocks collecting every
+ * matching event in the requested range of samples. */
+static bool collect_events(
+    const struct event_parse *parse, unsigned int ix_block,
+    unsigned int offset, uint64_t samples, struct event_list *list)
+{
+    const struct disk_header *header = get_header();
+    uint64_t end = offset + samples;
+    bool ok = true;
+    for (uint64_t base = 0; ok  &&  base < end;
+         base += header->major_sample_count)
+    {
+        struct event_block events;
+        ok = read_event_block(ix_block, &events);
+        if (ok)
+            add_block_events(list, parse, ix_block, &events, base, offset, end);
+        ix_block = (ix_block + 1) % header->major_block_count;
+    }
+    return ok;
+}
+
+
+/* Sends a count of events and of dropped events followed by a timestamp and
+ * the raised event bits for each event. */
+static bool send_events(
+    int scon, const char *client_name, const struct event_parse *parse)
+{
+    unsigned int ix_block, offset;
+    uint64_t samples = parse->samples;
+    struct event_list list = { .events = NULL, .count = 0, .size = 0 };
+
+    bool ok =
+        compute_start(
+            &fa_reader, parse->start, parse->end, true,
+            &samples, &ix_block, &offset)  &&
+        collect_events(parse, ix_block, offset, samples, &list);
+    bool write_ok =
+        report_socket_error(scon, client_name, ok)  &&  ok  &&
+        TEST_write(scon, &list.count, sizeof(list.count))  &&
+        TEST_write(scon, &list.dropped, sizeof(list.dropped))  &&
+        TEST_write(scon, list.events,
+            list.count * sizeof(struct event_record));
+
+    free(list.events);
+    return write_ok;
+}
+
+
+bool process_events(int scon, const char *client_name, const char *buf)
+{
+    struct event_parse parse;
+    push_error_handling();      // Popped by report_socket_error()
+    if (DO_PARSE("event request", parse_event_request, buf, &parse))
+        return send_events(scon, client_name, &parse);
     else
-        return FAIL_("Expected count or end time");
+        return report_socket_error(scon, client_name, false);
 }
 
 
-/* options = [ "N" ] [ "A" ] [ "T" [ "E" | "A" ] ] [ "C" ] [ "Z" ] . */
-static bool parse_options(const char **string, struct read_parse *parse)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Threshold search. */
+
+/* A threshold search finds the intervals where any of the selected ids lies
+ * outside the given limits.  Each block is searched from the coarsest data to
+ * the finest: the min and max fields of the DD data (held in memory) and then
+ * the D data rule out most ids and most of the block, and only the ids and the
+ * span of samples which may still be outside the limits are read as FA data. */
+
+struct threshold_parse {
+    struct filter_mask read_mask;   // Ids to search
+    uint64_t start;                 // Start of range to search
+    uint64_t end;                   // End of range, or 0 if samples given
+    uint64_t samples;               // Number of FA samples to search
+    struct limits limits;
+};
+
+struct interval_list {
+    uint64_t (*intervals)[2];       // Start and end timestamps
+    uint32_t count;                 // Number of intervals found
+    uint32_t size;                  // Allocated size of intervals[]
+    uint64_t last_end;              // Sample position of end of last interval
+};
+
+
+/* limit = ( "X" | "Y" ) low "," high . */
+static bool parse_limit(
+    const char **string, int32_t *low_out, int32_t *high_out)
 {
-    parse->send_sample_count = read_char(string, 'N');
-    parse->send_all_data     = read_char(string, 'A');
-    parse->send_timestamp =
-        read_char(string, 'T') ?
-            read_char(string, 'E') ? SEND_EXTENDED :    // TE
-            read_char(string, 'A') ? SEND_AT_END :      // TA
-        SEND_BASIC :                                    // T
-        SEND_NOTHING;
-    parse->send_id0          = read_char(string, 'Z');
-    parse->only_contiguous   = read_char(string, 'C');
-    parse->check_id0 = parse->only_contiguous && read_char(string, 'Z');
-    return true;
+    int low = 0, high = 0;
+    bool ok =
+        parse_int(string, &low)  &&
+        parse_char(string, ',')  &&
+        parse_int(string, &high)  &&
+        TEST_OK_(low <= high, "Empty limit range");
+    *low_out = low;
+    *high_out = high;
+    return ok;
 }
 
 
-/* read-request = "R" source "M" filter-mask start end options . */
-static bool parse_read_request(const char **string, struct read_parse *parse)
+/* threshold-request =
+ *     "T" "M" filter-mask start end [ "X" limit ] [ "Y" limit ] . */
+static bool parse_threshold_request(
+    const char **string, struct threshold_parse *parse)
 {
+    struct limits *limits = &parse->limits;
+    *limits = (struct limits) {
+        .low  = { .x = INT32_MIN, .y = INT32_MIN },
+        .high = { .x = INT32_MAX, .y = INT32_MAX } };
+    bool x_limit = false, y_limit = false;
     return
-        parse_char(string, 'R')  &&
-        parse_source(string, parse)  &&
+        parse_char(string, 'T')  &&
         parse_char(string, 'M')  &&
         parse_mask(string, fa_entry_count, &parse->read_mask)  &&
         parse_time_or_seconds(string, &parse->start)  &&
         parse_end(string, &parse->end, &parse->samples)  &&
-        parse_options(string, parse);
+        IF_(x_limit = read_char(string, 'X'),
+            parse_limit(string, &limits->low.x, &limits->high.x))  &&
+        IF_(y_limit = read_char(string, 'Y'),
+            parse_limit(string, &limits->low.y, &limits->high.y))  &&
+        TEST_OK_(x_limit  ||  y_limit, "No limits specified");
 }
 
 
+/* Searches the span [*first, *end) of FA samples in one block for the ids in
+ * iter using the given reader, and narrows the ids and span down to those which
+ * may still lie outside the limits.  For FA data outside[] is then set for each
+ * sample counted from the new *first which lies outside the limits for at least
+ * one id. */
+static bool search_level(
+    const struct reader *reader, struct block_reads *reads,
+    const struct limits *limits, unsigned int ix_block,
+    struct iter_mask *iter, unsigned int *first, unsigned int *end,
+    bool outside[])
+{
+    unsigned int log2 = reader->decimation_log2;
+    unsigned int read_first = *first >> log2;
+    unsigned int read_end = (*end + (1U << log2) - 1) >> log2;
+    unsigned int count = read_end - read_first;
+    memset(outside, 0, count * sizeof(bool));
+
+    reader->start_read_blocks(ix_block, read_first, count, iter, reads);
+    bool ok = wait_read_batch(&reads->batch);
+    unsigned int n = 0;
+    if (ok)
+        for (unsigned int i = 0; i < iter->count; i ++)
+            if (reader->mark_outside(
+                    reads->data.buffers[i], read_first, count, limits,
+                    outside))
+            {
+                iter->index[n] = iter->index[i];
+                n += 1;
+            }
+    release_read_batch(&reads->batch);
+    iter->count = n;
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Read processing. */
+    /* Narrow the span to the samples found outside the limits. */
+    if (n > 0)
+    {
+        unsigned int lo = 0;
+        while (!outside[lo])
+            lo += 1;
+        unsigned int hi = count;
+        while (!outside[hi - 1])
+            hi -= 1;
+        if ((read_first + lo) << log2 > *first)
+            *first = (read_first + lo) << log2;
+        if ((read_first + hi) << log2 < *end)
+            *end = (read_first + hi) << log2;
+        memmove(outside, outside + lo, (hi - lo) * sizeof(bool));
+    }
+    return ok;
+}
 
 
-/* Convert timestamp into block index. */
-bool process_read(int scon, const char *client_name, const char *buf)
+/* Adds the interval [start, end) at sample positions [position, end_position)
+ * in the searched range.  If follows_on is set the block containing the
+ * interval carries straight on from the block before it. */
+static bool add_interval(
+    struct interval_list *list, uint64_t start, uint64_t end,
+    uint64_t position, uint64_t end_position, bool follows_on)
 {
-    struct read_parse parse;
+    /* An interval running on from the end of the previous block extends the
+     * previous interval, but only if there is no gap between the blocks. */
+    if (list->count > 0  &&  position == list->last_end  &&  follows_on)
+        list->intervals[list->count - 1][1] = end;
+    else if (TEST_OK_(list->count < MAX_INTERVALS, "Too many intervals"))
+    {
+        if (list->count >= list->size)
+        {
+            list->size = list->size == 0 ? 256 : list->size + list->size / 2;
+            list->intervals = realloc(
+                list->intervals, list->size * sizeof(list->intervals[0]));
+        }
+        list->intervals[list->count][0] = start;
+        list->intervals[list->count][1] = end;
+        list->count += 1;
+    }
+    else
+        return false;
+    list->last_end = end_position;
+    return true;
+}
+
+
+/* Searches samples [first, end) of ix_block, which starts at sample position
+ * base in the range, and adds each run of samples outside the limits to the
+ * list of intervals. */
+static bool search_block(
+    const struct threshold_parse *parse, const struct iter_mask *archive_iter,
+    struct block_reads *reads, unsigned int ix_block, uint64_t base,
+    unsigned int first, unsigned int end, bool outside[],
+    struct interval_list *list)
+{
+    const struct reader *readers[] = { &dd_reader, &d_reader, &fa_reader };
+    struct iter_mask iter = *archive_iter;
+    bool ok = true;
+    for (unsigned int i = 0; i < ARRAY_SIZE(readers); i ++)
+        if (ok  &&  iter.count > 0)
+            ok = search_level(readers[i], reads, &parse->limits, ix_block,
+                &iter, &first, &end, outside);
+
+    /* Only now is outside[] in FA samples counted from first. */
+    if (ok  &&  iter.count > 0)
+    {
+        const struct data_index *index = read_index(ix_block);
+        uint32_t block_size = fa_reader.samples_per_fa_block;
+        bool follows_on = first == 0  &&  block_follows_on(ix_block);
+        for (unsigned int s = first; ok  &&  s < end; )
+        {
+            if (outside[s - first])
+            {
+                unsigned int run = s;
+                while (s < end  &&  outside[s - first])
+                    s += 1;
+                ok = add_interval(list,
+                    index->timestamp +
+                        (uint64_t) run * index->duration / block_size,
+                    index->timestamp +
+                        (uint64_t) s * index->duration / block_size,
+                    base + run, base + s, follows_on);
+            }
+            else
+                s += 1;
+        }
+    }
+    return ok;
+}
+
+
+/* Searches count FA samples starting at offset into ix_block. */
+static bool search_range(
+    const struct threshold_parse *parse, const struct iter_mask *iter,
+    struct read_buffers *read_buffers,
+    unsigned int ix_block, unsigned int offset, uint64_t count,
+    struct interval_list *list)
+{
+    const struct disk_header *header = get_header();
+    uint32_t block_size = header->major_sample_count;
+    struct read_request requests[iter->count];
+    void *data[iter->count];
+    struct block_reads reads = {
+        .buffers = read_buffers,
+        .data = { .count = iter->count, .buffers = data },
+        .requests = requests };
+    bool *outside = malloc(block_size * sizeof(bool));
+
+    uint64_t end = offset + count;
+    bool ok = true;
+    for (uint64_t base = 0; ok  &&  base < end; base += block_size)
+    {
+        unsigned int first = offset > base ? (unsigned int) (offset - base) : 0;
+        unsigned int last =
+            end - base < block_size ? (unsigned int) (end - base) : block_size;
+        ok = search_block(parse, iter, &reads, ix_block, base, first, last,
+            outside, list);
+        ix_block = (ix_block + 1) % header->major_block_count;
+    }
+
+    free(outside);
+    return ok;
+}
+
+
+/* Sends a count of intervals followed by the start and end timestamp of each
+ * interval. */
+static bool send_intervals(
+    int scon, const char *client_name, const struct threshold_parse *parse)
+{
+    unsigned int ix_block, offset;
+    uint64_t samples = parse->samples;
+    struct iter_mask iter = { 0 };
+    struct read_buffers read_buffers = { .count = 0, .buffers = NULL };
+    struct interval_list list = { .intervals = NULL, .count = 0, .size = 0 };
+    ALLOCATE_ADMISSION(admission);
+
+    bool ok =
+        mask_to_archive(&parse->read_mask, &iter)  &&
+        compute_start(
+            &fa_reader, parse->start, parse->end, true,
+            &samples, &ix_block, &offset)  &&
+        admit_buffers(&admission, client_name,
+            read_priority(&fa_reader, offset, samples), iter.count)  &&
+        lock_buffers(&admission, &read_buffers, iter.count)  &&
+        search_range(
+            parse, &iter, &read_buffers, ix_block, offset, samples, &list);
+    unlock_buffers(&read_buffers);
+    release_admission(&admission);
+
+    bool write_ok =
+        report_socket_error(scon, client_name, ok)  &&  ok  &&
+        TEST_write(scon, &list.count, sizeof(list.count))  &&
+        TEST_write(scon, list.intervals,
+            list.count * sizeof(list.intervals[0]));
+
+    free(list.intervals);
+    return write_ok;
+}
+
+
+bool process_threshold(int scon, const char *client_name, const char *buf)
+{
+    struct threshold_parse parse;
     push_error_handling();      // Popped by report_socket_error()
-    if (DO_PARSE("read request", parse_read_request, buf, &parse))
-        return read_data(scon, client_name, &parse);
+    if (DO_PARSE("threshold request", parse_threshold_request, buf, &parse))
+        return send_intervals(scon, client_name, &parse);
     else
         return report_socket_error(scon, client_name, false);
 }
 
 
-bool initialise_reader(const char *archive)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Subscription history. */
+
+/* A subscription can start with archived data.  Complete blocks are read from
+ * the archive as usual, and the block still being filled is copied from the
+ * transform thread.  The subscriber then opens its live reader and the history
+ * is run on until it reaches the first live sample, identified by its id0. */
+
+struct history {
+    struct iter_mask iter;
+    struct admission admission;
+    struct read_buffers read_buffers;
+    struct write_buffer out_buffer;
+    struct read_request requests[MAX_FA_ENTRY_COUNT];
+    void *data[MAX_FA_ENTRY_COUNT];
+    struct block_reads reads;
+    unsigned int ix_block;          // Block of next sample to send
+    unsigned int offset;            // Offset of next sample into block
+    bool started;                   // Set once the first sample has been sent
+    uint32_t next_id0;              // Expected id0 of next sample to send
+};
+
+
+bool open_history(
+    int scon, const char *client_name, const struct filter_mask *mask,
+    uint64_t start, struct encoder *encoder, struct formatter *formatter,
+    struct history **history)
+{
+    struct history *hist = calloc(1, sizeof(struct history));
+    hist->admission = (struct admission) { .client = NULL, .reserved = 0 };
+    hist->out_buffer = (struct write_buffer) {
+        .file = scon, .encoder = encoder, .formatter = formatter };
+    hist->reads = (struct block_reads) {
+        .buffers = &hist->read_buffers,
+        .data = { .buffers = hist->data },
+        .requests = hist->requests };
+    uint64_t samples = 1;
+
+    bool ok =
+        mask_to_archive(mask, &hist->iter)  &&
+        compute_start(&fa_reader, start, 0, false,
+            &samples, &hist->ix_block, &hist->offset)  &&
+        admit_buffers(&hist->admission, client_name,
+            PRIORITY_BULK, hist->iter.count + 1)  &&
+        lock_buffers(&hist->admission, &hist->read_buffers, hist->iter.count) &&
+        allocate_write_buffer(&hist->admission, &hist->out_buffer, 1);
+    hist->reads.data.count = hist->iter.count;
+    *history = hist;
+    if (!ok)
+        close_history(hist);
+    return ok;
+}
+
+
+void close_history(struct history *history)
+{
+    release_write_buffer(&history->out_buffer);
+    unlock_buffers(&history->read_buffers);
+    release_admission(&history->admission);
+    free(history);
+}
+
+
+bool send_history_header(
+    struct history *history, bool send_timestamp, bool send_id0)
+{
+    return send_timestamp_header(
+        send_timestamp ? SEND_BASIC : SEND_NOTHING, send_id0,
+        &history->out_buffer, &fa_reader, history->ix_block, history->offset);
+}
+
+
+/* Sends the samples available from the current position to the end of its
+ * block, stopping before the sample with id0 *join if join is not NULL.  Sets
+ * *sent to the number of samples sent, which is zero if we're waiting for the
+ * transform thread or have reached the join.  As with a live subscription, the
+ * stream fails if the samples don't follow on from the last samples sent,
+ * either because the next archive block starts after a gap or because the
+ * live block was discarded and restarted by the transform thread. */
+static bool send_history_block(
+    struct history *history, const uint32_t *join, unsigned int *sent)
+{
+    const struct iter_mask *iter = &history->iter;
+    struct block_reads *reads = &history->reads;
+    unsigned int block_size = fa_reader.samples_per_fa_block;
+    unsigned int offset = history->offset;
+    unsigned int count = block_size - offset;
+    uint32_t id_zero = 0;
+
+    bool live = read_live_block(
+        history->ix_block, offset, &count, iter->count, iter->index,
+        history->read_buffers.buffers, &id_zero);
+    if (live)
+        for (unsigned int i = 0; i < iter->count; i ++)
+            reads->data.buffers[i] = history->read_buffers.buffers[i];
+    else
+        id_zero = read_index(history->ix_block)->id_zero;
+
+    bool ok =
+        IF_(history->started  &&  count > 0,
+            TEST_OK_(id_zero + offset == history->next_id0, "Data gap"));
+    if (ok  &&  join  &&  count > 0)
+    {
+        uint32_t remaining = *join - (id_zero + offset);
+        ok = TEST_OK_(remaining <= 2 * block_size,
+            "Unable to join archive to live data");
+        if (remaining < count)
+            count = remaining;
+    }
+    if (ok  &&  count > 0)
+    {
+        if (!live)
+        {
+            fa_reader.start_read_blocks(
+                history->ix_block, offset, count, iter, reads);
+            ok = wait_read_batch(&reads->batch);
+        }
+        ok = ok  &&  write_block_lines(
+            fa_write_lines, iter->count, iter->count * FA_ENTRY_SIZE,
+            &reads->data, offset, count, &history->out_buffer);
+        if (!live)
+            release_read_batch(&reads->batch);
+
+        history->started = true;
+        history->next_id0 = id_zero + offset + count;
+        history->offset += count;
+        if (history->offset >= block_size)
+        {
+            history->ix_block =
+                (history->ix_block + 1) % get_header()->major_block_count;
+            history->offset = 0;
+        }
+    }
+    *sent = ok ? count : 0;
+    return ok;
+}
+
+
+bool send_history(struct history *history)
+{
+    bool ok = true;
+    unsigned int sent = 1;
+    while (ok  &&  sent > 0)
+        ok = send_history_block(history, NULL, &sent);
+    return ok;
+}
+
+
+bool join_history(struct history *history, uint32_t id0)
+{
+    /* The samples before the join are normally already in the archive or
+     * shortly will be, but give up if the transform thread stops making them
+     * available. */
+    uint64_t last_progress = get_timestamp();
+    bool ok = true;
+    bool joined = false;
+    while (ok  &&  !joined)
+    {
+        unsigned int sent;
+        ok = send_history_block(history, &id0, &sent);
+        if (ok  &&  sent == 0)
+        {
+            uint32_t id_zero = 0;
+            unsigned int count = 1;
+            /* Either we've reached the join or we have to wait. */
+            if (read_live_block(
+                    history->ix_block, history->offset, &count, 0, NULL, NULL,
+                    &id_zero)  &&  count == 0)
+            {
+                ok = TEST_OK_(
+                    get_timestamp() - last_progress < HISTORY_TIMEOUT,
+                    "Timed out joining archive to live data");
+                usleep(HISTORY_POLL);
+            }
+            else
+                joined = true;
+        }
+        else
+            last_progress = get_timestamp();
+    }
+    return ok  &&  flush_buffer(&history->out_buffer);
+}
+
+
+bool initialise_reader(
+    const char *archive, unsigned int read_queue_depth,
+    unsigned int block_cache_size, unsigned int buffer_sets,
+    unsigned int admission_timeout, unsigned int client_limit)
 {
     const struct disk_header *header = get_header();
 
-    archive_filename = archive;
     fa_entry_count = header->fa_entry_count;
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    cpu_count = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
 
     /* Initialise dynamic part of reader structures. */
     fa_reader.samples_per_fa_block  = header->major_sample_count;
@@ -826,9 +3400,16 @@ bool initialise_reader(const char *archive)
     dd_reader.samples_per_fa_block  = header->dd_sample_count;
 
     /* Make the buffer size large enough for a complete FA major block for one
-     * BPM id, allocate enough buffers to allow one user to capture a complete
-     * set of ids. */
+     * BPM id.  By default there are enough buffers to allow one user to capture
+     * a complete set of ids with read-ahead, more sets allow large reads to be
+     * run in parallel. */
     initialise_buffer_pool(
-        FA_ENTRY_SIZE * header->major_sample_count, fa_entry_count);
-    return true;
+        FA_ENTRY_SIZE * header->major_sample_count,
+        buffer_sets * fa_entry_count, admission_timeout, client_limit);
+    /* The block cache holds blocks of the same size. */
+    size_t block_size = FA_ENTRY_SIZE * header->major_sample_count;
+    initialise_block_cache(
+        block_size, (unsigned int) (((size_t) block_cache_size << 20) /
+            block_size));
+    return initialise_disk_reader(archive, read_queue_depth);
 }
@@ -32,7 +32,58 @@
  * The first character in the buffer is R. */
 bool process_read(int scon, const char *client_name, const char *buf);
 
-bool initialise_reader(const char *archive);
+/* Lists gaps in the archive over a time range.  The first character in the
+ * buffer is G. */
+bool process_gaps(int scon, const char *client_name, const char *buf);
+
+/* Lists events recorded in the event index over a time range.  The first
+ * character in the buffer is E. */
+bool process_events(int scon, const char *client_name, const char *buf);
+
+/* Searches for intervals where any of the selected ids lies outside the given
+ * limits.  The first character in the buffer is T. */
+bool process_threshold(int scon, const char *client_name, const char *buf);
+
+/* Parses a timestamp as used in read requests, see fa-archiver(1):
+ *  time-or-seconds = "T" date-time | "S" seconds [ "." nanoseconds ] . */
+bool parse_time_or_seconds(const char **string, uint64_t *microseconds);
+
+
+/* Archived data sent at the start of a subscription, see subscribe.c.  The
+ * history is opened at the given start time, fails if start is not in the
+ * archive, and holds pool buffers until it is closed.  Data is written to scon
+ * converted by formatter and through encoder, if either is not NULL. */
+struct history;
+struct filter_mask;
+struct encoder;
+struct formatter;
+bool open_history(
+    int scon, const char *client_name, const struct filter_mask *mask,
+    uint64_t start, struct encoder *encoder, struct formatter *formatter,
+    struct history **history);
+void close_history(struct history *history);
+/* Sends the timestamp and id0 of the first sample of the history as selected,
+ * in the same format as for a subscription. */
+bool send_history_header(
+    struct history *history, bool send_timestamp, bool send_id0);
+/* Sends all the data currently available, both in the archive and from the
+ * block still being written. */
+bool send_history(struct history *history);
+/* Sends the remaining data up to but not including the sample with the given
+ * id0, waiting for it to become available as necessary, and flushes the data to
+ * the client. */
+bool join_history(struct history *history, uint32_t id0);
+
+/* Initialises the reader, reads from the archive will be run with up to
+ * read_queue_depth reads in parallel and up to block_cache_size megabytes of
+ * recently read blocks will be shared between readers.  The buffer pool holds
+ * buffer_sets complete sets of read buffers, one buffer for each id.  Reads
+ * wait up to admission_timeout seconds for their buffers, and if client_limit
+ * is non zero at most this many reads from one host are admitted at once. */
+bool initialise_reader(
+    const char *archive, unsigned int read_queue_depth,
+    unsigned int block_cache_size, unsigned int buffer_sets,
+    unsigned int admission_timeout, unsigned int client_limit);
 
 
 /* Timestamp header when sending extended data. */
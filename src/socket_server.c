@@ -37,6 +37,8 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -57,6 +59,8 @@
 #include "list.h"
 #include "disk_writer.h"
 #include "subscribe.h"
+#include "hot_cache.h"
+#include "pool.h"
 
 #include "socket_server.h"
 
@@ -95,6 +99,10 @@ struct client_info
     struct timespec ts;             // Time client connection completed
     char name[64];                  // Socket address of client
     char buf[256];                  // Command sent by client
+    size_t length;                  // Length of command read so far
+    int scon;                       // Connected socket
+    int64_t deadline;               // Time by which command must arrive, in ms
+    struct list_head queue;         // Waiting for command or for a worker
 };
 
 /* Macro for walking lists of client_info structures. */
@@ -197,11 +205,14 @@ static bool set_socket_timeout(int sock, int rx_secs, int tx_secs)
             sock, SOL_SOCKET, SO_SNDTIMEO, &tx_timeout, sizeof(tx_timeout)));
 }
 
-/* Using cork should be harmless and should increase write efficiency. */
+/* Using cork should be harmless and should increase write efficiency.  Commands
+ * on a multiplexed connection write to a socket pair, which has no cork. */
 bool set_socket_cork(int sock, bool cork)
 {
     int _cork = cork;       // In case sizeof(bool) isn't sizeof(int)
-    return TEST_IO(setsockopt(sock, SOL_TCP, TCP_CORK, &_cork, sizeof(_cork)));
+    return
+        setsockopt(sock, SOL_TCP, TCP_CORK, &_cork, sizeof(_cork)) == 0  ||
+        TEST_OK(errno == EOPNOTSUPP);
 }
 
 
@@ -356,6 +367,31 @@ static bool write_status(int scon, const char *client_name)
 }
 
 
+static bool write_hot_cache_status(int scon)
+{
+    struct hot_cache_status status;
+    get_hot_cache_status(&status);
+    return write_string(scon,
+        "%u %u %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+        status.blocks, status.capacity, status.size,
+        status.hits, status.misses, status.skipped);
+}
+
+
+static bool write_admission_status(int scon)
+{
+    struct admission_status status;
+    get_admission_status(&status);
+    uint64_t mean_wait =
+        status.admitted > 0 ? status.total_wait / status.admitted : 0;
+    return write_string(scon,
+        "%u %u %u %u %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
+        status.pool_size, status.free,
+        status.waiting[PRIORITY_INTERACTIVE], status.waiting[PRIORITY_BULK],
+        status.admitted, status.timeouts, mean_wait, status.max_wait);
+}
+
+
 
 /* The C command prefix is followed by a sequence of one letter commands, and
  * each letter receives a one line response (except for the I command).  The
@@ -383,6 +419,12 @@ static bool write_status(int scon, const char *client_name)
  *  N   Returns server name configured on startup
  *  I   Returns list of all conected clients, one client per line.
  *  L   Returns list of FA ids and their descriptions
+ *  H   Returns recent history cache status.  The numbers returned are:
+ *          blocks held, block capacity, size in bytes, hits, misses, blocks
+ *          not cached because every spare buffer was still being read
+ *  A   Returns read buffer pool admission status.  The numbers returned are:
+ *          buffers in pool, buffers free, interactive and bulk reads waiting,
+ *          reads admitted, reads timed out, mean and maximum wait in us
  */
 static bool process_command(int scon, const char *client_name, const char *buf)
 {
@@ -436,6 +478,12 @@ static bool process_command(int scon, const char *client_name, const char *buf)
             case 'L':
                 ok = write_fa_ids(scon, &header->archive_mask);
                 break;
+            case 'H':
+                ok = write_hot_cache_status(scon);
+                break;
+            case 'A':
+                ok = write_admission_status(scon);
+                break;
             default:
                 ok = report_error(scon, client_name, "Unknown command");
                 break;
@@ -473,14 +521,23 @@ bool report_socket_error(int scon, const char *client_name, bool ok)
 
 typedef bool (*command_t)(int scon, const char *client_name, const char *buf);
 
+/* Multiplexed connections hand their commands to the worker pools, so are
+ * defined further down. */
+static bool process_multiplex(
+    int scon, const char *client_name, const char *buf);
+
 static const struct command_table {
     char id;            // Identification character
     command_t process;
 } command_table[] = {
     { 'C', process_command },
     { 'R', process_read },
+    { 'G', process_gaps },
+    { 'E', process_events },
+    { 'T', process_threshold },
     { 'S', process_subscribe },
     { 'D', process_debug_command },
+    { 'M', process_multiplex },
     { 0,   process_error }
 };
 
@@ -513,103 +570,893 @@ static void get_client_name(int scon, char *client_name)
 }
 
 
-/* Reads from the given socket until one of the following is encountered: a
- * newline (the preferred case), end of input, end of buffer or an error.  The
- * newline and anything following is discarded. */
-static bool read_line(int sock, struct client_info *client)
+/* Command successfully read, dispatch it to the appropriate handler. */
+static void dispatch_command(
+    int scon, const char *client_name, const char *buf)
+{
+    log_message("Client %s command: \"%s\"", client_name, buf);
+    command_t command = lookup_command(buf[0]);
+    bool ok = command(scon, client_name, buf);
+    char *error_message = pop_error_handling(!ok);
+    if (!ok)
+        log_message("Client %s error: %s", client_name, error_message);
+    free(error_message);
+}
+
+
+/* Closing a socket with unread input resets the connection, which can lose the
+ * tail of the data we've sent, for instance if a command was rejected before
+ * reading all its input.  Any input already waiting is discarded. */
+static void discard_input(int scon)
+{
+    char buf[256];
+    while (recv(scon, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+}
+
+
+/* Sets or clears O_NONBLOCK on the given socket. */
+static bool set_socket_nonblocking(int sock, bool nonblocking)
+{
+    int flags;
+    return
+        TEST_IO(flags = fcntl(sock, F_GETFL))  &&
+        TEST_IO(fcntl(sock, F_SETFL,
+            nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK));
+}
+
+
+/* Uncork the socket before closing to ensure any remaining data is sent.  It
+ * seems that if we close the socket with cork enabled and unread incoming data
+ * then the tail end of the sent data stream can be lost. */
+static void close_connection(struct client_info *client)
 {
-    char *buf = client->buf;
-    size_t buflen = sizeof(client->buf) - 1;    // Allow for '\0'
-    ssize_t rx;
-    while (
-        TEST_OK_(buflen > 0, "Read buffer exhausted")  &&
-        TEST_IO_(rx = read(sock, buf, buflen), "Socket read failed")  &&
-        TEST_OK_(rx > 0, "End of file on input"))
+    discard_input(client->scon);
+    set_socket_cork(client->scon, false);
+    IGNORE(TEST_IO(close(client->scon)));
+    remove_client(client);
+}
+
+
+/* Reports the pending error to the client and closes the connection. */
+static void reject_connection(struct client_info *client)
+{
+    pop_client_error(client->scon, client->name);
+    close_connection(client);
+}
+
+
+/* Runs the command read from the client and closes the connection.  Past this
+ * point only dispatch_command() can communicate with the client, any further
+ * errors it needs to handle. */
+static void serve_connection(struct client_info *client)
+{
+    push_error_handling();
+    dispatch_command(client->scon, client->name, client->buf);
+    close_connection(client);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Worker pools. */
+
+/* Commands other than configuration commands are run by worker threads.
+ * Subscriptions and multiplexed connections run for as long as the client
+ * wants, so they have a pool of their own and are refused when it is full,
+ * while other commands may wait in a queue for a worker.  Worker threads are
+ * started as needed up to the size of each pool and are then kept for reuse. */
+
+/* Maximum number of connections waiting for a read worker. */
+#define READ_QUEUE_LIMIT    256
+
+struct worker_pool {
+    const char *name;               // Used in error messages
+    unsigned int size;              // Maximum number of worker threads
+    unsigned int queue_limit;       // Maximum connections waiting for a worker
+    struct locking lock;            // Guards the fields below
+    unsigned int threads;           // Worker threads started
+    unsigned int idle;              // Threads waiting for work
+    unsigned int queued;            // Connections waiting for a worker
+    struct list_head queue;         // Connections in order of arrival
+};
+
+static struct worker_pool read_pool = {
+    .name = "reads", .queue_limit = READ_QUEUE_LIMIT };
+static struct worker_pool subscribe_pool = {
+    .name = "subscriptions", .queue_limit = 0 };
+
+/* Worker threads are detached as nothing ever waits for them. */
+static pthread_attr_t worker_attr;
+
+
+static void *pool_worker(void *context)
+{
+    struct worker_pool *pool = context;
+    while (true)
     {
-        char *newline = memchr(buf, '\n', (size_t) rx);
-        if (newline)
+        struct client_info *client;
+        LOCK(pool->lock);
+        pool->idle += 1;
+        while (pool->queue.next == &pool->queue)
+            pwait(&pool->lock);
+        pool->idle -= 1;
+        pool->queued -= 1;
+        client = container_of(pool->queue.next, struct client_info, queue);
+        list_del(&client->queue);
+        UNLOCK(pool->lock);
+
+        serve_connection(client);
+    }
+    return NULL;
+}
+
+
+/* Hands the connection over to the pool, starting a new worker if there is no
+ * idle worker to take it.  Fails if the pool and its queue are full. */
+static bool submit_connection(
+    struct worker_pool *pool, struct client_info *client)
+{
+    bool ok;
+    errno = 0;
+    LOCK(pool->lock);
+    unsigned int available = pool->idle + pool->size - pool->threads;
+    pthread_t thread;
+    ok =
+        TEST_OK_(pool->queued < available + pool->queue_limit,
+            "Too many %s", pool->name)  &&
+        IF_(pool->queued >= pool->idle  &&  pool->threads < pool->size,
+            TEST_0(pthread_create(&thread, &worker_attr, pool_worker, pool))  &&
+            DO_(pool->threads += 1));
+    if (ok)
+    {
+        list_add_tail(&client->queue, &pool->queue);
+        pool->queued += 1;
+        psignal(&pool->lock);
+    }
+    UNLOCK(pool->lock);
+    return ok;
+}
+
+
+/* Long lived connections go to the subscription pool. */
+static struct worker_pool *choose_pool(char command)
+{
+    return command == 'S'  ||  command == 'M' ? &subscribe_pool : &read_pool;
+}
+
+
+static void initialise_pool(struct worker_pool *pool, unsigned int size)
+{
+    pool->size = size;
+    initialise_locking(&pool->lock);
+    INIT_LIST_HEAD(&pool->queue);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Multiplexed connections. */
+
+/* The M command switches the connection over to protocol version 2, described
+ * in socket_server.h.  Each command sent over the connection is run by a
+ * worker exactly as if it had arrived on a connection of its own, except that
+ * the worker is given one end of a socket pair in place of the client socket.
+ * The thread serving the connection holds the other end of each pair and
+ * relays whatever the worker writes to the client in MUX_DATA frames, so every
+ * command works unchanged.  Cancelling a request closes our end of its pair,
+ * and the worker then fails on its next write as if its client had gone.
+ *
+ * Frames for the client are queued and sent as the client takes them, so a
+ * slow client never stops us reading its frames.  The queue is bounded: while
+ * it is too full to take a full data frame we stop reading the socket pairs,
+ * holding up the workers, but some room is always kept for the replies to
+ * client frames so that cancelling a request still works. */
+
+/* Maximum number of commands in progress on one connection. */
+#define MUX_REQUEST_LIMIT   64
+/* Maximum payload accepted from the client in one frame. */
+#define MUX_PAYLOAD_LIMIT   65536
+/* Maximum payload of each MUX_DATA frame sent to the client. */
+#define MUX_DATA_SIZE       65536
+/* Maximum number of events handled for each call to epoll_wait(). */
+#define MUX_MAX_EVENTS      16
+
+/* Size of a MUX_DATA frame with a full payload. */
+#define MUX_FRAME_SIZE      (sizeof(struct mux_frame_header) + MUX_DATA_SIZE)
+/* Largest reply to a single client frame: an error followed by MUX_END. */
+#define MUX_REPLY_SIZE      (MUX_FRAME_SIZE + sizeof(struct mux_frame_header))
+/* Capacity of the queue of frames waiting to be sent to the client. */
+#define MUX_OUTPUT_SIZE     (4 * MUX_FRAME_SIZE)
+
+struct mux_request {
+    struct list_head list;
+    uint32_t request_id;
+    int sock;                       // Our end of the worker's socket pair
+};
+
+struct mux_connection {
+    int scon;                       // Connection to client
+    const char *client_name;
+    int epoll;                      // Watches scon and all request sockets
+    bool closed;                    // Set when client closes the connection
+    struct list_head requests;      // Commands in progress
+    unsigned int request_count;
+    struct mux_frame_header header; // Header of frame being received
+    size_t received;                // Bytes of this frame received so far
+    char *payload;                  // Payload of frame being received
+    char *frame;                    // Frame being sent, header then payload
+    char *output;                   // Frames waiting to be sent to the client
+    size_t output_start;            // Unsent frames run from output_start
+    size_t output_end;              //  to output_end
+    uint32_t scon_events;           // Events currently watched on scon
+    bool relaying;                  // Set while request sockets are watched
+};
+
+
+static struct mux_request *find_request(
+    struct mux_connection *mux, uint32_t request_id)
+{
+    list_for_each_entry(struct mux_request, list, request, &mux->requests)
+        if (request->request_id == request_id)
+            return request;
+    return NULL;
+}
+
+
+static struct mux_request *find_request_socket(
+    struct mux_connection *mux, int sock)
+{
+    list_for_each_entry(struct mux_request, list, request, &mux->requests)
+        if (request->sock == sock)
+            return request;
+    return NULL;
+}
+
+
+/* A request socket which isn't being read is removed from the epoll set
+ * rather than left watching no events, as hangups are always reported. */
+static bool watch_request(struct mux_connection *mux, int sock, bool watch)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = sock };
+    return TEST_IO(epoll_ctl(
+        mux->epoll, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, sock, &event));
+}
+
+
+/* Closing our end of the pair also removes it from the epoll set. */
+static void close_request(
+    struct mux_connection *mux, struct mux_request *request)
+{
+    IGNORE(TEST_IO(close(request->sock)));
+    list_del(&request->list);
+    free(request);
+    mux->request_count -= 1;
+}
+
+
+static size_t output_room(struct mux_connection *mux)
+{
+    return MUX_OUTPUT_SIZE - (mux->output_end - mux->output_start);
+}
+
+
+/* Requests are watched only while there is room to relay a full data frame
+ * and still reply to a client frame. */
+static bool can_relay(struct mux_connection *mux)
+{
+    return output_room(mux) >= MUX_FRAME_SIZE + MUX_REPLY_SIZE;
+}
+
+
+static bool can_receive(struct mux_connection *mux)
+{
+    return output_room(mux) >= MUX_REPLY_SIZE;
+}
+
+
+/* Queues the frame assembled in mux->frame, with length bytes of payload
+ * already following the header.  Frames are only generated when can_relay()
+ * or can_receive() has said there is room. */
+static bool send_frame(
+    struct mux_connection *mux, uint32_t request_id, uint32_t type,
+    size_t length)
+{
+    struct mux_frame_header *header = (void *) mux->frame;
+    header->length = (uint32_t) length;
+    header->request_id = request_id;
+    header->type = type;
+
+    size_t size = sizeof(*header) + length;
+    ASSERT_OK(size <= output_room(mux));
+    if (mux->output_end + size > MUX_OUTPUT_SIZE)
+    {
+        memmove(mux->output, mux->output + mux->output_start,
+            mux->output_end - mux->output_start);
+        mux->output_end -= mux->output_start;
+        mux->output_start = 0;
+    }
+    memcpy(mux->output + mux->output_end, mux->frame, size);
+    mux->output_end += size;
+    return true;
+}
+
+
+/* Sends as much of the queued output as the client will take without
+ * blocking. */
+static bool send_output(struct mux_connection *mux)
+{
+    ssize_t tx = send(mux->scon, mux->output + mux->output_start,
+        mux->output_end - mux->output_start, MSG_DONTWAIT);
+    if (tx < 0  &&  (errno == EAGAIN  ||  errno == EWOULDBLOCK))
+        return true;
+    else if (TEST_IO_(tx, "Unable to write frame"))
+    {
+        mux->output_start += (size_t) tx;
+        if (mux->output_start == mux->output_end)
+            mux->output_start = mux->output_end = 0;
+        return true;
+    }
+    else
+        return false;
+}
+
+
+static bool send_end(struct mux_connection *mux, uint32_t request_id)
+{
+    return send_frame(mux, request_id, MUX_END, 0);
+}
+
+
+/* Pops the pending error and sends it to the client as the complete response
+ * to the request, exactly as it would appear on a connection of its own. */
+static bool send_request_error(struct mux_connection *mux, uint32_t request_id)
+{
+    char *error_message = pop_error_handling(true);
+    log_message("Client %s error sent: %s", mux->client_name, error_message);
+    char *payload = mux->frame + sizeof(struct mux_frame_header);
+    snprintf(payload, MUX_DATA_SIZE, "%s\n", error_message);
+    free(error_message);
+    return
+        send_frame(mux, request_id, MUX_DATA, strlen(payload))  &&
+        send_end(mux, request_id);
+}
+
+
+static bool send_parameters(struct mux_connection *mux, uint32_t request_id)
+{
+    const struct disk_header *header = get_header();
+    struct mux_parameters *parameters =
+        (void *) (mux->frame + sizeof(struct mux_frame_header));
+    *parameters = (struct mux_parameters) {
+        .sample_frequency = get_mean_frame_rate(),
+        .earliest = timestamp_to_index_ts(1),
+        .latest = timestamp_to_index_ts((uint64_t) -1),
+        .first_decimation = 1U << header->first_decimation_log2,
+        .second_decimation = 1U << header->second_decimation_log2,
+        .live_decimation = get_decimation_factor(),
+        .fa_entry_count = header->fa_entry_count,
+        .events_fa_id = (int32_t) events_fa_id,
+    };
+
+    /* Failing to read the sniffer status is not an error here, the client is
+     * simply told the status isn't available. */
+    struct fa_status status;
+    push_error_handling();
+    if (get_sniffer_status(&status))
+    {
+        parameters->status_valid = 1;
+        parameters->link_status = status.status;
+        parameters->link_partner = status.partner;
+        parameters->last_interrupt = status.last_interrupt;
+        parameters->frame_errors = status.frame_errors;
+        parameters->soft_errors = status.soft_errors;
+        parameters->hard_errors = status.hard_errors;
+        parameters->running = status.running;
+        parameters->overrun = status.overrun;
+    }
+    free(pop_error_handling(true));
+
+    return
+        send_frame(mux, request_id, MUX_PARAMETERS, sizeof(*parameters))  &&
+        send_end(mux, request_id);
+}
+
+
+/* Starts the command in the payload.  The command line runs to the first
+ * newline and anything following is passed to the command as further input,
+ * as for batch reads.  Once the worker's socket pair exists any failure is
+ * reported through it, just as for a connection of its own. */
+static bool start_request(
+    struct mux_connection *mux, uint32_t request_id,
+    const char *payload, size_t length)
+{
+    const char *newline = memchr(payload, '\n', length);
+    size_t line_length = newline ? (size_t) (newline - payload) : length;
+    const char *input = newline ? newline + 1 : payload + length;
+    size_t input_length = length - (size_t) (input - payload);
+
+    push_error_handling();
+    struct client_info *client;
+    int pair[2];
+    bool ok =
+        TEST_OK_(mux->request_count < MUX_REQUEST_LIMIT,
+            "Too many requests")  &&
+        TEST_OK_(line_length < sizeof(client->buf), "Command too long")  &&
+        TEST_OK_(line_length == 0  ||  payload[0] != 'M', "Invalid command")  &&
+        TEST_IO(socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+    if (ok)
+    {
+        ok =
+            set_socket_nonblocking(pair[0], true)  &&
+            IF_(mux->relaying, watch_request(mux, pair[0], true));
+        if (!ok)
         {
-            *newline = '\0';
-            return true;
+            close(pair[0]);
+            close(pair[1]);
         }
+    }
+    if (!ok)
+        return send_request_error(mux, request_id);
+    pop_error_handling(false);
 
-        buflen -= (size_t) rx;
-        buf += rx;
+    struct mux_request *request = malloc(sizeof(struct mux_request));
+    request->request_id = request_id;
+    request->sock = pair[0];
+    list_add_tail(&request->list, &mux->requests);
+    mux->request_count += 1;
+
+    client = add_client();
+    client->scon = pair[1];
+    memcpy(client->name, mux->client_name, sizeof(client->name));
+    memcpy(client->buf, payload, line_length);
+
+    push_error_handling();
+    if (set_socket_timeout(pair[1], 0, 10)  &&
+        TEST_OK_(send(pair[0], input, input_length, MSG_DONTWAIT) ==
+            (ssize_t) input_length, "Command too long")  &&
+        TEST_IO(shutdown(pair[0], SHUT_WR))  &&
+        submit_connection(choose_pool(client->buf[0]), client))
+        pop_error_handling(false);
+    else
+        reject_connection(client);
+    return true;
+}
+
+
+/* Cancelling a request which has already completed is quietly ignored. */
+static bool cancel_request(struct mux_connection *mux, uint32_t request_id)
+{
+    struct mux_request *request = find_request(mux, request_id);
+    if (request)
+    {
+        close_request(mux, request);
+        return send_end(mux, request_id);
     }
+    else
+        return true;
+}
 
-    /* On failure report what we managed to read before failing. */
-    *buf = '\0';
-    log_message("Client %s sent: \"%s\"", client->name, client->buf);
-    return false;
+
+/* A new request can't reuse the id of a request still in progress, or the
+ * client couldn't tell their responses apart. */
+static bool process_frame(struct mux_connection *mux)
+{
+    uint32_t request_id = mux->header.request_id;
+    bool in_use = find_request(mux, request_id) != NULL;
+    switch (mux->header.type)
+    {
+        case MUX_COMMAND:
+            return
+                TEST_OK_(!in_use,
+                    "Request id %"PRIu32" already in use", request_id)  &&
+                start_request(
+                    mux, request_id, mux->payload, mux->header.length);
+        case MUX_CANCEL:
+            return cancel_request(mux, request_id);
+        case MUX_PARAMETERS:
+            return
+                TEST_OK_(!in_use,
+                    "Request id %"PRIu32" already in use", request_id)  &&
+                send_parameters(mux, request_id);
+        default:
+            return FAIL_("Invalid frame type %"PRIu32, mux->header.type);
+    }
 }
 
 
-/* Command successfully read, dispatch it to the appropriate handler. */
-static void dispatch_command(
+/* Reads whatever is available of the frame being received, and processes the
+ * frame once it is complete.  The client closing the connection between frames
+ * is the normal end of the connection. */
+static bool receive_frame(struct mux_connection *mux)
+{
+    size_t header_size = sizeof(mux->header);
+    char *target;
+    size_t wanted;
+    if (mux->received < header_size)
+    {
+        target = (char *) &mux->header + mux->received;
+        wanted = header_size - mux->received;
+    }
+    else
+    {
+        target = mux->payload + (mux->received - header_size);
+        wanted = header_size + mux->header.length - mux->received;
+    }
+
+    ssize_t rx = recv(mux->scon, target, wanted, MSG_DONTWAIT);
+    if (rx < 0  &&  (errno == EAGAIN  ||  errno == EWOULDBLOCK))
+        return true;        // Nothing to read after all
+    else if (rx == 0  &&  mux->received == 0)
+    {
+        mux->closed = true;
+        return true;
+    }
+
+    bool ok =
+        TEST_IO_(rx, "Socket read failed")  &&
+        TEST_OK_(rx > 0, "End of file on input");
+    if (ok)
+    {
+        mux->received += (size_t) rx;
+        if (mux->received == header_size)
+            ok = TEST_OK_(mux->header.length <= MUX_PAYLOAD_LIMIT,
+                "Frame too long");
+        if (ok  &&  mux->received == header_size + mux->header.length)
+        {
+            mux->received = 0;
+            ok = process_frame(mux);
+        }
+    }
+    return ok;
+}
+
+
+/* Relays whatever the worker has written to the client.  The request is
+ * complete when the worker has finished and closed its end of the pair. */
+static bool relay_request(
+    struct mux_connection *mux, struct mux_request *request)
+{
+    ssize_t rx = read(request->sock,
+        mux->frame + sizeof(struct mux_frame_header), MUX_DATA_SIZE);
+    if (rx > 0)
+        return send_frame(mux, request->request_id, MUX_DATA, (size_t) rx);
+    else if (rx < 0  &&  (errno == EAGAIN  ||  errno == EWOULDBLOCK))
+        return true;
+    else
+    {
+        uint32_t request_id = request->request_id;
+        close_request(mux, request);
+        return send_end(mux, request_id);
+    }
+}
+
+
+/* Watches the client for input while we have room to reply and for output
+ * while anything is queued, and the requests while we can relay. */
+static bool update_events(struct mux_connection *mux)
+{
+    uint32_t scon_events =
+        (can_receive(mux) ? EPOLLIN : 0U)  |
+        (mux->output_end > mux->output_start ? EPOLLOUT : 0U);
+    struct epoll_event event = { .events = scon_events, .data.fd = mux->scon };
+    bool ok = IF_(scon_events != mux->scon_events,
+        DO_(mux->scon_events = scon_events)  &&
+        TEST_IO(epoll_ctl(mux->epoll, EPOLL_CTL_MOD, mux->scon, &event)));
+
+    bool relaying = can_relay(mux);
+    if (ok  &&  relaying != mux->relaying)
+    {
+        mux->relaying = relaying;
+        list_for_each_entry(struct mux_request, list, request, &mux->requests)
+            ok = ok  &&  watch_request(mux, request->sock, relaying);
+    }
+    return ok;
+}
+
+
+/* Any output is sent once all the events returned together have been handled,
+ * which also takes care of the client being ready for more output. */
+static bool run_multiplex(struct mux_connection *mux)
+{
+    bool ok = true;
+    while (ok  &&  !mux->closed)
+    {
+        struct epoll_event events[MUX_MAX_EVENTS];
+        int count = epoll_wait(mux->epoll, events, MUX_MAX_EVENTS, -1);
+        ok = count >= 0  ||  TEST_OK(errno == EINTR);
+        for (int i = 0; ok  &&  i < count; i ++)
+        {
+            /* Requests are looked up by socket as an earlier event may already
+             * have closed the request, and the room left for output is checked
+             * again as earlier events may have used it up. */
+            int sock = events[i].data.fd;
+            if (sock == mux->scon)
+            {
+                if ((events[i].events & EPOLLIN)  &&  can_receive(mux))
+                    ok = receive_frame(mux);
+            }
+            else if (can_relay(mux))
+            {
+                struct mux_request *request = find_request_socket(mux, sock);
+                if (request)
+                    ok = relay_request(mux, request);
+            }
+        }
+        ok = ok  &&
+            IF_(mux->output_end > mux->output_start, send_output(mux))  &&
+            update_events(mux);
+    }
+    return ok;
+}
+
+
+/* The connection itself is closed by our caller, closing our end of every
+ * request still in progress lets their workers finish. */
+static bool process_multiplex(
     int scon, const char *client_name, const char *buf)
 {
-    log_message("Client %s command: \"%s\"", client_name, buf);
-    command_t command = lookup_command(buf[0]);
-    bool ok = command(scon, client_name, buf);
-    char *error_message = pop_error_handling(!ok);
+    push_error_handling();
+
+    struct mux_connection mux = {
+        .scon = scon, .client_name = client_name, .epoll = -1,
+        .payload = malloc(MUX_PAYLOAD_LIMIT),
+        .frame = malloc(MUX_FRAME_SIZE),
+        .output = malloc(MUX_OUTPUT_SIZE),
+        .scon_events = EPOLLIN, .relaying = true,
+    };
+    INIT_LIST_HEAD(&mux.requests);
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = scon };
+    int nodelay = 1;
+    bool ok =
+        TEST_OK_(buf[1] == '\0', "Unexpected characters after command")  &&
+        set_socket_cork(scon, false)  &&
+        TEST_IO(setsockopt(
+            scon, SOL_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)))  &&
+        TEST_IO(mux.epoll = epoll_create1(EPOLL_CLOEXEC))  &&
+        TEST_IO(epoll_ctl(mux.epoll, EPOLL_CTL_ADD, scon, &event));
     if (!ok)
-        log_message("Client %s error: %s", client_name, error_message);
-    free(error_message);
+        ok = report_socket_error(scon, client_name, false);
+    else if (report_socket_error(scon, client_name, true))
+        ok = run_multiplex(&mux);
+
+    while (mux.requests.next != &mux.requests)
+        close_request(&mux,
+            container_of(mux.requests.next, struct mux_request, list));
+    if (mux.epoll >= 0)
+        IGNORE(TEST_IO(close(mux.epoll)));
+    free(mux.payload);
+    free(mux.frame);
+    free(mux.output);
+    return ok;
 }
 
 
-static void *process_connection(void *context)
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Event loop. */
+
+/* All connections are accepted by a single thread which reads the command line
+ * from each client as it arrives, using epoll to wait for input on all of them
+ * at once.  Short configuration commands are answered directly and all other
+ * commands are handed over to a worker pool.  Once a command is handed over
+ * its socket reverts to ordinary blocking IO. */
+
+/* Seconds allowed for a client to send its command line. */
+#define COMMAND_TIMEOUT     1
+/* Longest configuration command answered by the event loop.  Each of these
+ * commands has a one line response, so the whole response fits into the send
+ * buffer of a new connection and can be written without blocking. */
+#define INLINE_COMMAND_LIMIT    16
+/* Maximum number of events handled for each call to epoll_wait(). */
+#define MAX_EVENTS          64
+
+static int server_epoll;
+/* Connections waiting for their command, in order of arrival.  Only touched by
+ * the event loop thread. */
+static LIST_HEAD(pending_list);
+
+
+static int64_t monotonic_ms(void)
 {
-    int scon = (int) (intptr_t) context;
-    struct client_info *client = add_client();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-    /* Retrieve client address so we can log all messages associated with this
-     * client with the appropriate address. */
-    get_client_name(scon, client->name);
 
-    /* Read the command, required to be one line terminated by \n, and dispatch
-     * to the appropriate handler.  Any errors are handled locally and are
-     * reported below. */
-    push_error_handling();
+/* Reads whatever is available of the command line from the client.  Returns
+ * false if the connection has failed, otherwise sets *complete once the whole
+ * line has been read.  The newline is discarded, and anything following it is
+ * left unread on the socket for the command to consume. */
+static bool read_command(struct client_info *client, bool *complete)
+{
+    char *buf = client->buf + client->length;
+    size_t buflen = sizeof(client->buf) - 1 - client->length;  // Allow '\0'
+    *complete = false;
+    errno = 0;          // Don't report stale errors from the event loop
+    ssize_t rx = recv(client->scon, buf, buflen, MSG_PEEK);
+    if (rx < 0  &&  (errno == EAGAIN  ||  errno == EWOULDBLOCK))
+        return true;        // Nothing to read after all
+
     bool ok =
+        TEST_IO_(rx, "Socket read failed")  &&
+        TEST_OK_(rx > 0, "End of file on input");
+    if (ok)
+    {
+        /* Only consume input up to the end of the line. */
+        char *newline = memchr(buf, '\n', (size_t) rx);
+        if (newline)
+            rx = newline - buf + 1;
+        ok = TEST_IO_(rx = read(client->scon, buf, (size_t) rx),
+            "Socket read failed");
+        if (ok)
+        {
+            client->length += (size_t) rx;
+            if (newline)
+            {
+                *newline = '\0';
+                *complete = true;
+            }
+            else
+                ok = TEST_OK_(client->length < sizeof(client->buf) - 1,
+                    "Read buffer exhausted");
+        }
+    }
+
+    /* On failure report what we managed to read before failing. */
+    if (!ok)
+    {
+        client->buf[client->length] = '\0';
+        log_message("Client %s sent: \"%s\"", client->name, client->buf);
+    }
+    return ok;
+}
+
+
+static void unwatch_connection(struct client_info *client)
+{
+    IGNORE(TEST_IO(epoll_ctl(server_epoll, EPOLL_CTL_DEL, client->scon, NULL)));
+    list_del(&client->queue);
+}
+
+
+/* Configuration commands can be answered without blocking unless they ask for
+ * one of the lists (I, L or M) or are simply too long. */
+static bool answer_inline(const char *buf)
+{
+    return
+        buf[0] == 'C'  &&
+        strlen(buf) <= INLINE_COMMAND_LIMIT + 1  &&
+        strpbrk(buf + 1, "ILM") == NULL;
+}
+
+
+/* Called with the command line read and error handling pushed.  Short
+ * configuration commands are run here on the still non-blocking socket, so a
+ * client which doesn't read its response can only cause its own command to
+ * fail.  Everything else is passed to a worker. */
+static void start_command(struct client_info *client)
+{
+    int scon = client->scon;
+    if (answer_inline(client->buf))
+    {
+        if (set_socket_cork(scon, true))
+        {
+            pop_error_handling(false);
+            serve_connection(client);
+        }
+        else
+            reject_connection(client);
+    }
+    else if (
+        set_socket_nonblocking(scon, false)  &&
         set_socket_cork(scon, true)  &&
-        set_socket_timeout(scon, 1, 10)  &&
-        read_line(scon, client);
+        set_socket_timeout(scon, COMMAND_TIMEOUT, 10)  &&
+        submit_connection(choose_pool(client->buf[0]), client))
+        pop_error_handling(false);
+    else
+        reject_connection(client);
+}
 
-    if (ok)
-        /* Past this point only dispatch_command() can communicate with the
-         * client, any further errors it needs to handle. */
-        dispatch_command(scon, client->name, client->buf);
+
+static void process_client_event(struct client_info *client)
+{
+    push_error_handling();
+    bool complete;
+    if (!read_command(client, &complete))
+    {
+        unwatch_connection(client);
+        reject_connection(client);
+    }
+    else if (complete)
+    {
+        unwatch_connection(client);
+        start_command(client);
+    }
     else
-        /* Any errors seen at this stage are reported back to the client. */
-        pop_client_error(scon, client->name);
+        pop_error_handling(false);
+}
 
-    /* Uncork the socket before closing to ensure any remaining data is sent.
-     * It seems that if we close the socket with cork enabled and unread
-     * incoming data then the tail end of the sent data stream can be lost. */
-    set_socket_cork(scon, false);
-    IGNORE(TEST_IO(close(scon)));
 
-    remove_client(client);
-    return NULL;
+/* Accepts all waiting connections and starts watching them for input. */
+static void accept_connections(int sock)
+{
+    int scon;
+    while ((scon = accept4(sock, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        struct client_info *client = add_client();
+        client->scon = scon;
+        client->deadline = monotonic_ms() + COMMAND_TIMEOUT * 1000;
+        /* Retrieve client address so we can log all messages associated with
+         * this client with the appropriate address. */
+        get_client_name(scon, client->name);
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+        push_error_handling();
+        if (TEST_IO(epoll_ctl(server_epoll, EPOLL_CTL_ADD, scon, &event)))
+        {
+            pop_error_handling(false);
+            list_add_tail(&client->queue, &pending_list);
+        }
+        else
+            reject_connection(client);
+    }
+    if (errno != EAGAIN  &&  errno != EWOULDBLOCK)
+        IGNORE(TEST_IO_(scon, "Unable to accept connection"));
+}
+
+
+/* Drops connections which haven't sent their command in time, and returns the
+ * time in milliseconds until the next connection is due, or -1 if none. */
+static int expire_connections(void)
+{
+    int64_t now = monotonic_ms();
+    while (pending_list.next != &pending_list)
+    {
+        struct client_info *client =
+            container_of(pending_list.next, struct client_info, queue);
+        if (client->deadline > now)
+            return (int) (client->deadline - now);
+
+        unwatch_connection(client);
+        push_error_handling();
+        errno = 0;
+        IGNORE(FAIL_("Timed out reading command"));
+        client->buf[client->length] = '\0';
+        log_message("Client %s sent: \"%s\"", client->name, client->buf);
+        reject_connection(client);
+    }
+    return -1;
 }
 
 
 static void *run_server(void *context)
 {
     int sock = (int)(intptr_t) context;
-    /* Note that we need to create the spawned threads with DETACHED attribute,
-     * otherwise we accumlate internal joinable state information and eventually
-     * run out of resources. */
-    pthread_attr_t attr;
-    ASSERT_0(pthread_attr_init(&attr));
-    ASSERT_0(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    bool ok =
+        set_socket_nonblocking(sock, true)  &&
+        TEST_IO(server_epoll = epoll_create1(EPOLL_CLOEXEC))  &&
+        TEST_IO(epoll_ctl(server_epoll, EPOLL_CTL_ADD, sock, &event));
 
-    int scon;
-    pthread_t thread;
-    while (TEST_IO(scon = accept(sock, NULL, NULL)))
-        IGNORE(TEST_0(pthread_create(&thread, &attr,
-            process_connection, (void *)(intptr_t) scon)));
+    int timeout = -1;
+    while (ok)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(server_epoll, events, MAX_EVENTS, timeout);
+        ok = count >= 0  ||  TEST_OK(errno == EINTR);
+        for (int i = 0; i < count; i ++)
+        {
+            /* The listening socket is the only event without a client. */
+            struct client_info *client = events[i].data.ptr;
+            if (client)
+                process_client_event(client);
+            else
+                accept_connections(sock);
+        }
+        timeout = expire_connections();
+    }
     return NULL;
 }
 
@@ -620,9 +1467,15 @@ static int server_socket;
 bool initialise_server(
     struct buffer *fa_buffer, struct buffer *decimated,
     unsigned int _events_fa_id, const char *_server_name,
-    const char *bind_address, int port, bool extra, bool reuseaddr)
+    const char *bind_address, int port, bool extra, bool reuseaddr,
+    unsigned int read_workers, unsigned int subscribers)
 {
     initialise_subscribe(fa_buffer, decimated);
+    initialise_pool(&read_pool, read_workers);
+    initialise_pool(&subscribe_pool, subscribers);
+    ASSERT_0(pthread_attr_init(&worker_attr));
+    ASSERT_0(pthread_attr_setdetachstate(
+        &worker_attr, PTHREAD_CREATE_DETACHED));
     fa_block_buffer = fa_buffer;
     events_fa_id = _events_fa_id;
     server_name = _server_name;
@@ -645,7 +1498,7 @@ bool initialise_server(
         TEST_IO_(
             bind(server_socket, (struct sockaddr *) &sin, sizeof(sin)),
             "Unable to bind to server socket")  &&
-        TEST_IO(listen(server_socket, 5))  &&
+        TEST_IO(listen(server_socket, SOMAXCONN))  &&
         DO_(log_message("Server listening on port %d", port));
 }
 
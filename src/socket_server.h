@@ -27,10 +27,15 @@
  *      michael.abbott@diamond.ac.uk
  */
 
+struct buffer;
+
+/* Commands other than configuration commands are run by at most read_workers
+ * threads, and at most subscribers subscriptions are served at once. */
 bool initialise_server(
     struct buffer *fa_buffer, struct buffer *decimated,
     unsigned int events_fa_id, const char *server_name,
-    const char *bind_address, int port, bool extra, bool reuseaddr);
+    const char *bind_address, int port, bool extra, bool reuseaddr,
+    unsigned int read_workers, unsigned int subscribers);
 bool start_server(void);
 void terminate_server(void);
 
@@ -40,3 +45,50 @@ void terminate_server(void);
 bool report_socket_error(int scon, const char *client_name, bool ok);
 /* Controls buffering of socket. */
 bool set_socket_cork(int sock, bool cork);
+
+
+/* Protocol version 2.  After the M command has been acknowledged with a null
+ * byte all traffic on the connection in both directions is carried in frames,
+ * each consisting of a mux_frame_header followed by length bytes of payload.
+ * The client chooses the request id for each request, and all frames sent in
+ * response carry the same id.  Every request is completed by exactly one
+ * MUX_END frame, after which its id can be used again. */
+struct mux_frame_header {
+    uint32_t length;            // Bytes of payload following this header
+    uint32_t request_id;        // Identifies the request this frame belongs to
+    uint32_t type;              // One of enum mux_frame_type
+} __attribute__((packed));
+
+enum mux_frame_type {
+    /* Sent by the client. */
+    MUX_COMMAND = 1,            // Payload is a version 1 command
+    MUX_CANCEL = 2,             // Cancels the request, no payload
+    MUX_PARAMETERS = 3,         // Requests a mux_parameters frame, no payload
+    /* Sent by the server. */
+    MUX_DATA = 4,               // Next part of the response to a command
+    MUX_END = 5,                // Request complete, no payload
+    /* MUX_PARAMETERS is sent in reply with a mux_parameters payload. */
+};
+
+/* Payload of the MUX_PARAMETERS reply, with the values otherwise returned by
+ * the C command given in brackets. */
+struct mux_parameters {
+    double sample_frequency;    // Current sample frequency in Hz (CF)
+    uint64_t earliest;          // Earliest archived timestamp in us (CT)
+    uint64_t latest;            // Latest archived timestamp in us (CU)
+    uint32_t first_decimation;  // (Cd)
+    uint32_t second_decimation; // (CD)
+    uint32_t live_decimation;   // (CC)
+    uint32_t fa_entry_count;    // (CK)
+    int32_t events_fa_id;       // Event mask FA id or -1 (CE)
+    /* Sniffer status as returned by CS, all zero if status_valid is zero. */
+    uint32_t status_valid;
+    uint32_t link_status;
+    uint32_t link_partner;
+    uint32_t last_interrupt;
+    uint32_t frame_errors;
+    uint32_t soft_errors;
+    uint32_t hard_errors;
+    uint32_t running;
+    uint32_t overrun;
+} __attribute__((packed));
@@ -0,0 +1,217 @@
+/* Power spectrum estimation for archived data.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <complex.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+
+#include "spectrum.h"
+
+
+struct spectrum {
+    unsigned int length;        // FFT length, a power of 2
+    double *window;             // Hann window of length points
+    double window_power;        // Sum of squares of window
+    double complex *twiddle;    // exp(-2 pi i k / length) for k < length/2
+    unsigned int *reverse;      // Bit reversal permutation of indices
+};
+
+
+struct spectrum *create_spectrum(unsigned int length)
+{
+    struct spectrum *spectrum = malloc(sizeof(struct spectrum));
+    spectrum->length = length;
+    spectrum->window = malloc(length * sizeof(double));
+    spectrum->twiddle = malloc(length / 2 * sizeof(double complex));
+    spectrum->reverse = malloc(length * sizeof(unsigned int));
+
+    /* The same symmetric Hann window as used by the viewer. */
+    spectrum->window_power = 0;
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        double w = 1 - cos(2 * M_PI * i / (length - 1));
+        spectrum->window[i] = w;
+        spectrum->window_power += w * w;
+    }
+
+    for (unsigned int k = 0; k < length / 2; k ++)
+        spectrum->twiddle[k] = cexp(-2 * M_PI * I * k / length);
+
+    unsigned int bits = 0;
+    while ((1U << bits) < length)
+        bits += 1;
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        unsigned int r = 0;
+        for (unsigned int b = 0; b < bits; b ++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        spectrum->reverse[i] = r;
+    }
+    return spectrum;
+}
+
+
+void destroy_spectrum(struct spectrum *spectrum)
+{
+    free(spectrum->window);
+    free(spectrum->twiddle);
+    free(spectrum->reverse);
+    free(spectrum);
+}
+
+
+size_t spectrum_workspace_size(const struct spectrum *spectrum)
+{
+    return spectrum->length * sizeof(double complex);
+}
+
+
+double spectrum_window_power(const struct spectrum *spectrum)
+{
+    return spectrum->window_power;
+}
+
+
+unsigned int welch_segments(unsigned int length, unsigned int count)
+{
+    if (count < length)
+        return 0;
+    else
+        return (count - length) / (length / 2) + 1;
+}
+
+
+/* In place radix 2 decimation in time FFT. */
+static void fft(const struct spectrum *spectrum, double complex z[])
+{
+    unsigned int length = spectrum->length;
+    for (unsigned int i = 0; i < length; i ++)
+    {
+        unsigned int j = spectrum->reverse[i];
+        if (i < j)
+        {
+            double complex t = z[i];
+            z[i] = z[j];
+            z[j] = t;
+        }
+    }
+
+    for (unsigned int half = 1; half < length; half *= 2)
+    {
+        unsigned int stride = length / (2 * half);
+        for (unsigned int start = 0; start < length; start += 2 * half)
+        {
+            double complex *a = &z[start];
+            double complex *b = &z[start + half];
+            for (unsigned int k = 0; k < half; k ++)
+            {
+                double complex t = b[k] * spectrum->twiddle[k * stride];
+                b[k] = a[k] - t;
+                a[k] = a[k] + t;
+            }
+        }
+    }
+}
+
+
+static inline double norm(double complex z)
+{
+    return creal(z) * creal(z) + cimag(z) * cimag(z);
+}
+
+
+unsigned int accumulate_spectrum(
+    const struct spectrum *spectrum,
+    const struct fa_entry *data, unsigned int count,
+    void *workspace, double power[])
+{
+    unsigned int length = spectrum->length;
+    double complex *z = workspace;
+    unsigned int segments = welch_segments(length, count);
+    for (unsigned int s = 0; s < segments; s ++)
+    {
+        const struct fa_entry *segment = data + s * (length / 2);
+
+        int64_t sum_x = 0, sum_y = 0;
+        for (unsigned int i = 0; i < length; i ++)
+        {
+            sum_x += segment[i].x;
+            sum_y += segment[i].y;
+        }
+        double mean_x = (double) sum_x / length;
+        double mean_y = (double) sum_y / length;
+        for (unsigned int i = 0; i < length; i ++)
+            z[i] = spectrum->window[i] * (
+                (segment[i].x - mean_x) + I * (segment[i].y - mean_y));
+
+        fft(spectrum, z);
+
+        /* As x and y are real their transforms are the conjugate symmetric
+         * and antisymmetric parts of the transform of x + iy:
+         *  X[k] = (Z[k] + conj(Z[N-k])) / 2
+         *  Y[k] = (Z[k] - conj(Z[N-k])) / 2i */
+        for (unsigned int k = 0; k < length / 2; k ++)
+        {
+            double complex a = z[k];
+            double complex b = conj(z[(length - k) & (length - 1)]);
+            power[2*k]     += 0.25 * norm(a + b);
+            power[2*k + 1] += 0.25 * norm(a - b);
+        }
+    }
+    return segments;
+}
+
+
+unsigned int compute_log_bins(
+    unsigned int length, unsigned int count, unsigned int counts[])
+{
+    /* Group boundaries are the integer parts of count logarithmically spaced
+     * points from 1 to length, with empty groups discarded. */
+    unsigned int groups = 0;
+    unsigned int last = 1;
+    for (unsigned int i = 1; i < count; i ++)
+    {
+        unsigned int edge = i + 1 == count ? length :
+            (unsigned int) pow(length, (double) i / (count - 1));
+        if (edge > last)
+        {
+            counts[groups] = edge - last;
+            groups += 1;
+            last = edge;
+        }
+    }
+    return groups;
+}
@@ -0,0 +1,66 @@
+/* Power spectrum estimation for archived data.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Power spectra are estimated by Welch's method: the data is cut into
+ * segments of a fixed power of two length overlapping by half, each segment
+ * has its mean removed and is Hann windowed, and the squared magnitudes of the
+ * FFTs of all the segments are summed.  The X and Y axes of FA data are
+ * transformed together as the real and imaginary parts of a single FFT. */
+
+struct spectrum;
+
+/* Prepares for computing FFTs of the given length, which must be a power of 2
+ * no smaller than 4.  The result can be shared between threads. */
+struct spectrum *create_spectrum(unsigned int length);
+void destroy_spectrum(struct spectrum *spectrum);
+
+/* Size of the workspace needed by each thread calling accumulate_spectrum(). */
+size_t spectrum_workspace_size(const struct spectrum *spectrum);
+
+/* Sum of squares of the window, needed to scale the accumulated power. */
+double spectrum_window_power(const struct spectrum *spectrum);
+
+/* Returns the number of segments of the given length fitting into a run of
+ * count contiguous samples. */
+unsigned int welch_segments(unsigned int length, unsigned int count);
+
+/* Adds the power spectra of all the segments in a run of count contiguous FA
+ * samples into power[], which has length/2 pairs of X and Y power, one pair
+ * for each frequency bin from 0 up to but excluding the Nyquist frequency.
+ * Returns the number of segments added. */
+unsigned int accumulate_spectrum(
+    const struct spectrum *spectrum,
+    const struct fa_entry *data, unsigned int count,
+    void *workspace, double power[]);
+
+/* Computes logarithmically spaced groups of bins for a spectrum of length
+ * bins, in the same way as the viewer's compute_gaps().  No more than count-1
+ * groups are returned in counts[], the number of groups is returned. */
+unsigned int compute_log_bins(
+    unsigned int length, unsigned int count, unsigned int counts[]);
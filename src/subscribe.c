@@ -46,6 +46,9 @@
 #include "disk.h"
 #include "transform.h"
 #include "decimate.h"
+#include "encode.h"
+#include "pool.h"
+#include "transpose.h"
 
 #include "subscribe.h"
 
@@ -74,6 +77,10 @@ struct subscribe_parse {
     bool want_t0;                   // Set if T0 should be sent
     bool uncork;                    // Set if stream should be uncorked
     bool decimated;                 // Source of data (FA or decimated)
+    bool encode;                    // Send compressed data
+    enum output_format format;      // Format of data sent
+    bool history;                   // Start with archived data
+    uint64_t start;                 // Start of archived data
 };
 
 
@@ -85,15 +92,26 @@ static bool parse_options(const char **string, struct subscribe_parse *parse)
     parse->want_t0   = read_char(string, 'Z');
     parse->uncork    = read_char(string, 'U');
     parse->decimated = read_char(string, 'D');
+    parse->encode    = read_char(string, 'X');
     return
         TEST_OK_(!parse->decimated  ||  decimated_buffer != NULL,
-            "Decimated data not available");
+            "Decimated data not available")  &&
+        parse_output_format(string, &parse->format)  &&
+        IF_(parse->history = read_char(string, 'H'),
+            parse_time_or_seconds(string, &parse->start)  &&
+            TEST_OK_(!parse->decimated,
+                "Decimated data not available with history")  &&
+            TEST_OK_(parse->send_timestamp != SEND_EXTENDED,
+                "Extended timestamps not available with history"));
 }
 
 /* A subscribe request is a filter mask followed by options:
  *
  *  subscription = "S" filter-mask options
- *  options = [ "T" [ "E" ]] [ "Z" ] [ "U" ] [ "D" ]
+ *  options =
+ *      [ "T" [ "E" ]] [ "Z" ] [ "U" ] [ "D" ] [ "X" ] [ "O" format ]
+ *      [ "H" start ]
+ *  format = "F" | "S"
  *
  * The options have the following meanings:
  *
@@ -102,9 +120,18 @@ static bool parse_options(const char **string, struct subscribe_parse *parse)
  *  Z   Start subscription stream with t0
  *  U   Uncork data stream
  *  D   Want decimated data stream
+ *  X   Send compressed data, see encode.h
+ *  OF  Send data as calibrated floats, see transpose.h
+ *  OS  Send data as scaled 16-bit integers
+ *  H   Start with archived data from the given start time
  *
  * If TZ is specified then the timestamp is sent first before T0.
- * If TEZ is specified then T0 is sent with each timestamp. */
+ * If TEZ is specified then T0 is sent with each timestamp.
+ *
+ * With H the stream starts at the given time in the archive and runs on
+ * without a break into live data, and the timestamp and T0 are those of the
+ * first archived sample.  This is only available for FA data without extended
+ * timestamps. */
 static bool parse_subscription(
     const char **string, unsigned int fa_entry_count,
     struct subscribe_parse *parse)
@@ -116,30 +143,45 @@ static bool parse_subscription(
 }
 
 
+/* Writes data to the client, encoding it if requested. */
+static bool write_data(
+    int scon, struct encoder *encoder, const void *data, size_t length,
+    const char *error)
+{
+    if (encoder)
+        return write_encoded(encoder, scon, data, length);
+    else
+        return TEST_write_(scon, data, length, "%s", error);
+}
+
+
 /* Sends header according to selected options.  The transmitted data optionally
  * begins with the timestamp and T0 values, in that order, if requested. */
 static bool send_header(
-    int scon, struct subscribe_parse *parse,
+    int scon, struct encoder *encoder, struct subscribe_parse *parse,
     size_t block_size, uint64_t timestamp, const uint32_t *id0)
 {
+#define HEADER_ERROR "Unable to write header"
     if (parse->send_timestamp == SEND_EXTENDED)
     {
         struct extended_timestamp_header header = {
             .block_size = (uint32_t) block_size,
             .offset = 0 };
-        return TEST_write(scon, &header, sizeof(header));
+        return write_data(scon, encoder, &header, sizeof(header), HEADER_ERROR);
     }
     else
         return
             IF_(parse->send_timestamp == SEND_BASIC,
-                TEST_write(scon, &timestamp, sizeof(uint64_t)))  &&
+                write_data(scon, encoder,
+                    &timestamp, sizeof(uint64_t), HEADER_ERROR))  &&
             IF_(parse->want_t0,
-                TEST_write(scon, id0, sizeof(uint32_t)));
+                write_data(scon, encoder,
+                    id0, sizeof(uint32_t), HEADER_ERROR));
 }
 
 
 static bool send_extended_timestamp(
-    int scon, bool want_t0, bool decimated,
+    int scon, struct encoder *encoder, bool want_t0, bool decimated,
     size_t block_size, uint64_t timestamp, uint32_t id0)
 {
     const struct disk_header *header = get_header();
@@ -158,16 +200,16 @@ static bool send_extended_timestamp(
             .timestamp = timestamp,
             .duration = duration,
             .id_zero = id0 };
-        return TEST_write_(
-            scon, &extended_timestamp, sizeof(extended_timestamp), TS_ERROR);
+        return write_data(scon, encoder,
+            &extended_timestamp, sizeof(extended_timestamp), TS_ERROR);
     }
     else
     {
         struct extended_timestamp extended_timestamp = {
             .timestamp = timestamp,
             .duration = duration };
-        return TEST_write_(
-            scon, &extended_timestamp, sizeof(extended_timestamp), TS_ERROR);
+        return write_data(scon, encoder,
+            &extended_timestamp, sizeof(extended_timestamp), TS_ERROR);
     }
 }
 
@@ -216,22 +258,25 @@ static void copy_frames(
 static bool send_subscription(
     int scon, struct reader_state *reader,
     struct subscribe_parse *parse, unsigned int fa_entry_count,
+    struct encoder *encoder, struct formatter *formatter,
     const void *block, uint64_t timestamp)
 {
     unsigned int block_size = (unsigned int) (
         reader_block_size(reader) / fa_entry_count / FA_ENTRY_SIZE);
     unsigned int id_count = count_mask_bits(&parse->mask, fa_entry_count);
-    size_t buffer_size = block_size * FA_ENTRY_SIZE * id_count;
-
-    bool ok =
-        send_header(scon, parse, block_size, timestamp, block)  &&
-        IF_(parse->uncork, set_socket_cork(scon, false));
+    size_t line_size = FA_ENTRY_SIZE * id_count;
+    size_t header_size = format_header_size(formatter);
 
+    bool ok = true;
     while (ok)
     {
-        /* Grab a copy of the data in the buffer. */
-        char buffer[buffer_size];
-        copy_frames(buffer, block, &parse->mask, fa_entry_count, block_size);
+        /* Grab a copy of the data in the buffer and convert it for sending,
+         * one block at a time. */
+        char buffer[header_size + block_size * line_size];
+        copy_frames(buffer + header_size,
+            block, &parse->mask, fa_entry_count, block_size);
+        size_t buffer_size =
+            format_lines(formatter, buffer, block_size, line_size);
         uint32_t id0 = *(const uint32_t *) block;
 
         ok =
@@ -240,9 +285,10 @@ static bool send_subscription(
             /* Write the data if it's clean. */
             IF_(parse->send_timestamp == SEND_EXTENDED,
                 send_extended_timestamp(
-                    scon, parse->want_t0, parse->decimated,
+                    scon, encoder, parse->want_t0, parse->decimated,
                     block_size, timestamp, id0))  &&
-            TEST_write_(scon, buffer, buffer_size, "Unable to write frame")  &&
+            write_data(scon, encoder, buffer, buffer_size,
+                "Unable to write frame")  &&
             /* Get the next block. */
             TEST_NULL_(
                 block = get_read_block(reader, &timestamp),
@@ -252,24 +298,16 @@ static bool send_subscription(
 }
 
 
-/* A subscription is a command of the form S<mask> where <mask> is a mask
- * specification as described in mask.h.  The default mask is empty. */
-bool process_subscribe(int scon, const char *client_name, const char *buf)
+/* Starts the subscription with live data. */
+static bool subscribe_live(
+    int scon, const char *client_name,
+    struct subscribe_parse *parse, unsigned int fa_entry_count,
+    struct encoder *encoder, struct formatter *formatter)
 {
-    unsigned int fa_entry_count = get_header()->fa_entry_count;
-
-    push_error_handling();
-
-    /* Parse the incoming request. */
-    struct subscribe_parse parse;
-    if (!DO_PARSE("subscription",
-            parse_subscription, buf, fa_entry_count, &parse))
-        return report_socket_error(scon, client_name, false);
-
     /* See if we can start the subscription, report the final status to the
      * caller. */
     struct reader_state *reader = open_reader(
-        parse.decimated ? decimated_buffer : fa_block_buffer, false);
+        parse->decimated ? decimated_buffer : fa_block_buffer, false);
     uint64_t timestamp;
     const void *block = get_read_block(reader, &timestamp);
     bool start_ok = TEST_NULL_(block, "No data currently available");
@@ -277,11 +315,91 @@ bool process_subscribe(int scon, const char *client_name, const char *buf)
 
     /* Send the requested subscription if all is well. */
     if (start_ok  &&  ok)
-        ok = send_subscription(
-            scon, reader, &parse, fa_entry_count, block, timestamp);
+    {
+        unsigned int block_size = (unsigned int) (
+            reader_block_size(reader) / fa_entry_count / FA_ENTRY_SIZE);
+        ok =
+            send_header(scon, encoder, parse, block_size, timestamp, block)  &&
+            IF_(parse->uncork, set_socket_cork(scon, false))  &&
+            send_subscription(
+                scon, reader, parse, fa_entry_count, encoder, formatter,
+                block, timestamp);
+    }
 
     close_reader(reader);
+    return ok;
+}
+
+
+/* Starts the subscription with archived data.  The live reader is only opened
+ * once we have caught up with the archive, as the live buffer is far too small
+ * to hold data while older data is sent. */
+static bool subscribe_history(
+    int scon, const char *client_name,
+    struct subscribe_parse *parse, unsigned int fa_entry_count,
+    struct encoder *encoder, struct formatter *formatter)
+{
+    struct history *history;
+    bool start_ok = open_history(
+        scon, client_name, &parse->mask, parse->start, encoder, formatter,
+        &history);
+    bool ok = report_socket_error(scon, client_name, start_ok);
+    if (!start_ok)
+        return ok;
+
+    struct reader_state *reader = NULL;
+    const void *block = NULL;
+    uint64_t timestamp;
+    ok = ok  &&
+        send_history_header(history,
+            parse->send_timestamp == SEND_BASIC, parse->want_t0)  &&
+        IF_(parse->uncork, set_socket_cork(scon, false))  &&
+        send_history(history)  &&
+        DO_(reader = open_reader(fa_block_buffer, false))  &&
+        TEST_NULL_(block = get_read_block(reader, &timestamp),
+            "No data currently available")  &&
+        join_history(history, *(const uint32_t *) block);
+    close_history(history);
+
+    if (ok)
+        ok = send_subscription(
+            scon, reader, parse, fa_entry_count, encoder, formatter,
+            block, timestamp);
+    if (reader)
+        close_reader(reader);
+    return ok;
+}
+
+
+/* A subscription is a command of the form S<mask> where <mask> is a mask
+ * specification as described in mask.h.  The default mask is empty. */
+bool process_subscribe(int scon, const char *client_name, const char *buf)
+{
+    unsigned int fa_entry_count = get_header()->fa_entry_count;
+
+    push_error_handling();
+
+    /* Parse the incoming request. */
+    struct subscribe_parse parse;
+    if (!DO_PARSE("subscription",
+            parse_subscription, buf, fa_entry_count, &parse))
+        return report_socket_error(scon, client_name, false);
 
+    /* Compressed data is delta encoded over whole lines of formatted data. */
+    unsigned int id_count = count_mask_bits(&parse.mask, fa_entry_count);
+    struct formatter *formatter =
+        create_formatter(parse.format, &parse.mask, fa_entry_count, 1);
+    struct encoder *encoder = parse.encode ?
+        create_encoder((unsigned int) (
+            formatted_line_size(formatter, FA_ENTRY_SIZE * id_count) / 4)) :
+        NULL;
+    bool ok = IF_ELSE(parse.history,
+        subscribe_history(
+            scon, client_name, &parse, fa_entry_count, encoder, formatter),
+        subscribe_live(
+            scon, client_name, &parse, fa_entry_count, encoder, formatter));
+    destroy_encoder(encoder);
+    destroy_formatter(formatter);
     return ok;
 }
 
@@ -63,8 +63,9 @@
 static struct disk_header *header;
 /* Archiver index. */
 static struct data_index *data_index;
-/* Area to write DD data. */
-static struct decimated_data *dd_area;
+/* DD data area, only read here.  DD data is staged with each major block and
+ * written back by the disk writer. */
+static const struct decimated_data *dd_area;
 
 /* EVR events are handled completely differently, if present.  Only active if
  * positive value assigned. */
@@ -75,14 +76,17 @@ static unsigned int events_fa_id_output;    // Output id or -1
 static unsigned int input_frame_count;
 static unsigned int input_decimation_count;
 
-/* This lock guards access to header->current_major_block, or to be precise,
- * enforces the invariant described here.  The transform thread has full
- * unconstrained access to this variable, but only updates it under this lock.
- * All major blocks other than current_major_block are valid for reading from
- * disk, the current block is either being worked on or being written to disk.
- * The request_read() function ensures that the previously current block is
- * written and therefore is available. */
-DECLARE_LOCKING(transform_lock);
+/* This sequence lock guards access to header->current_major_block and the index
+ * entries, or to be precise, enforces the invariant described here.  The
+ * transform thread has full unconstrained access to these, but only completes
+ * an index entry and advances current_major_block under this lock.  All major
+ * blocks other than current_major_block are valid for reading from disk, the
+ * current block is either being worked on or being written to disk.  The write
+ * of a block is always scheduled before the block is published, so the
+ * request_read() function ensures that the previously current block is written
+ * and therefore is available.  Readers never wait for the writer, which may
+ * itself be waiting for the disk. */
+DECLARE_SEQLOCK(index_seqlock);
 
 static size_t page_size;    // 4096
 
@@ -91,12 +95,15 @@ static size_t page_size;    // 4096
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Buffered IO support. */
 
-/* Double-buffered block IO. */
+/* Double-buffered block IO.  Each buffer holds a complete major block followed
+ * by the double decimated data for the same block, staged here so that it can
+ * be written back in one batch together with the major block. */
 
 static void *buffers[2];           // Two major buffers to receive data
 static unsigned int current_buffer; // Index of buffer currently receiving data
 static unsigned int fa_offset;     // Current sample count into current block
 static unsigned int d_offset;      // Current decimated sample count
+static unsigned int dd_offset;     // Current double decimated sample count
 
 
 static inline struct fa_entry *fa_block(unsigned int id)
@@ -111,6 +118,16 @@ static inline struct decimated_data *d_block(unsigned int id)
 }
 
 
+/* The staged DD data follows the major block and is organised as an array of
+ * dd_sample_count samples for each archived id. */
+static inline struct decimated_data *dd_block(unsigned int id)
+{
+    struct decimated_data *dd_stage =
+        buffers[current_buffer] + header->major_block_size;
+    return dd_stage + id * header->dd_sample_count + dd_offset;
+}
+
+
 /* Advances the offset pointer within an minor block by the number of bytes
  * written, returns true iff the block is now full. */
 static bool advance_block(void)
@@ -126,15 +143,21 @@ static void reset_block(void)
 {
     fa_offset = 0;
     d_offset = 0;
+    dd_offset = 0;
 }
 
 
-/* Writes the currently written major block to disk at the current offset. */
+/* Writes the currently written major block to disk at the current offset
+ * together with its staged DD data. */
 static void write_major_block(void)
 {
     off64_t offset = (off64_t) header->major_data_start +
         (off64_t) header->current_major_block * header->major_block_size;
-    schedule_write(offset, buffers[current_buffer], header->major_block_size);
+    void *block = buffers[current_buffer];
+    schedule_write(
+        offset, block, header->major_block_size,
+        block + header->major_block_size,
+        header->current_major_block * header->dd_sample_count);
 
     current_buffer = 1 - current_buffer;
     reset_block();
@@ -144,12 +167,35 @@ static void write_major_block(void)
 /* Initialises IO buffers for the given minor block size. */
 static void initialise_io_buffer(void)
 {
+    size_t dd_stage_size = sizeof(struct decimated_data) *
+        header->archive_mask_count * header->dd_sample_count;
     for (unsigned int i = 0; i < 2; i ++)
-        buffers[i] = valloc(header->major_block_size);
+        buffers[i] = valloc(header->major_block_size + dd_stage_size);
 
     current_buffer = 0;
-    fa_offset = 0;
-    d_offset = 0;
+    reset_block();
+}
+
+
+/* Readers following the archive into live data can copy samples out of the
+ * major block still being filled.  Samples below fa_visible are not touched
+ * again until the buffer is handed to the disk writer or discarded at a gap,
+ * and only these two events are published under block_seqlock: fa_visible
+ * itself simply advances with a release store after each input block. */
+DECLARE_SEQLOCK(block_seqlock);
+static unsigned int fa_visible;     // Samples in buffer available to readers
+
+static void publish_block(void)
+{
+    __atomic_store_n(&fa_visible, fa_offset, __ATOMIC_RELEASE);
+}
+
+/* Must be called before the current buffer is handed over or reset. */
+static void retire_block(void)
+{
+    seq_write_begin(&block_seqlock);
+    fa_visible = 0;
+    seq_write_end(&block_seqlock);
 }
 
 
@@ -477,65 +523,39 @@ static void decimate_block(const void *read_block)
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Double data decimation. */
 
-/* Current offset into DD data area. */
-static unsigned int dd_offset;
 /* Count of IDs being stored. */
 static unsigned int output_id_count;
-/* Array of previously madvised addresses. */
-static void **madvise_array;
 
 
 
 /* In this case we work on decimated data sorted in the d_block and we write to
- * the in memory DD block. */
+ * the DD data staged with the current major block. */
 static void double_decimate_block(void)
 {
-    struct decimated_data *output = dd_area + dd_offset;
     unsigned int decimation_log2 =
         header->first_decimation_log2 + header->second_decimation_log2;
 
     for (unsigned int i = 0; i < output_id_count; i ++)
     {
+        struct decimated_data *output = dd_block(i);
         if (i == events_fa_id_output)
             compute_events_result(&double_accumulators[i], output);
         else
             compute_result(&double_accumulators[i], decimation_log2, output);
         initialise_accum(&double_accumulators[i]);
-        output += header->dd_total_count;
     }
 
-    dd_offset = (dd_offset + 1) % header->dd_total_count;
+    dd_offset += 1;
 }
 
 
 static void reset_double_decimation(void)
 {
-    dd_offset = header->current_major_block * header->dd_sample_count;
     for (unsigned int i = 0; i < output_id_count; i ++)
         initialise_accum(&double_accumulators[i]);
 }
 
 
-/* This is called at the start of a round of block processing to give the system
- * notice to ensure that all the pages required for writing double decimation
- * values are in memory.  This should be called after dd_offset has been
- * advanced. */
-static void madvise_double_decimation(void)
-{
-    struct decimated_data *output = dd_area + dd_offset;
-    for (unsigned int i = 0; i < output_id_count; i ++)
-    {
-        void *dd_address = (void *) ((uintptr_t) output & -page_size);
-        output += header->dd_total_count;
-        if (dd_address != madvise_array[i])
-        {
-            IGNORE(TEST_IO(madvise(dd_address, page_size, MADV_WILLNEED)));
-            madvise_array[i] = dd_address;
-        }
-    }
-}
-
-
 /* Helper function to compute offset into output structure corresponding to
  * given input id.  Returns -1 if no entry found. */
 static unsigned int input_id_to_output(
@@ -559,13 +579,196 @@ static void initialise_double_decimation(void)
     events_fa_id_output =
         input_id_to_output(&header->archive_mask, events_fa_id);
     double_accumulators = calloc(output_id_count, sizeof(struct fa_accum));
-    madvise_array = calloc(output_id_count, sizeof(void *));
     reset_double_decimation();
+}
 
-    madvise_double_decimation();
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Gap map. */
+
+/* Gaps in the archive are recorded by listing the blocks which directly follow
+ * a gap.  As blocks are written in turn the list is naturally kept in archive
+ * order, oldest first: new gaps are added at the end as blocks are completed,
+ * and old gaps fall off the front as their blocks are overwritten.  There are
+ * two lists, one for timestamp gaps only and one which also counts id0 gaps,
+ * each held in a ring buffer with room for every block. */
+struct gap_list {
+    unsigned int *blocks;       // Ring buffer of blocks following a gap
+    unsigned int head;          // Index of oldest entry in ring buffer
+    unsigned int count;         // Number of gaps in list
+};
+
+/* Indexed by check_id0 flag. */
+static struct gap_list gap_lists[2];
+
+
+/* Returns true if there is a gap between block and the block before it. */
+static bool block_follows_gap(bool check_id0, unsigned int block)
+{
+    unsigned int N = header->major_block_count;
+    const struct data_index *prev = &data_index[(block + N - 1) % N];
+    const struct data_index *ix = &data_index[block];
+    int64_t delta_t =
+        (int64_t) (ix->timestamp - prev->timestamp - prev->duration);
+    return
+        (check_id0  &&
+            ix->id_zero != prev->id_zero + header->major_sample_count)  ||
+        delta_t < -MAX_DELTA_T  ||  MAX_DELTA_T < delta_t;
+}
+
+
+static unsigned int gap_list_entry(
+    const struct gap_list *list, unsigned int index)
+{
+    return list->blocks[(list->head + index) % header->major_block_count];
+}
+
+
+/* Called with the index sequence lock held as block is completed, just before
+ * it is published.  Any gaps recorded against this block and the following
+ * block are out of date and will be found at the front of the list. */
+static void update_gap_list(bool check_id0, unsigned int block)
+{
+    struct gap_list *list = &gap_lists[check_id0];
+    unsigned int N = header->major_block_count;
+    unsigned int next = (block + 1) % N;
+    while (list->count > 0  &&
+           (list->blocks[list->head] == block  ||
+            list->blocks[list->head] == next))
+    {
+        list->head = (list->head + 1) % N;
+        list->count -= 1;
+    }
+    if (block_follows_gap(check_id0, block))
+    {
+        list->blocks[(list->head + list->count) % N] = block;
+        list->count += 1;
+    }
+}
+
+
+/* Builds the gap lists from the index, taking every block except the current
+ * block in archive order. */
+static void initialise_gap_map(void)
+{
+    unsigned int N = header->major_block_count;
+    for (unsigned int check_id0 = 0; check_id0 < 2; check_id0 ++)
+    {
+        struct gap_list *list = &gap_lists[check_id0];
+        list->blocks = malloc(N * sizeof(unsigned int));
+        list->head = 0;
+        list->count = 0;
+        for (unsigned int i = 1; i < N; i ++)
+        {
+            unsigned int block = (header->current_major_block + i) % N;
+            if (block_follows_gap(check_id0, block))
+            {
+                list->blocks[list->count] = block;
+                list->count += 1;
+            }
+        }
+    }
 }
 
 
+/* Searches for the first gap in the given range of blocks, not counting any gap
+ * before the first block, and returns the number of blocks before the gap.
+ * Called inside a sequence lock read loop.  As blocks in the gap list are in
+ * archive order we can binary search on their age, counted from the oldest
+ * block in the archive. */
+static bool search_gap_list(
+    const struct gap_list *list, unsigned int current,
+    unsigned int start, unsigned int blocks, unsigned int *offset)
+{
+    unsigned int N = header->major_block_count;
+    unsigned int start_age = (start + N - current - 1) % N;
+
+    /* Find the first gap with age greater than start_age. */
+    unsigned int low = 0;
+    unsigned int high = list->count;
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        if ((gap_list_entry(list, mid) + N - current - 1) % N <= start_age)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low < list->count)
+    {
+        unsigned int gap_age =
+            (gap_list_entry(list, low) + N - current - 1) % N;
+        *offset = gap_age - start_age;
+        return *offset < blocks;
+    }
+    else
+        return false;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Event index. */
+
+/* For each major block we record the rising edges of the event bits in the
+ * events FA id.  The record for the block currently being written is updated
+ * in place; readers never look at this block. */
+
+static struct event_block *event_index;     // NULL if archive has no index
+static struct fa_entry last_events;         // Events seen in previous sample
+
+
+static bool events_indexed(void)
+{
+    return event_index != NULL  &&  events_fa_id < header->fa_entry_count;
+}
+
+
+/* Scans the events column of an input block for newly raised event bits. */
+static void index_events(const void *block)
+{
+    if (!events_indexed())
+        return;
+
+    struct event_block *events = &event_index[header->current_major_block];
+    if (fa_offset == 0)
+    {
+        events->count = 0;
+        events->dropped = 0;
+    }
+
+    const struct fa_entry *input =
+        (const struct fa_entry *) block + events_fa_id;
+    for (unsigned int i = 0; i < input_frame_count; i ++)
+    {
+        struct fa_entry rising = {
+            .x = input->x & ~last_events.x,
+            .y = input->y & ~last_events.y };
+        if (rising.x != 0  ||  rising.y != 0)
+        {
+            if (events->count < EVENT_BLOCK_ENTRIES)
+            {
+                events->entries[events->count] = (struct event_entry) {
+                    .offset = fa_offset + i, .events = rising };
+                events->count += 1;
+            }
+            else
+                events->dropped += 1;
+        }
+        last_events = *input;
+        input += header->fa_entry_count;
+    }
+}
+
+
+/* After a gap we can't tell which events are new, so treat all as new. */
+static void reset_events(void)
+{
+    last_events = (struct fa_entry) { .x = 0, .y = 0 };
+}
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Index maintenance. */
@@ -607,6 +810,16 @@ static void flush_index(uint32_t current_block)
     IGNORE(
         TEST_IO(msync(header, DISK_HEADER_SIZE, MS_ASYNC))  &&
         TEST_IO(msync(index_address, page_size, MS_ASYNC)));
+    if (events_indexed())
+    {
+        /* The event record can straddle a page boundary. */
+        void *events_address = (void *) (
+            (uintptr_t) &event_index[current_block] & page_mask);
+        size_t length = (size_t) (
+            (uintptr_t) &event_index[current_block + 1] -
+            (uintptr_t) events_address);
+        IGNORE(TEST_IO(msync(events_address, length, MS_ASYNC)));
+    }
 }
 
 
@@ -633,25 +846,32 @@ static void advance_index(void)
         ((int64_t) timestamp_count * timestamp_count - 1) *
         timestamp_count / 3;
 
-    struct data_index *ix = &data_index[header->current_major_block];
     /* Duration is "slope" calculated from fit above over an interval of
      * 2*timestamp_count. */
-    ix->duration = (uint32_t) (2 * timestamp_count * sum_xt / sum_t2);
+    uint32_t duration = (uint32_t) (2 * timestamp_count * sum_xt / sum_t2);
     /* Starting timestamp is computed at t=-timestamp_count-1 from centre. */
-    ix->timestamp = first_timestamp +
+    uint64_t timestamp = first_timestamp +
         (uint64_t) (
             sum_x / timestamp_count - (timestamp_count + 1) * sum_xt / sum_t2);
-
     /* For the last duration we run an IIR to smooth out the bumps in our
      * timestamp calculations.  This gives us another digit or so. */
-    header->last_duration = (uint32_t) round(
-        ix->duration * header->timestamp_iir +
+    uint32_t last_duration = (uint32_t) round(
+        duration * header->timestamp_iir +
         header->last_duration * (1 - header->timestamp_iir));
 
-    /* All done, advance the block index and reset our index. */
+    /* All done, publish the index entry, advance the block index and reset our
+     * index. */
     uint32_t current_block = header->current_major_block;
+    struct data_index *ix = &data_index[current_block];
+    seq_write_begin(&index_seqlock);
+    ix->duration = duration;
+    ix->timestamp = timestamp;
+    update_gap_list(false, current_block);
+    update_gap_list(true, current_block);
+    header->last_duration = last_duration;
     header->current_major_block =
-        (header->current_major_block + 1) % header->major_block_count;
+        (current_block + 1) % header->major_block_count;
+    seq_write_end(&index_seqlock);
     timestamp_index = 0;
 
     /* Flush index and header to disk. */
@@ -677,16 +897,20 @@ static void initialise_index(void)
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Interlocked access. */
 
+/* All the functions here which read the index are called inside a sequence
+ * lock read loop, and so may see inconsistent data which will be discarded.
+ * They must therefore be safe with any data, and must not report errors. */
+
 /* Binary search to find major block corresponding to timestamp.  Note that the
  * high block is never inspected, which is just as well, as the current block is
  * invariably invalid.
  *     Returns the index of the latest valid block with a starting timestamp no
  * later than the target timestamp.  If the archive is empty may return an
  * invalid index, this is recognised by comparing the result with current. */
-static unsigned int binary_search(uint64_t timestamp, bool *first_block)
+static unsigned int binary_search(
+    unsigned int current, uint64_t timestamp, bool *first_block)
 {
     unsigned int N = header->major_block_count;
-    unsigned int current = header->current_major_block;
     unsigned int start = (current + 1 + INDEX_SKIP) % N;
     unsigned int low = start;
     unsigned int high = current;
@@ -718,9 +942,12 @@ static unsigned int binary_search(uint64_t timestamp, bool *first_block)
 uint64_t timestamp_to_index_ts(uint64_t timestamp)
 {
     uint64_t result;
-    LOCK(transform_lock);
-    result = data_index[binary_search(timestamp, NULL)].timestamp;
-    UNLOCK(transform_lock);
+    unsigned int sequence;
+    do {
+        sequence = seq_read_begin(&index_seqlock);
+        unsigned int current = header->current_major_block;
+        result = data_index[binary_search(current, timestamp, NULL)].timestamp;
+    } while (seq_read_retry(&index_seqlock, sequence));
     return result;
 }
 
@@ -731,10 +958,10 @@ uint64_t timestamp_to_index_ts(uint64_t timestamp)
  * but otherwise (except in the transient case of a completely empty archive)
  * the block is guaranteed to be valid. */
 static void timestamp_to_block(
-    uint64_t timestamp, bool skip_gap, bool *first_block,
+    unsigned int current, uint64_t timestamp, bool skip_gap, bool *first_block,
     unsigned int *block_out, unsigned int *offset)
 {
-    unsigned int block = binary_search(timestamp, first_block);
+    unsigned int block = binary_search(current, timestamp, first_block);
     uint64_t block_start = data_index[block].timestamp;
     unsigned int duration = data_index[block].duration;
     unsigned int block_size = header->major_sample_count;
@@ -767,9 +994,9 @@ static void timestamp_to_block(
 
 /* Computes the number of samples available from the given block:offset to the
  * current end of the archive. */
-static uint64_t compute_samples(unsigned int block, unsigned int offset)
+static uint64_t compute_samples(
+    unsigned int current, unsigned int block, unsigned int offset)
 {
-    unsigned int current = header->current_major_block;
     unsigned int N = header->major_block_count;
     unsigned int block_count =
         current >= block ? current - block : N - block + current;
@@ -782,21 +1009,23 @@ bool timestamp_to_start(
     uint64_t timestamp, bool all_data, uint64_t *samples_available,
     unsigned int *block, unsigned int *offset)
 {
-    bool ok;
-    LOCK(transform_lock);
-
+    unsigned int current;
     bool first_block;
-    timestamp_to_block(timestamp, true, &first_block, block, offset);
-    ok =
-        TEST_OK_(
-            *block != header->current_major_block, "Start time too late")  &&
-        TEST_OK_(all_data  ||  data_index[*block].timestamp <= timestamp,
-            first_block ? "Start time too early" : "Start time in data gap");
-    if (ok)
-        *samples_available = compute_samples(*block, *offset);
+    uint64_t block_start;
+    unsigned int sequence;
+    do {
+        sequence = seq_read_begin(&index_seqlock);
+        current = header->current_major_block;
+        timestamp_to_block(
+            current, timestamp, true, &first_block, block, offset);
+        block_start = data_index[*block].timestamp;
+        *samples_available = compute_samples(current, *block, *offset);
+    } while (seq_read_retry(&index_seqlock, sequence));
 
-    UNLOCK(transform_lock);
-    return ok;
+    return
+        TEST_OK_(*block != current, "Start time too late")  &&
+        TEST_OK_(all_data  ||  block_start <= timestamp,
+            first_block ? "Start time too early" : "Start time in data gap");
 }
 
 
@@ -806,15 +1035,14 @@ bool timestamp_to_end(
 {
     uint64_t end_timestamp;
     unsigned int current;
-
-    LOCK(transform_lock);
-
-    current = header->current_major_block;
-    timestamp_to_block(timestamp, false, NULL, block, offset);
-    struct data_index *ix = &data_index[*block];
-    end_timestamp = ix->timestamp + ix->duration;
-
-    UNLOCK(transform_lock);
+    unsigned int sequence;
+    do {
+        sequence = seq_read_begin(&index_seqlock);
+        current = header->current_major_block;
+        timestamp_to_block(current, timestamp, false, NULL, block, offset);
+        const struct data_index *ix = &data_index[*block];
+        end_timestamp = ix->timestamp + ix->duration;
+    } while (seq_read_retry(&index_seqlock, sequence));
 
     return
         TEST_OK_(all_data  ||  timestamp <= end_timestamp,
@@ -833,26 +1061,87 @@ bool timestamp_to_end(
 
 bool find_gap(bool check_id0, unsigned int *start, unsigned int *blocks)
 {
-    struct data_index *ix = &data_index[*start];
-    uint64_t timestamp = ix->timestamp + ix->duration;
-    uint32_t id_zero   = ix->id_zero + header->major_sample_count;
-    while (*blocks > 1)
-    {
-        *blocks -= 1;
-        *start += 1;
-        if (*start == header->major_block_count)
-            *start = 0;
-
-        ix = &data_index[*start];
-        int64_t delta_t = (int64_t) (ix->timestamp - timestamp);
-        if ((check_id0  &&  ix->id_zero != id_zero)  ||
-            delta_t < -MAX_DELTA_T  ||  MAX_DELTA_T < delta_t)
-            return true;
-
-        timestamp = ix->timestamp + ix->duration;
-        id_zero = ix->id_zero + header->major_sample_count;
-    }
-    return false;
+    const struct gap_list *list = &gap_lists[check_id0];
+    bool found;
+    unsigned int offset = 0;
+    unsigned int sequence;
+    do {
+        sequence = seq_read_begin(&index_seqlock);
+        found = search_gap_list(
+            list, header->current_major_block, *start, *blocks, &offset);
+    } while (seq_read_retry(&index_seqlock, sequence));
+
+    /* If no gap found leave start at the last block. */
+    if (!found)
+        offset = *blocks > 0 ? *blocks - 1 : 0;
+    *start = (*start + offset) % header->major_block_count;
+    *blocks -= offset;
+    return found;
+}
+
+
+bool block_follows_on(unsigned int block)
+{
+    unsigned int N = header->major_block_count;
+    bool follows;
+    unsigned int sequence;
+    do {
+        sequence = seq_read_begin(&index_seqlock);
+        const struct data_index *prev = &data_index[(block + N - 1) % N];
+        follows =
+            data_index[block].id_zero ==
+                prev->id_zero + header->major_sample_count  ||
+            !block_follows_gap(false, block);
+    } while (seq_read_retry(&index_seqlock, sequence));
+    return follows;
+}
+
+
+bool read_event_block(unsigned int block, struct event_block *events)
+{
+    if (!TEST_OK_(events_indexed(), "No event index in archive"))
+        return false;
+
+    bool complete;
+    unsigned int sequence;
+    do {
+        sequence = seq_read_begin(&index_seqlock);
+        complete = block != header->current_major_block;
+        if (complete)
+            *events = event_index[block];
+    } while (seq_read_retry(&index_seqlock, sequence));
+    return TEST_OK_(complete, "Event block not yet complete");
+}
+
+
+bool read_live_block(
+    unsigned int block, unsigned int offset, unsigned int *count,
+    unsigned int id_count, const uint16_t ids[], void *data[],
+    uint32_t *id_zero)
+{
+    bool live;
+    unsigned int copied;
+    unsigned int sequence;
+    do {
+        sequence = seq_read_begin(&block_seqlock);
+        live = block == header->current_major_block;
+        unsigned int visible = __atomic_load_n(&fa_visible, __ATOMIC_ACQUIRE);
+        copied = live  &&  visible > offset ? visible - offset : 0;
+        if (copied > *count)
+            copied = *count;
+        if (copied > 0)
+        {
+            const void *buffer = buffers[current_buffer];
+            *id_zero = data_index[block].id_zero;
+            for (unsigned int i = 0; i < id_count; i ++)
+                memcpy(data[i] + FA_ENTRY_SIZE * offset,
+                    buffer + fa_data_offset(header, offset, ids[i]),
+                    FA_ENTRY_SIZE * copied);
+        }
+    } while (seq_read_retry(&block_seqlock, sequence));
+    if (live)
+        *count = copied;
+    return live;
 }
 
 
@@ -885,6 +1174,7 @@ void process_block(const void *block, uint64_t timestamp)
     if (block)
     {
         index_minor_block(block, timestamp);
+        index_events(block);
         transpose_block(block);
         decimate_block(block);
         bool must_write = advance_block();
@@ -894,20 +1184,23 @@ void process_block(const void *block, uint64_t timestamp)
             double_decimate_block();
         if (must_write)
         {
-            LOCK(transform_lock);
+            /* The write must be scheduled before the index is advanced, and
+             * this may block waiting for the previous write to complete. */
+            retire_block();
             write_major_block();
             advance_index();
-            UNLOCK(transform_lock);
-
-            madvise_double_decimation();
         }
+        else
+            publish_block();
     }
     else
     {
         /* If we see a gap in the block then discard all the work we've done so
          * far. */
+        retire_block();
         reset_block();
         reset_index();
+        reset_events();
         reset_double_decimation();
     }
 }
@@ -915,11 +1208,13 @@ void process_block(const void *block, uint64_t timestamp)
 
 void initialise_transform(
     struct disk_header *header_, struct data_index *data_index_,
-    struct decimated_data *dd_area_, unsigned int events_fa_id_)
+    const struct decimated_data *dd_area_, struct event_block *event_index_,
+    unsigned int events_fa_id_)
 {
     header = header_;
     data_index = data_index_;
     dd_area = dd_area_;
+    event_index = event_index_;
     events_fa_id = events_fa_id_;
 
     input_frame_count =
@@ -930,4 +1225,5 @@ void initialise_transform(
     initialise_double_decimation();
     initialise_io_buffer();
     initialise_index();
+    initialise_gap_map();
 }
@@ -54,10 +54,32 @@ bool timestamp_to_end(
 
 /* Searches a range of index blocks for a gap in the timestamp, returning true
  * iff a gap is found.  *start is updated to the index of the block directly
- * after the first gap and *blocks is decremented accordingly. */
+ * after the first gap and *blocks is decremented accordingly.  Gaps are tracked
+ * as the archive is written, so this takes logarithmic time. */
 bool find_gap(bool check_id0, unsigned int *start, unsigned int *blocks);
+
+/* Returns true if the given index block carries straight on from the block
+ * before it, either because id0 runs on or because the timestamps meet. */
+bool block_follows_on(unsigned int block);
 const struct data_index *__const_ read_index(unsigned int ix);
 
+/* Copies the event record for the given major block.  Fails if the archive has
+ * no event index or if the block is still being written. */
+bool read_event_block(unsigned int block, struct event_block *events);
+
+/* Copies up to *count FA samples starting at offset from the given major block
+ * if it is still being filled by the transform thread, for the archive ids in
+ * ids[], to data[] at their natural offsets.  Returns false if the block is not
+ * being filled, and otherwise updates *count with the number of samples copied,
+ * which is zero if none are available yet.  If any samples are copied *id_zero
+ * is set to the id0 of the first sample of the block as it was when they were
+ * copied: if the block is discarded at a gap and restarted this changes, so
+ * callers must check that id_zero + offset follows on from earlier samples. */
+bool read_live_block(
+    unsigned int block, unsigned int offset, unsigned int *count,
+    unsigned int id_count, const uint16_t ids[], void *data[],
+    uint32_t *id_zero);
+
 /* Returns an unlocked pointer to the header: should only be used to access the
  * constant header fields. */
 const struct disk_header *__const_ get_header(void);
@@ -65,7 +87,8 @@ const struct disk_header *__const_ get_header(void);
 
 void initialise_transform(
     struct disk_header *header, struct data_index *data_index,
-    struct decimated_data *dd_area, unsigned int events_fa_id);
+    const struct decimated_data *dd_area, struct event_block *event_index,
+    unsigned int events_fa_id);
 
 // !!!!!!
 // Not right.  Returns DD data area.
@@ -0,0 +1,378 @@
+/* Transposition of archive data into output lines.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <emmintrin.h>
+
+#include "error.h"
+#include "parse.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "disk.h"
+#include "pool.h"
+
+#include "transpose.h"
+
+
+#define always_inline   inline __attribute__((always_inline))
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* FA data. */
+
+/* A single id is a straight copy, otherwise this is the original loop: the
+ * copy is bound by memory bandwidth, and none of the blocked or vectorised
+ * transpositions measured with benchtranspose improved on it. */
+void fa_write_lines(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset, void *p)
+{
+    struct fa_entry *output = (struct fa_entry *) p;
+    if (field_count == 1)
+        memcpy(output,
+            (struct fa_entry *) read_buffers->buffers[0] + offset,
+            line_count * FA_ENTRY_SIZE);
+    else
+        for (unsigned int l = 0; l < line_count; l ++)
+        {
+            for (unsigned int i = 0; i < field_count; i ++)
+                *output++ =
+                    ((struct fa_entry *) read_buffers->buffers[i])[offset];
+            offset += 1;
+        }
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Decimated data. */
+
+/* Copies the fields of a single decimated sample selected by data_mask.  As
+ * data_mask is a compile time constant in each of the specialised versions
+ * below all the tests are resolved at compile time, and adjacent pairs of
+ * fields are copied as a single 16 byte move. */
+static always_inline struct fa_entry *copy_d_fields(
+    struct fa_entry *output, const struct fa_entry *input,
+    unsigned int data_mask)
+{
+    if ((data_mask & 3) == 3)
+    {
+        _mm_storeu_si128((__m128i *) output,
+            _mm_loadu_si128((const __m128i *) &input[0]));
+        output += 2;
+    }
+    else
+    {
+        if (data_mask & 1)  *output++ = input[0];
+        if (data_mask & 2)  *output++ = input[1];
+    }
+    if ((data_mask & 12) == 12)
+    {
+        _mm_storeu_si128((__m128i *) output,
+            _mm_loadu_si128((const __m128i *) &input[2]));
+        output += 2;
+    }
+    else
+    {
+        if (data_mask & 4)  *output++ = input[2];
+        if (data_mask & 8)  *output++ = input[3];
+    }
+    return output;
+}
+
+static always_inline void d_write_lines_mask(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset, void *p,
+    unsigned int data_mask)
+{
+    struct fa_entry *output = (struct fa_entry *) p;
+    struct decimated_data **input =
+        (struct decimated_data **) read_buffers->buffers;
+    for (unsigned int l = 0; l < line_count; l ++)
+    {
+        /* Each input buffer is an array of decimated_data structures which we
+         * index by offset, but we then cast this to an array of fa_entry
+         * structures to allow the individual fields to be selected by the
+         * data_mask. */
+        for (unsigned int i = 0; i < field_count; i ++)
+            output = copy_d_fields(output,
+                (const struct fa_entry *) &input[i][offset], data_mask);
+        offset += 1;
+    }
+}
+
+
+#define DEFINE_D_WRITE_LINES(data_mask) \
+    static void d_write_lines_##data_mask( \
+        unsigned int line_count, unsigned int field_count, \
+        struct read_buffers *read_buffers, unsigned int offset, void *p) \
+    { \
+        d_write_lines_mask( \
+            line_count, field_count, read_buffers, offset, p, data_mask); \
+    }
+
+DEFINE_D_WRITE_LINES(1)
+DEFINE_D_WRITE_LINES(2)
+DEFINE_D_WRITE_LINES(3)
+DEFINE_D_WRITE_LINES(4)
+DEFINE_D_WRITE_LINES(5)
+DEFINE_D_WRITE_LINES(6)
+DEFINE_D_WRITE_LINES(7)
+DEFINE_D_WRITE_LINES(8)
+DEFINE_D_WRITE_LINES(9)
+DEFINE_D_WRITE_LINES(10)
+DEFINE_D_WRITE_LINES(11)
+DEFINE_D_WRITE_LINES(12)
+DEFINE_D_WRITE_LINES(13)
+DEFINE_D_WRITE_LINES(14)
+DEFINE_D_WRITE_LINES(15)
+
+static const write_lines_t d_write_lines_table[16] = {
+    NULL,
+    d_write_lines_1,  d_write_lines_2,  d_write_lines_3,
+    d_write_lines_4,  d_write_lines_5,  d_write_lines_6,
+    d_write_lines_7,  d_write_lines_8,  d_write_lines_9,
+    d_write_lines_10, d_write_lines_11, d_write_lines_12,
+    d_write_lines_13, d_write_lines_14, d_write_lines_15,
+};
+
+
+write_lines_t d_write_lines(unsigned int data_mask)
+{
+    ASSERT_OK(0 < data_mask  &&  data_mask <= 15);
+    return d_write_lines_table[data_mask];
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Output formats. */
+
+struct formatter {
+    enum output_format format;
+    unsigned int values;            // Number of 32-bit values in a line
+    float scales[];                 // Calibration of each value for floats
+};
+
+
+bool parse_output_format(const char **string, enum output_format *format)
+{
+    *format = FORMAT_INT32;
+    if (read_char(string, 'O'))
+    {
+        if (read_char(string, 'F'))
+            *format = FORMAT_FLOAT;
+        else if (read_char(string, 'S'))
+            *format = FORMAT_SCALED;
+        else
+            return FAIL_("Invalid output format");
+    }
+    return true;
+}
+
+
+struct formatter *create_formatter(
+    enum output_format format, const struct filter_mask *mask,
+    unsigned int fa_entry_count, unsigned int pair_count)
+{
+    if (format == FORMAT_INT32)
+        return NULL;
+
+    unsigned int values =
+        2 * pair_count * count_mask_bits(mask, fa_entry_count);
+    struct formatter *formatter =
+        malloc(sizeof(struct formatter) + values * sizeof(float));
+    formatter->format = format;
+    formatter->values = values;
+
+    /* Every pair of values for an id shares the calibration of the id. */
+    float *scale = formatter->scales;
+    for (unsigned int id = 0; id < fa_entry_count; id ++)
+        if (test_mask_bit(mask, id))
+        {
+            float x_scale, y_scale;
+            get_fa_id_scale(id, &x_scale, &y_scale);
+            for (unsigned int i = 0; i < pair_count; i ++)
+            {
+                *scale++ = x_scale;
+                *scale++ = y_scale;
+            }
+        }
+    return formatter;
+}
+
+
+void destroy_formatter(struct formatter *formatter)
+{
+    free(formatter);
+}
+
+
+size_t format_header_size(const struct formatter *formatter)
+{
+    if (formatter  &&  formatter->format == FORMAT_SCALED)
+        return
+            sizeof(struct scaled_header) + formatter->values * sizeof(int32_t);
+    else
+        return 0;
+}
+
+
+size_t formatted_line_size(const struct formatter *formatter, size_t line_size)
+{
+    if (formatter  &&  formatter->format == FORMAT_SCALED)
+        return line_size / 2;
+    else
+        return line_size;
+}
+
+
+/* Converts each value to float in place, four values at a time. */
+static size_t format_float(
+    const struct formatter *formatter, void *buffer, unsigned int line_count)
+{
+    unsigned int values = formatter->values;
+    const int32_t *input = buffer;
+    float *output = buffer;
+    for (unsigned int l = 0; l < line_count; l ++)
+    {
+        unsigned int i = 0;
+        for (; i + 4 <= values; i += 4)
+            _mm_storeu_ps(&output[i], _mm_mul_ps(
+                _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) &input[i])),
+                _mm_loadu_ps(&formatter->scales[i])));
+        for (; i < values; i ++)
+            output[i] = (float) input[i] * formatter->scales[i];
+        input += values;
+        output += values;
+    }
+    return line_count * values * sizeof(float);
+}
+
+
+/* Chooses an offset for each value at the centre of its range over the block
+ * and a shift which brings the largest excursion from the offset into 16 bits.
+ * The chosen offsets are written to offsets[]. */
+static unsigned int choose_scaling(
+    unsigned int values, const int32_t *input, unsigned int line_count,
+    int32_t offsets[])
+{
+    int32_t low[values], high[values];
+    for (unsigned int i = 0; i < values; i ++)
+    {
+        low[i] = INT32_MAX;
+        high[i] = INT32_MIN;
+    }
+    for (unsigned int l = 0; l < line_count; l ++)
+    {
+        for (unsigned int i = 0; i < values; i ++)
+        {
+            if (input[i] < low[i])   low[i] = input[i];
+            if (input[i] > high[i])  high[i] = input[i];
+        }
+        input += values;
+    }
+
+    int64_t largest = 0;
+    for (unsigned int i = 0; i < values; i ++)
+    {
+        int64_t offset = ((int64_t) low[i] + high[i]) >> 1;
+        /* Only possible if the range spans all 32 bits. */
+        if (high[i] - offset > INT32_MAX)
+            offset += 1;
+        offsets[i] = (int32_t) offset;
+        if (high[i] - offset > largest)
+            largest = high[i] - offset;
+    }
+
+    unsigned int shift = 0;
+    while ((largest >> shift) > INT16_MAX)
+        shift += 1;
+    return shift;
+}
+
+
+/* Writes the scaling header followed by the scaled values.  As each 16-bit
+ * value is written no further forward than the 32-bit value it replaces, we
+ * can convert eight values at a time in place. */
+static size_t format_scaled(
+    const struct formatter *formatter, void *buffer, unsigned int line_count)
+{
+    unsigned int values = formatter->values;
+    size_t header_size = format_header_size(formatter);
+    struct scaled_header *header = buffer;
+    int32_t *offsets = buffer + sizeof(struct scaled_header);
+    const int32_t *input = buffer + header_size;
+    int16_t *output = buffer + header_size;
+
+    unsigned int shift = choose_scaling(values, input, line_count, offsets);
+    header->line_count = line_count;
+    header->shift = shift;
+
+    __m128i shift_count = _mm_cvtsi32_si128((int) shift);
+    for (unsigned int l = 0; l < line_count; l ++)
+    {
+        unsigned int i = 0;
+        for (; i + 8 <= values; i += 8)
+        {
+            __m128i low = _mm_sub_epi32(
+                _mm_loadu_si128((const __m128i *) &input[i]),
+                _mm_loadu_si128((const __m128i *) &offsets[i]));
+            __m128i high = _mm_sub_epi32(
+                _mm_loadu_si128((const __m128i *) &input[i + 4]),
+                _mm_loadu_si128((const __m128i *) &offsets[i + 4]));
+            _mm_storeu_si128((__m128i *) &output[i], _mm_packs_epi32(
+                _mm_sra_epi32(low, shift_count),
+                _mm_sra_epi32(high, shift_count)));
+        }
+        for (; i < values; i ++)
+            output[i] = (int16_t) ((input[i] - offsets[i]) >> shift);
+        input += values;
+        output += values;
+    }
+    return header_size + line_count * values * sizeof(int16_t);
+}
+
+
+size_t format_lines(
+    const struct formatter *formatter, void *buffer,
+    unsigned int line_count, size_t line_size)
+{
+    if (formatter == NULL)
+        return line_count * line_size;
+    else if (formatter->format == FORMAT_FLOAT)
+        return format_float(formatter, buffer, line_count);
+    else
+        return format_scaled(formatter, buffer, line_count);
+}
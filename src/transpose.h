@@ -0,0 +1,102 @@
+/* Transposition of archive data into output lines.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Data is read from the archive as one column of samples for each FA id, and
+ * has to be transposed into lines of samples, one field per id, for sending. */
+
+/* Writes the given lines from a list of buffers to an output buffer:
+ *  line_count      Number of samples to be written
+ *  field_count     Number of FA ids per sample
+ *  read_buffers    Array of buffers, one for each FA id
+ *  offset          Starting offset into buffer of first sample to write
+ *  output          Data buffer to be written to */
+typedef void (*write_lines_t)(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset, void *output);
+
+/* Transposition of FA data. */
+void fa_write_lines(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset, void *output);
+
+/* Returns transposition of decimated data writing only the fields selected by
+ * data_mask, which must be in the range 1 to 15. */
+write_lines_t d_write_lines(unsigned int data_mask);
+
+
+/* Lines are normally sent as 32-bit integers, but can be converted for sending
+ * to one of the following formats:
+ *
+ *  FORMAT_FLOAT    Each field is sent as a 32-bit float multiplied by the
+ *                  calibration of its FA id, see get_fa_id_scale().
+ *  FORMAT_SCALED   Fields are sent as 16-bit integers in blocks of lines, each
+ *                  block preceded by a scaled_header giving the number of
+ *                  lines, a shift for the whole block and an offset for each
+ *                  field in a line.  Each value sent approximates the original
+ *                  as offset + (value << shift), rounded down. */
+enum output_format {
+    FORMAT_INT32,
+    FORMAT_FLOAT,
+    FORMAT_SCALED,
+};
+
+/* The header is followed by a 32-bit offset for each field of a line. */
+struct scaled_header {
+    uint32_t line_count;        // Number of lines in this block
+    uint32_t shift;             // Shift for all fields in this block
+};
+
+struct filter_mask;
+struct formatter;
+
+/* Parses an optional output format specification:
+ *  [ "O" ( "F" | "S" ) ]
+ * for float or scaled data respectively, otherwise FORMAT_INT32. */
+bool parse_output_format(const char **string, enum output_format *format);
+
+/* Creates formatter for lines of pair_count X,Y pairs for each id in mask.
+ * Returns NULL for FORMAT_INT32, as no conversion is needed. */
+struct formatter *create_formatter(
+    enum output_format format, const struct filter_mask *mask,
+    unsigned int fa_entry_count, unsigned int pair_count);
+/* Safe to call with NULL formatter. */
+void destroy_formatter(struct formatter *formatter);
+
+/* Returns the space to be left in front of lines to be formatted. */
+size_t format_header_size(const struct formatter *formatter);
+/* Returns the size of a formatted line given the size of an unformatted line,
+ * not counting any header. */
+size_t formatted_line_size(const struct formatter *formatter, size_t line_size);
+/* Converts line_count lines of size line_size starting format_header_size()
+ * bytes into buffer, writing the result to the start of buffer, and returns
+ * the length of the result.  All three formatting functions accept a NULL
+ * formatter, in which case the data is left unchanged. */
+size_t format_lines(
+    const struct formatter *formatter, void *buffer,
+    unsigned int line_count, size_t line_size);